@@ -0,0 +1,43 @@
+#include "arena.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+void arena_init(Arena *arena, size_t capacity) {
+  capacity = (capacity + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+  void *base = mmap(NULL, capacity, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (base == MAP_FAILED) {
+    fprintf(stderr, "Error reserving %zu byte arena: %s\n", capacity,
+            strerror(errno));
+    exit(1);
+  }
+  *arena = (Arena){base, capacity, 0};
+}
+
+void arena_release(Arena *arena) {
+  if (arena->base != NULL)
+    munmap(arena->base, arena->capacity);
+  *arena = (Arena){NULL, 0, 0};
+}
+
+void *arena_alloc(Arena *arena, size_t size) {
+  size_t offset = arena->offset;
+  size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+  if (size > arena->capacity - offset) {
+    fprintf(stderr, "Error allocating %zu bytes: arena of %zu bytes is full\n",
+            size, arena->capacity);
+    exit(1);
+  }
+  arena->offset = offset + size;
+  return arena->base + offset;
+}
+
+ArenaMark arena_mark(const Arena *arena) { return arena->offset; }
+
+void arena_reset(Arena *arena, ArenaMark mark) {
+  if (mark <= arena->offset)
+    arena->offset = mark;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stddef.h>
+
+#define ARENA_ALIGNMENT 64
+
+typedef struct Arena Arena;
+typedef size_t ArenaMark;
+
+/* A linear allocator over one reserved block of address space. Allocation
+ * bumps an offset; memory is given back all at once by resetting to an
+ * earlier mark. Pages are only backed once they are touched, so the reserve
+ * can be generous, and a reset keeps them around for the next round. */
+struct Arena {
+  unsigned char *base;
+  size_t capacity;
+  size_t offset;
+};
+
+void arena_init(Arena *arena, size_t capacity);
+void arena_release(Arena *arena);
+
+/* size bytes aligned to ARENA_ALIGNMENT; exits when the arena is full */
+void *arena_alloc(Arena *arena, size_t size);
+
+ArenaMark arena_mark(const Arena *arena);
+void arena_reset(Arena *arena, ArenaMark mark);
@@ -0,0 +1,33 @@
+#include "cpu.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *isa_names[CPU_ISA_COUNT] = {"scalar", "sse2", "avx2",
+                                               "avx512"};
+
+CpuIsa cpu_isa_detect(void) {
+#if defined(CPU_X86_SIMD)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f"))
+    return CPU_ISA_AVX512;
+  if (__builtin_cpu_supports("avx2"))
+    return CPU_ISA_AVX2;
+  if (__builtin_cpu_supports("sse2"))
+    return CPU_ISA_SSE2;
+#endif
+  return CPU_ISA_SCALAR;
+}
+
+CpuIsa cpu_isa_parse(const char *name) {
+  for (int i = 0; i < CPU_ISA_COUNT; i++) {
+    if (strcmp(name, isa_names[i]) == 0)
+      return (CpuIsa)i;
+  }
+  fprintf(stderr, "Error: unknown instruction set %s (expected scalar, sse2, "
+                  "avx2 or avx512)\n",
+          name);
+  exit(1);
+}
+
+const char *cpu_isa_name(CpuIsa isa) { return isa_names[isa]; }
@@ -0,0 +1,29 @@
+#pragma once
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) &&        \
+    !defined(RAYCASTER_NO_SIMD)
+#define CPU_X86_SIMD 1
+#include <immintrin.h>
+/* compile one function for an instruction set the rest of the build does not
+ * assume; only call it after cpu_isa_detect() said the CPU has it */
+#define CPU_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+/* Instruction set levels the hot kernels come in. Each kernel is built for
+ * several of them and the best one at or below the active level is picked
+ * once at startup. */
+typedef enum CpuIsa {
+  CPU_ISA_SCALAR = 0,
+  CPU_ISA_SSE2,
+  CPU_ISA_AVX2,
+  CPU_ISA_AVX512, /* AVX-512 F */
+} CpuIsa;
+
+#define CPU_ISA_COUNT 4
+
+/* the best level this CPU supports */
+CpuIsa cpu_isa_detect(void);
+/* parse a --isa argument (scalar, sse2, avx2, avx512); exits on anything
+ * else */
+CpuIsa cpu_isa_parse(const char *name);
+const char *cpu_isa_name(CpuIsa isa);
@@ -11,7 +11,22 @@
 #define TEXTURE_WIDTH 64
 #define TEXTURE_HEIGHT 64
 #define MINIMAP_SCALE_FACTOR 0.3
-#define NUM_TEXTURES 8
 #define FOV_ANGLE (60 * (M_PI / 180))
 
 #define NUM_RAYS WINDOW_WIDTH
+/* the 3D view may be drawn up to this many times smaller on each side */
+#define RENDER_SCALE_MAX 8
+/* an interlaced view draws every column again after the camera moved
+ * further than this since the frame before, or turned further than the
+ * player turns in a frame, give or take this much */
+#define INTERLACE_MAX_STEP (TILE_SIZE / 16)
+#define INTERLACE_TURN_SLACK (2 * FOV_ANGLE / WINDOW_WIDTH)
+
+#define FRAME_ARENA_SIZE (16 << 20)
+/* batches of --stress-jobs a round submits at once, and items per batch */
+#define STRESS_JOB_BATCHES 512
+#define STRESS_JOB_ITEMS 2048
+/* steps --bench-envs runs, and the observation size it draws by default */
+#define BENCH_ENV_STEPS 256
+#define BENCH_ENV_WIDTH 160
+#define BENCH_ENV_HEIGHT 120
@@ -0,0 +1,112 @@
+#include "env.h"
+#include "jobs.h"
+#include "map.h"
+#include "player.h"
+#include "ray.h"
+#include "renderer.h"
+#include "scaler.h"
+#include "texture.h"
+#include "wall.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+void env_batch_init(EnvBatch *batch, const Map *map,
+                    const TextureAtlas *atlas, int count, int width,
+                    int height, ObservationFormat format) {
+  if (count < 1 || width < 1 || height < 1) {
+    fprintf(stderr, "Error: %d environments of %dx%d\n", count, width,
+            height);
+    exit(1);
+  }
+  batch->map = map;
+  batch->count = count;
+  batch->width = width;
+  batch->height = height;
+  batch->format = format;
+  batch->observation_bytes = observation_bytes(format, width, height);
+  batch->steps = 0;
+  RendererConfig config = {width, height, 1, UPSCALE_NEAREST, false,
+                           RAY_ADAPTIVE_STEP};
+  size_t env_bytes = renderer_observer_bytes(&config) +
+                     ray_buffer_bytes(width) + wall_arena_bytes(width, height);
+  arena_init(&batch->arena,
+             (sizeof(Env) + sizeof(RayBuffer) + env_bytes +
+              3 * ARENA_ALIGNMENT) * (size_t)count +
+                 sizeof(int) * atlas->count + ARENA_ALIGNMENT);
+  batch->envs = arena_alloc(&batch->arena, sizeof(Env) * count);
+  batch->rays = arena_alloc(&batch->arena, sizeof(RayBuffer) * count);
+
+  /* every environment draws at the same height, so one set of scalers with
+   * every table already built serves them all, only ever read */
+  int *texture_heights = arena_alloc(&batch->arena, sizeof(int) * atlas->count);
+  for (unsigned i = 0; i < atlas->count; i++)
+    texture_heights[i] = atlas->descriptors[i].height;
+  scaler_cache_init_complete(&batch->scaler, height, texture_heights,
+                             atlas->count);
+
+  for (int i = 0; i < count; i++) {
+    Env *env = &batch->envs[i];
+    /* a piece of the batch's arena, never released on its own */
+    env->arena = (Arena){arena_alloc(&batch->arena, env_bytes), env_bytes, 0};
+    /* the observation is drawn straight into the output, so the renderer
+     * has no color buffer of its own */
+    renderer_init_observer(&env->renderer, map, atlas, &config, &batch->scaler,
+                           &env->arena);
+    batch->rays[i] = ray_buffer_alloc(&env->arena, width);
+    env->step_mark = arena_mark(&env->arena);
+  }
+  /* no environment can see a wall that is not on the map */
+  textures_require(map);
+  fprintf(stderr, "envs: %d at %dx%d %s\n", count, width, height,
+          observation_format_name(format));
+}
+
+void env_batch_release(EnvBatch *batch) {
+  for (int i = 0; i < batch->count; i++)
+    renderer_release(&batch->envs[i].renderer);
+  scaler_cache_release(&batch->scaler);
+  arena_release(&batch->arena);
+  batch->envs = NULL;
+  batch->rays = NULL;
+  batch->count = 0;
+}
+
+static void env_step_job(void *data, int first, int last) {
+  EnvBatch *batch = data;
+  for (int i = first; i < last; i++) {
+    Env *env = &batch->envs[i];
+    Player *player = &batch->players[i];
+    RayBuffer *rays = &batch->rays[i];
+    player->walkDirection = batch->actions[i].walk;
+    player->turnDirection = batch->actions[i].turn;
+    player_update(player, batch->map);
+
+    arena_reset(&env->arena, env->step_mark);
+    cast_all_rays(&env->renderer, player, rays,
+                  &env->renderer.view.history[0]);
+    JobCounter drawn = {0};
+    render_observation(&env->renderer,
+                       batch->out + batch->observation_bytes * i,
+                       batch->format, batch->height, rays, player,
+                       &env->arena, NULL, &drawn);
+    jobs_wait(&drawn);
+  }
+}
+
+void env_batch_step(EnvBatch *batch, Player *players,
+                    const EnvAction *actions, void *out) {
+  /* textures hit last step. Making the batch streamed in every texture on
+   * the map that fits the budget; past it, prefetching around players all
+   * over the map would only evict what the others see. */
+  textures_update(batch->map, batch->rays, batch->count, NULL);
+  textures_wait();
+  batch->players = players;
+  batch->actions = actions;
+  batch->out = out;
+  int num_jobs = ENV_JOBS_PER_THREAD * (jobs_threads() + 1);
+  int grain = (batch->count + num_jobs - 1) / num_jobs;
+  JobCounter stepped = {0};
+  jobs_for(&stepped, NULL, env_step_job, batch, batch->count, grain);
+  jobs_wait(&stepped);
+  batch->steps++;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include "arena.h"
+#include "map.h"
+#include "player.h"
+#include "ray.h"
+#include "renderer.h"
+#include "texture.h"
+#include "wall.h"
+#include <SDL3/SDL_stdinc.h>
+#include <stdint.h>
+
+/* jobs a step is split into per thread, so threads that finish early have
+ * environments left to steal */
+#define ENV_JOBS_PER_THREAD 8
+
+typedef struct EnvAction EnvAction;
+typedef struct Env Env;
+typedef struct EnvBatch EnvBatch;
+
+/* what one environment does in a step, like holding the arrow keys: walk 1
+ * forward or -1 back, turn 1 right or -1 left, 0 for neither */
+struct EnvAction {
+  float walk;
+  float turn;
+};
+
+/* one environment: a renderer whose view is the observation, and a piece
+ * of the batch's arena with that view's ray history and its rays, then what
+ * drawing a step allocates */
+struct Env {
+  Renderer renderer;
+  Arena arena;
+  ArenaMark step_mark; /* past the rays */
+};
+
+/* Many independent players on one level, stepped together without a window.
+ * A step moves every player by its action, casts its rays against its own
+ * ray history and draws its 3D view, without the minimap, into its
+ * observation in the output. Environments are spread over the jobs threads,
+ * and each one's rays and wall columns are jobs as well, so a few large views
+ * keep every thread busy as well as many small ones do. Everything a step
+ * needs is reserved when the batch is made; a step only resets arenas.
+ *
+ * The map and the texture atlas are shared by every environment. Making the
+ * batch streams in the textures of every wall on the map, as many as the
+ * budget holds, and a step waits for whatever it queued before drawing, so
+ * the same players and actions always give the same observations. Only past
+ * the budget are walls drawn in their texture's average color, as the game
+ * draws those not streamed in yet. */
+struct EnvBatch {
+  const Map *map;
+  int count;
+  int width, height; /* of every observation */
+  ObservationFormat format;
+  size_t observation_bytes;
+  Env *envs;
+  RayBuffer *rays; /* each environment's last cast, side by side */
+  Arena arena;     /* envs, rays and the environments' arenas */
+  ScalerCache scaler; /* complete, shared by every environment */
+  uint64_t steps;
+  /* the step in flight */
+  Player *players;
+  const EnvAction *actions;
+  uint8_t *out;
+};
+
+/* count environments drawing width x height observations in format. Call
+ * jobs_init() first: the work is split for as many threads as it started.
+ * Waits for the map's textures, so nothing may draw meanwhile. */
+void env_batch_init(EnvBatch *batch, const Map *map,
+                    const TextureAtlas *atlas, int count, int width,
+                    int height, ObservationFormat format);
+void env_batch_release(EnvBatch *batch);
+
+/* Step every environment i: set the directions of players[i] from
+ * actions[i], move it as the game does, then draw what it sees into
+ * out + i * observation_bytes in the batch's format; out holds count
+ * observations. A step starts with textures_update() for the rays of the
+ * last one, so it must not overlap another step or anything else that
+ * draws. */
+void env_batch_step(EnvBatch *batch, Player *players,
+                    const EnvAction *actions, void *out);
@@ -1,5 +1,7 @@
 #include "graphics.h"
+#include "cpu.h"
 #include "defs.h"
+#include "jobs.h"
 #include <SDL3/SDL_stdinc.h>
 #include <math.h>
 #include <stdio.h>
@@ -29,28 +31,113 @@ SDL_Renderer *initializeRenderer(SDL_Window *window) {
   return renderer;
 }
 
-void clear_color_buffer(Uint32 *color_buffer, Uint32 color) {
-  for (int i = 0; i < WINDOW_WIDTH * WINDOW_HEIGHT; i++)
-    color_buffer[i] = color;
+static void fill_span_scalar(Uint32 *span, Uint32 color, size_t count) {
+  for (size_t i = 0; i < count; i++)
+    span[i] = color;
+}
+
+#if defined(CPU_X86_SIMD)
+CPU_TARGET("sse2")
+static void fill_span_sse2(Uint32 *span, Uint32 color, size_t count) {
+  __m128i v = _mm_set1_epi32(color);
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4)
+    _mm_storeu_si128((__m128i *)(span + i), v);
+  for (; i < count; i++)
+    span[i] = color;
+}
+
+CPU_TARGET("avx2")
+static void fill_span_avx2(Uint32 *span, Uint32 color, size_t count) {
+  __m256i v = _mm256_set1_epi32(color);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8)
+    _mm256_storeu_si256((__m256i *)(span + i), v);
+  if (i < count) {
+    __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256i mask =
+        _mm256_cmpgt_epi32(_mm256_set1_epi32((int)(count - i)), lanes);
+    _mm256_maskstore_epi32((int *)(span + i), mask, v);
+  }
+}
+
+CPU_TARGET("avx512f")
+static void fill_span_avx512(Uint32 *span, Uint32 color, size_t count) {
+  __m512i v = _mm512_set1_epi32(color);
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16)
+    _mm512_storeu_si512(span + i, v);
+  if (i < count)
+    _mm512_mask_storeu_epi32(span + i,
+                             (__mmask16)((1u << (count - i)) - 1), v);
+}
+#endif
+
+static void (*fill_span_kernel)(Uint32 *, Uint32, size_t) = fill_span_scalar;
+
+CpuIsa graphics_use_isa(CpuIsa limit) {
+#if defined(CPU_X86_SIMD)
+  if (limit >= CPU_ISA_AVX512) {
+    fill_span_kernel = fill_span_avx512;
+    return CPU_ISA_AVX512;
+  }
+  if (limit >= CPU_ISA_AVX2) {
+    fill_span_kernel = fill_span_avx2;
+    return CPU_ISA_AVX2;
+  }
+  if (limit >= CPU_ISA_SSE2) {
+    fill_span_kernel = fill_span_sse2;
+    return CPU_ISA_SSE2;
+  }
+#endif
+  (void)limit;
+  fill_span_kernel = fill_span_scalar;
+  return CPU_ISA_SCALAR;
+}
+
+void fill_span(Uint32 *span, Uint32 color, size_t count) {
+  fill_span_kernel(span, color, count);
+}
+
+typedef struct ClearJob {
+  ColorBuffer target;
+  Uint32 color;
+} ClearJob;
+
+static void clear_rows_job(void *data, int first, int last) {
+  ClearJob *job = data;
+  size_t width = job->target.width;
+  fill_span(job->target.pixels + (size_t)first * width, job->color,
+            (size_t)(last - first) * width);
+}
+
+void clear_color_buffer(const ColorBuffer *target, Uint32 color, Arena *arena,
+                        JobCounter *done) {
+  ClearJob *job = arena_alloc(arena, sizeof(ClearJob));
+  *job = (ClearJob){*target, color};
+  jobs_for(done, NULL, clear_rows_job, job, target->height,
+           GRAPHICS_CLEAR_ROWS);
 }
 
 void render_color_buffer(SDL_Renderer *renderer, SDL_Texture *texture,
-                         Uint32 *color_buffer) {
-  SDL_UpdateTexture(texture, NULL, color_buffer, WINDOW_WIDTH * sizeof(Uint32));
+                         const ColorBuffer *target) {
+  if (target != NULL)
+    SDL_UpdateTexture(texture, NULL, target->pixels,
+                      target->width * sizeof(Uint32));
   SDL_RenderTexture(renderer, texture, NULL, NULL);
 }
 
-void draw_rectangle(Uint32 *color_buffer, Uint32 color, int x, int y,
+void draw_rectangle(const ColorBuffer *target, Uint32 color, int x, int y,
                     float width, float height) {
   for (int i = x; i <= x + width; i++) {
     for (int j = y; j <= y + height; j++) {
-      color_buffer[j * (int)WINDOW_WIDTH + i] = color;
+      target->pixels[j * target->width + i] = color;
     }
   }
 }
 
-void draw_line(int x0, int y0, int x1, int y1, Uint32 color,
-               Uint32 *color_buffer) {
+void draw_line(const ColorBuffer *target, int x0, int y0, int x1, int y1,
+               Uint32 color) {
   int delta_x = x1 - x0;
   int delta_y = y1 - y0;
 
@@ -63,8 +150,10 @@ void draw_line(int x0, int y0, int x1, int y1, Uint32 color,
   float current_y = y0;
 
   for (int i = 0; i <= side_length; i++) {
-    color_buffer[(int)round(current_y) * (int)WINDOW_WIDTH + (int)current_x] =
-        color;
+    int y = round(current_y);
+    if (current_x >= 0 && current_x < target->width && y >= 0 &&
+        y < target->height)
+      target->pixels[y * target->width + (int)current_x] = color;
     current_x += x_inc;
     current_y += y_inc;
   }
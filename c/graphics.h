@@ -1,6 +1,9 @@
 #pragma once
 
+#include "arena.h"
+#include "cpu.h"
 #include "defs.h"
+#include "jobs.h"
 #include <SDL3/SDL.h>
 #include <SDL3/SDL_blendmode.h>
 #include <SDL3/SDL_error.h>
@@ -15,12 +18,32 @@
 #include <SDL3/SDL_timer.h>
 #include <SDL3/SDL_video.h>
 
+typedef struct ColorBuffer ColorBuffer;
+
+/* pixels of a frame, width a row and height rows, tightly packed */
+struct ColorBuffer {
+  Uint32 *pixels;
+  int width;
+  int height;
+};
+
 SDL_Window *initializeWindow(void);
 SDL_Renderer *initializeRenderer(SDL_Window *window);
-void clear_color_buffer(Uint32 *color_buffer, Uint32 color);
+/* pick the span fill variant for the best level up to limit, returns it */
+CpuIsa graphics_use_isa(CpuIsa limit);
+/* count contiguous pixels set to color */
+void fill_span(Uint32 *span, Uint32 color, size_t count);
+/* rows cleared per job */
+#define GRAPHICS_CLEAR_ROWS 64
+/* fill target by jobs counted by done, what they fill with allocated from
+ * arena */
+void clear_color_buffer(const ColorBuffer *target, Uint32 color, Arena *arena,
+                        JobCounter *done);
+/* upload target and draw it; NULL draws what was uploaded last */
 void render_color_buffer(SDL_Renderer *renderer, SDL_Texture *texture,
-                         Uint32 *color_buffer);
-void draw_rectangle(Uint32 *color_buffer, Uint32 color, int x, int y,
+                         const ColorBuffer *target);
+void draw_rectangle(const ColorBuffer *target, Uint32 color, int x, int y,
                     float width, float height);
-void draw_line(int x0, int y0, int x1, int y1, Uint32 color,
-               Uint32 *color_buffer);
+/* the part of the line inside target */
+void draw_line(const ColorBuffer *target, int x0, int y0, int x1, int y1,
+               Uint32 color);
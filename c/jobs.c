@@ -0,0 +1,422 @@
+#if defined(__linux__)
+#define _GNU_SOURCE /* sched_getaffinity, sched_setaffinity */
+#include <sched.h>
+#endif
+
+#include "jobs.h"
+#include "arena.h"
+#include <SDL3/SDL_cpuinfo.h>
+#include <SDL3/SDL_mutex.h>
+#include <SDL3/SDL_thread.h>
+#include <SDL3/SDL_timer.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* an idle thread spins 1, 2, 4 ... 2^(rounds - 1) pauses between looks for
+ * work; then a worker goes to sleep and a waiting thread yields its core */
+#define JOBS_SPIN_ROUNDS 10
+
+typedef struct Job {
+  JobFunction run;
+  void *data;
+  int first, last;
+  JobCounter *counter;
+  bool background; /* see jobs_for_background() */
+} Job;
+
+/* the arguments of a jobs_for() held back until after has nothing pending */
+typedef struct JobBatch {
+  JobFunction run;
+  void *data;
+  int count, grain;
+  JobCounter *counter;
+  JobCounter *after;
+  bool background;
+  int releaser; /* once after is done, 1 + the thread to submit it, else 0 */
+} JobBatch;
+
+/* A thread's deque and what it did, each on cache lines of its own. The
+ * utilization counters are only written by the thread itself. */
+typedef struct JobThread {
+  _Alignas(ARENA_ALIGNMENT) SDL_SpinLock lock;
+  int head; /* the front, where thieves take from */
+  int count;
+  Job jobs[JOBS_DEQUE_SIZE];
+  SDL_Thread *thread;
+  Uint64 busy_ns; /* running jobs, not counting jobs run while waiting */
+  uint64_t run;
+  uint64_t stolen;
+} JobThread;
+
+static struct {
+  Arena arena;
+  JobThread *threads; /* [0] is the thread that called jobs_init() */
+  int count;          /* workers + 1 */
+  bool pinned;
+  int cpus[JOBS_MAX_THREADS + 1]; /* the core each thread is pinned to */
+  Uint64 start;
+  SDL_Mutex *lock;
+  SDL_Condition *wake; /* jobs pushed or quit requested */
+  SDL_AtomicInt sleeping;
+  SDL_AtomicInt quit;
+  /* batches held back until their after counter drops to zero */
+  SDL_SpinLock park_lock;
+  JobBatch parked[JOBS_PARKED_MAX];
+  int num_parked;
+} jobs;
+
+static _Thread_local int self;
+static _Thread_local int depth; /* jobs running on this thread, nested */
+
+int jobs_threads(void) { return jobs.count - 1; }
+
+int jobs_self(void) { return self; }
+
+static bool job_push(JobThread *thread, const Job *job) {
+  SDL_LockSpinlock(&thread->lock);
+  bool room = thread->count < JOBS_DEQUE_SIZE;
+  if (room) {
+    thread->jobs[(thread->head + thread->count) % JOBS_DEQUE_SIZE] = *job;
+    thread->count++;
+  }
+  SDL_UnlockSpinlock(&thread->lock);
+  return room;
+}
+
+/* whether a thread waiting on waiting, NULL for a worker looking for
+ * work, may run job; without workers nobody else would */
+static bool job_takes(const Job *job, const JobCounter *waiting) {
+  return !job->background || waiting == NULL || job->counter == waiting ||
+         jobs.count == 1;
+}
+
+/* a background job at the back stays there for someone that takes it */
+static bool job_pop(JobThread *thread, Job *job, const JobCounter *waiting) {
+  SDL_LockSpinlock(&thread->lock);
+  int back = (thread->head + thread->count - 1) % JOBS_DEQUE_SIZE;
+  bool found = thread->count > 0 && job_takes(&thread->jobs[back], waiting);
+  if (found) {
+    thread->count--;
+    *job = thread->jobs[back];
+  }
+  SDL_UnlockSpinlock(&thread->lock);
+  return found;
+}
+
+/* a busy deque is passed over rather than waited for, and so is one with a
+ * background job in front */
+static bool job_steal(JobThread *thread, Job *job,
+                      const JobCounter *waiting) {
+  if (!SDL_TryLockSpinlock(&thread->lock))
+    return false;
+  bool found =
+      thread->count > 0 && job_takes(&thread->jobs[thread->head], waiting);
+  if (found) {
+    *job = thread->jobs[thread->head];
+    thread->head = (thread->head + 1) % JOBS_DEQUE_SIZE;
+    thread->count--;
+  }
+  SDL_UnlockSpinlock(&thread->lock);
+  return found;
+}
+
+/* this thread's own newest job, or else the oldest of the next busy one,
+ * for a thread waiting on waiting, or NULL */
+static bool job_find(Job *job, bool *stolen, const JobCounter *waiting) {
+  *stolen = false;
+  if (job_pop(&jobs.threads[self], job, waiting))
+    return true;
+  for (int i = 1; i < jobs.count; i++) {
+    if (job_steal(&jobs.threads[(self + i) % jobs.count], job, waiting)) {
+      *stolen = true;
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool jobs_queued(void) {
+  for (int i = 0; i < jobs.count; i++) {
+    SDL_LockSpinlock(&jobs.threads[i].lock);
+    int count = jobs.threads[i].count;
+    SDL_UnlockSpinlock(&jobs.threads[i].lock);
+    if (count > 0)
+      return true;
+  }
+  return false;
+}
+
+/* Call after pushing. The fence keeps the push from being seen after the
+ * look at sleeping; with the one in jobs_worker(), either the pusher sees
+ * a worker going to sleep or the worker sees the job. */
+static void jobs_wake(void) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (SDL_GetAtomicInt(&jobs.sleeping) == 0)
+    return;
+  SDL_LockMutex(jobs.lock);
+  SDL_BroadcastCondition(jobs.wake);
+  SDL_UnlockMutex(jobs.lock);
+}
+
+static void job_run(const Job *job, bool stolen);
+
+/* onto this thread's deque, or run right away when it is full */
+static void job_submit(const Job *job) {
+  if (!job_push(&jobs.threads[self], job))
+    job_run(job, false);
+}
+
+/* every job of a batch, grain items each */
+static void batch_submit(const JobBatch *batch) {
+  for (int first = 0; first < batch->count; first += batch->grain) {
+    int last = first + batch->grain < batch->count ? first + batch->grain
+                                                   : batch->count;
+    job_submit(&(Job){batch->run, batch->data, first, last, batch->counter,
+                      batch->background});
+  }
+}
+
+/* take one batch this thread released off the parked ones */
+static bool batch_unpark(JobBatch *batch) {
+  SDL_LockSpinlock(&jobs.park_lock);
+  bool found = false;
+  for (int i = 0; !found && i < jobs.num_parked; i++) {
+    if (jobs.parked[i].releaser == self + 1) {
+      *batch = jobs.parked[i];
+      jobs.parked[i] = jobs.parked[--jobs.num_parked];
+      found = true;
+    }
+  }
+  SDL_UnlockSpinlock(&jobs.park_lock);
+  return found;
+}
+
+/* Count a job of counter's batch as done. The last one drops the counter to
+ * zero under the park lock, so a batch held back for it was either parked
+ * before and is released here, or sees it done; past that the counter may
+ * be gone, as whoever waited on it has returned, and its address reused.
+ * Released batches are marked where they are parked and taken off one at a
+ * time, never compared with counter again. */
+static void job_finish(JobCounter *counter) {
+  while (true) {
+    int pending = SDL_GetAtomicInt(&counter->pending);
+    if (pending > 1) {
+      if (SDL_CompareAndSwapAtomicInt(&counter->pending, pending, pending - 1))
+        return;
+      continue;
+    }
+    bool released = false;
+    SDL_LockSpinlock(&jobs.park_lock);
+    bool last = SDL_CompareAndSwapAtomicInt(&counter->pending, 1, 0);
+    for (int i = 0; last && i < jobs.num_parked; i++) {
+      if (jobs.parked[i].after == counter && jobs.parked[i].releaser == 0) {
+        jobs.parked[i].releaser = self + 1;
+        released = true;
+      }
+    }
+    SDL_UnlockSpinlock(&jobs.park_lock);
+    if (!last)
+      continue;
+    if (released) {
+      JobBatch batch;
+      while (batch_unpark(&batch))
+        batch_submit(&batch);
+      jobs_wake();
+    }
+    return;
+  }
+}
+
+static void job_run(const Job *job, bool stolen) {
+  JobThread *thread = &jobs.threads[self];
+  Uint64 start = depth == 0 ? SDL_GetTicksNS() : 0;
+  depth++;
+  job->run(job->data, job->first, job->last);
+  depth--;
+  if (depth == 0)
+    thread->busy_ns += SDL_GetTicksNS() - start;
+  thread->run++;
+  thread->stolen += stolen;
+  job_finish(job->counter);
+}
+
+/* the cores this process may run on, up to max of them into cpus, returns
+ * how many; 0 where that cannot be told */
+static int jobs_allowed_cpus(int *cpus, int max) {
+  int count = 0;
+#if defined(__linux__)
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) != 0)
+    return 0;
+  for (int cpu = 0; cpu < CPU_SETSIZE && count < max; cpu++) {
+    if (CPU_ISSET(cpu, &set))
+      cpus[count++] = cpu;
+  }
+#else
+  (void)cpus;
+  (void)max;
+#endif
+  return count;
+}
+
+static void jobs_pin(int index) {
+#if defined(__linux__)
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(jobs.cpus[index], &set);
+  if (sched_setaffinity(0, sizeof(set), &set) != 0)
+    fprintf(stderr, "jobs: worker %d left unpinned, core %d refused\n", index,
+            jobs.cpus[index]);
+#else
+  (void)index;
+#endif
+}
+
+static int jobs_worker(void *data) {
+  self = (int)(intptr_t)data;
+  if (jobs.pinned)
+    jobs_pin(self);
+  int rounds = 0;
+  while (SDL_GetAtomicInt(&jobs.quit) == 0) {
+    Job job;
+    bool stolen;
+    if (job_find(&job, &stolen, NULL)) {
+      job_run(&job, stolen);
+      rounds = 0;
+    } else if (rounds < JOBS_SPIN_ROUNDS) {
+      for (int i = 0; i < 1 << rounds; i++)
+        SDL_CPUPauseInstruction();
+      rounds++;
+    } else {
+      /* whoever pushes after the look under the lock sees sleeping and
+       * wakes this thread */
+      SDL_LockMutex(jobs.lock);
+      SDL_AddAtomicInt(&jobs.sleeping, 1);
+      __atomic_thread_fence(__ATOMIC_SEQ_CST);
+      if (!jobs_queued() && SDL_GetAtomicInt(&jobs.quit) == 0)
+        SDL_WaitCondition(jobs.wake, jobs.lock);
+      SDL_AddAtomicInt(&jobs.sleeping, -1);
+      SDL_UnlockMutex(jobs.lock);
+      rounds = 0;
+    }
+  }
+  return 0;
+}
+
+void jobs_init(int threads) {
+  if (threads < 0)
+    threads = 0;
+  if (threads > JOBS_MAX_THREADS)
+    threads = JOBS_MAX_THREADS;
+  jobs.count = threads + 1;
+  arena_init(&jobs.arena,
+             sizeof(JobThread) * (size_t)jobs.count + ARENA_ALIGNMENT);
+  jobs.threads = arena_alloc(&jobs.arena, sizeof(JobThread) * jobs.count);
+  for (int i = 0; i < jobs.count; i++)
+    jobs.threads[i] = (JobThread){0};
+  /* worker i gets the i-th core the process may use; the first is left to
+   * the thread that started them */
+  jobs.pinned = jobs_allowed_cpus(jobs.cpus, jobs.count) == jobs.count;
+  jobs.start = SDL_GetTicksNS();
+  SDL_SetAtomicInt(&jobs.sleeping, 0);
+  SDL_SetAtomicInt(&jobs.quit, 0);
+  jobs.num_parked = 0;
+  self = 0;
+  jobs.lock = SDL_CreateMutex();
+  jobs.wake = SDL_CreateCondition();
+  if (jobs.lock == NULL || jobs.wake == NULL) {
+    fprintf(stderr, "Error starting jobs %s\n", SDL_GetError());
+    exit(1);
+  }
+  for (int i = 1; i < jobs.count; i++) {
+    jobs.threads[i].thread =
+        SDL_CreateThread(jobs_worker, "job worker", (void *)(intptr_t)i);
+    if (jobs.threads[i].thread == NULL) {
+      fprintf(stderr, "Error starting job worker %s\n", SDL_GetError());
+      exit(1);
+    }
+  }
+  fprintf(stderr, "jobs: %d workers%s\n", threads,
+          jobs.pinned && threads > 0 ? ", pinned" : "");
+}
+
+void jobs_shutdown(void) {
+  SDL_LockMutex(jobs.lock);
+  SDL_SetAtomicInt(&jobs.quit, 1);
+  SDL_BroadcastCondition(jobs.wake);
+  SDL_UnlockMutex(jobs.lock);
+  for (int i = 1; i < jobs.count; i++)
+    SDL_WaitThread(jobs.threads[i].thread, NULL);
+
+  Uint64 elapsed = SDL_GetTicksNS() - jobs.start;
+  for (int i = 0; i < jobs.count; i++) {
+    const JobThread *thread = &jobs.threads[i];
+    fprintf(stderr, "jobs: thread %d %.1f%% busy, %llu jobs, %llu stolen\n",
+            i, elapsed > 0 ? 100.0 * thread->busy_ns / elapsed : 0.0,
+            (unsigned long long)thread->run,
+            (unsigned long long)thread->stolen);
+  }
+  SDL_DestroyCondition(jobs.wake);
+  SDL_DestroyMutex(jobs.lock);
+  arena_release(&jobs.arena);
+}
+
+static void jobs_submit_batch(JobCounter *counter, JobCounter *after,
+                              JobFunction run, void *data, int count,
+                              int grain, bool background) {
+  if (count <= 0)
+    return;
+  JobBatch batch = {run, data, count, grain, counter, after, background, 0};
+  SDL_AddAtomicInt(&counter->pending, (count + grain - 1) / grain);
+  if (after != NULL) {
+    /* under the park lock after cannot finish between the look and
+     * parking */
+    SDL_LockSpinlock(&jobs.park_lock);
+    bool pending = SDL_GetAtomicInt(&after->pending) > 0;
+    bool park = pending && jobs.num_parked < JOBS_PARKED_MAX;
+    if (park)
+      jobs.parked[jobs.num_parked++] = batch;
+    SDL_UnlockSpinlock(&jobs.park_lock);
+    if (park)
+      return;
+    /* with every slot taken, this thread helps after along instead */
+    if (pending)
+      jobs_wait(after);
+  }
+  batch_submit(&batch);
+  jobs_wake();
+}
+
+void jobs_for(JobCounter *counter, JobCounter *after, JobFunction run,
+              void *data, int count, int grain) {
+  jobs_submit_batch(counter, after, run, data, count, grain, false);
+}
+
+void jobs_for_background(JobCounter *counter, JobFunction run, void *data,
+                         int count, int grain) {
+  jobs_submit_batch(counter, NULL, run, data, count, grain, true);
+}
+
+void jobs_wait(JobCounter *counter) {
+  int rounds = 0;
+  while (SDL_GetAtomicInt(&counter->pending) > 0) {
+    Job job;
+    bool stolen;
+    if (job_find(&job, &stolen, counter)) {
+      job_run(&job, stolen);
+      rounds = 0;
+      continue;
+    }
+    if (rounds == JOBS_SPIN_ROUNDS) {
+      /* whoever runs the last jobs may be waiting for this core */
+      SDL_DelayNS(0);
+      continue;
+    }
+    for (int i = 0; i < 1 << rounds; i++)
+      SDL_CPUPauseInstruction();
+    rounds++;
+  }
+}
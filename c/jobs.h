@@ -0,0 +1,53 @@
+#pragma once
+
+#include <SDL3/SDL_atomic.h>
+
+/* worker threads at most, besides the thread that starts them */
+#define JOBS_MAX_THREADS 15
+/* jobs a thread's deque holds; past that, submitting runs jobs in place */
+#define JOBS_DEQUE_SIZE 1024
+/* batches held back for another at once; past that, submitting one waits
+ * for what it is held back for, running jobs meanwhile */
+#define JOBS_PARKED_MAX 256
+
+/* a job covers items [first, last) of whatever data points to */
+typedef void (*JobFunction)(void *data, int first, int last);
+
+/* Counts the jobs of a batch that have not finished. A zeroed counter has
+ * nothing pending, and a counter may be reused once it drops to zero. */
+typedef struct JobCounter {
+  SDL_AtomicInt pending;
+} JobCounter;
+
+/* Work-stealing scheduler shared by the frame stages. Every thread, the one
+ * that called jobs_init() included, has a deque of jobs: it pushes and pops
+ * at the back, and a thread out of work steals from the front of another's,
+ * oldest first, so large batches spread out while each thread keeps working
+ * on what it just made. A thread waiting on a counter runs jobs until the
+ * counter drops to zero, so batches may be submitted and waited on from
+ * inside jobs. Idle workers spin with backoff, then sleep until work comes.
+ */
+
+/* start threads workers, pinned to a core each when there are enough; with
+ * 0 every job runs on the thread that waits for it */
+void jobs_init(int threads);
+/* log how busy every thread was, then end the workers */
+void jobs_shutdown(void);
+int jobs_threads(void);
+/* 0 on the thread that called jobs_init(), 1 to jobs_threads() on the
+ * workers */
+int jobs_self(void);
+
+/* split [0, count) into jobs of grain items, the last one shorter, counted
+ * by counter. With after, they are held back until after has nothing
+ * pending. */
+void jobs_for(JobCounter *counter, JobCounter *after, JobFunction run,
+              void *data, int count, int grain);
+/* as jobs_for(), for work that runs alongside the thread that submits it:
+ * a thread waiting on another counter leaves these jobs to the workers,
+ * and runs them only once it waits on counter itself. Without workers they
+ * run wherever they are found. */
+void jobs_for_background(JobCounter *counter, JobFunction run, void *data,
+                         int count, int grain);
+/* run jobs until counter has nothing pending */
+void jobs_wait(JobCounter *counter);
@@ -1,5 +1,4 @@
 #include "player.h"
-#include "upng.h"
 #include <SDL3/SDL.h>
 #include <SDL3/SDL_blendmode.h>
 #include <SDL3/SDL_error.h>
@@ -13,95 +12,428 @@
 #include <SDL3/SDL_stdinc.h>
 #include <SDL3/SDL_timer.h>
 #include <SDL3/SDL_video.h>
-#include <assert.h>
 #include <float.h>
 #include <math.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
-#include <sys/mman.h>
+#include <string.h>
 
+#include "arena.h"
+#include "cpu.h"
 #include "defs.h"
+#include "env.h"
 #include "graphics.h"
+#include "jobs.h"
 #include "map.h"
 #include "ray.h"
+#include "renderer.h"
+#include "texture.h"
+#include "tile.h"
+#include "upng.h"
+#include "upscale.h"
+#include "wall.h"
 
-upng_t *textures[8];
-
-void render_3D_projections(Uint32 *color_buffer, Ray *rays, Player *player) {
-  for (int i = 0; i < NUM_RAYS; i++) {
-    float distance =
-        rays[i].distance * cos(rays[i].rayAngle - player->rotationAngle);
-    float distance_to_projection_plane =
-        (WINDOW_WIDTH / 2) / tan(FOV_ANGLE / 2);
-    float wall_strip_height =
-        (TILE_SIZE / distance) * distance_to_projection_plane;
-
-    float shade = wall_strip_height / WINDOW_HEIGHT;
-    int y_start = WINDOW_HEIGHT / 2 - wall_strip_height / 2;
-    if (y_start < 0)
-      y_start = 0;
-    int y_end = y_start + wall_strip_height;
-    if (y_end >= WINDOW_HEIGHT)
-      y_end = WINDOW_HEIGHT - 1;
-    int texture_width = upng_get_width(textures[rays[i].wallHitContent - 1]);
-    int texture_height = upng_get_height(textures[rays[i].wallHitContent - 1]);
-    int texture_offset_x = rays[i].wasHitVertical
-                               ? (int)(rays[i].wallHitY) % (int)TILE_SIZE
-                               : (int)(rays[i].wallHitX) % (int)TILE_SIZE;
-
-    for (int x = i * WALL_STRIP_WIDTH;
-         x < i * WALL_STRIP_WIDTH + WALL_STRIP_WIDTH; x++) {
-      for (int j = 0; j < y_start; j++) {
-        color_buffer[j * (int)WINDOW_WIDTH + x] = 0xFFA9A9A9;
-      }
-      for (int y = y_start; y < y_end; y++) {
-        int texture_offset_y =
-            (y + (wall_strip_height / 2 - WINDOW_HEIGHT / 2)) *
-            ((float)texture_height / wall_strip_height);
-        uint32_t texel = ((uint32_t *)upng_get_buffer(
-            textures[rays[i].wallHitContent -
-                     1]))[texture_width * texture_offset_y + texture_offset_x];
-        color_buffer[y * (int)WINDOW_WIDTH + x] =
-            texel + ((int)(0xFF000000 * shade) & (0xFF000000));
-      }
-      for (int j = y_end; j < WINDOW_HEIGHT; j++) {
-        color_buffer[j * (int)WINDOW_WIDTH + x] = 0xFF2F4F4F;
-      }
-    }
+/* select every kernel variant for the best level up to isa and log them */
+static void use_isa(CpuIsa isa) {
+  static const char *unfilter_names[] = {"scalar", "sse2", "ssse3", "avx2"};
+  upng_simd unfilter = upng_set_simd_limit(
+      isa >= CPU_ISA_AVX2   ? UPNG_SIMD_AVX2
+      : isa >= CPU_ISA_SSE2 ? UPNG_SIMD_SSE2
+                            : UPNG_SIMD_NONE);
+  CpuIsa rays = ray_use_isa(isa);
+  CpuIsa walls = wall_use_isa(isa);
+  CpuIsa spans = graphics_use_isa(isa);
+  CpuIsa upscaler = upscale_use_isa(isa);
+  /* each kernel at the level it runs at, which may be below isa: the march
+   * and the unfilter stop at AVX2, and the rest of the ray caster is scalar
+   * throughout */
+  fprintf(stderr,
+          "kernels: up to %s; ray march %s, wall strips %s, observations %s, "
+          "span fill %s, upscaler %s, png unfilter %s\n",
+          cpu_isa_name(isa), cpu_isa_name(rays), cpu_isa_name(walls),
+          wall_observation_variant(), cpu_isa_name(spans),
+          cpu_isa_name(upscaler), unfilter_names[unfilter]);
+}
+
+typedef struct FrameStats {
+  uint64_t rendered;
+  uint64_t skipped;
+  uint64_t rays_cast;
+  uint64_t rays_marched;
+} FrameStats;
+
+/* step count environments for BENCH_ENV_STEPS steps without a window, log
+ * how fast, and a hash of the last observations to compare runs by. The
+ * players start from the game's pose facing every way, and each walks and
+ * turns in its own fixed pattern. */
+static void bench_envs(const Map *map, const TextureAtlas *atlas, int count,
+                       int width, int height, ObservationFormat format) {
+  EnvBatch batch;
+  env_batch_init(&batch, map, atlas, count, width, height, format);
+  Arena arena;
+  size_t bytes = batch.observation_bytes * count;
+  arena_init(&arena, sizeof(Player) * count + sizeof(EnvAction) * count +
+                         bytes + 3 * ARENA_ALIGNMENT);
+  Player *players = arena_alloc(&arena, sizeof(Player) * count);
+  EnvAction *actions = arena_alloc(&arena, sizeof(EnvAction) * count);
+  uint8_t *out = arena_alloc(&arena, bytes);
+  for (int i = 0; i < count; i++)
+    players[i] = (Player){WINDOW_WIDTH / 2, WINDOW_HEIGHT / 2, TILE_SIZE,
+                          TILE_SIZE, 0, 0, 2 * M_PI * i / count, 1,
+                          1 * (M_PI / 180)};
+
+  Uint64 start = SDL_GetTicksNS();
+  for (int step = 0; step < BENCH_ENV_STEPS; step++) {
+    for (int i = 0; i < count; i++)
+      actions[i] = (EnvAction){(step / 64 + i) % 3 - 1.0f,
+                               (step / 16 + 2 * i) % 3 - 1.0f};
+    env_batch_step(&batch, players, actions, out);
+  }
+  double seconds = (SDL_GetTicksNS() - start) / 1e9;
+
+  uint64_t hash = 14695981039346656037ull;
+  for (size_t i = 0; i < bytes; i++)
+    hash = (hash ^ out[i]) * 1099511628211ull;
+  fprintf(stderr,
+          "envs: %d steps in %.3f s, %.0f environment steps/s, "
+          "observations %016llx\n",
+          BENCH_ENV_STEPS, seconds,
+          seconds > 0 ? (double)count * BENCH_ENV_STEPS / seconds : 0.0,
+          (unsigned long long)hash);
+  arena_release(&arena);
+  env_batch_release(&batch);
+}
+
+/* One batch of --stress-jobs: three stages over the same items, each held
+ * back until the one before has finished. */
+typedef struct StressBatch {
+  int *items;
+  SDL_AtomicInt errors;
+} StressBatch;
+
+static void stress_fill_job(void *data, int first, int last) {
+  StressBatch *batch = data;
+  for (int i = first; i < last; i++)
+    batch->items[i] = i;
+}
+
+static void stress_add_job(void *data, int first, int last) {
+  StressBatch *batch = data;
+  for (int i = first; i < last; i++)
+    batch->items[i] += 1;
+}
+
+static void stress_check_job(void *data, int first, int last) {
+  StressBatch *batch = data;
+  for (int i = first; i < last; i++) {
+    if (batch->items[i] != i + 1)
+      SDL_AddAtomicInt(&batch->errors, 1);
   }
 }
 
-void render(SDL_Renderer *renderer, SDL_Texture *texture, Uint32 *color_buffer,
-            Player *player, Ray *rays) {
-  SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
-  SDL_RenderClear(renderer);
+static void stress_batch_job(void *data, int first, int last) {
+  StressBatch *batches = data;
+  for (int b = first; b < last; b++) {
+    JobCounter filled = {0}, added = {0}, checked = {0};
+    jobs_for(&filled, NULL, stress_fill_job, &batches[b], STRESS_JOB_ITEMS,
+             64);
+    jobs_for(&added, &filled, stress_add_job, &batches[b], STRESS_JOB_ITEMS,
+             64);
+    jobs_for(&checked, &added, stress_check_job, &batches[b],
+             STRESS_JOB_ITEMS, 64);
+    jobs_wait(&checked);
+  }
+}
 
-  render_color_buffer(renderer, texture, color_buffer);
-  clear_color_buffer(color_buffer, 0xFF00EE30);
+/* run rounds of STRESS_JOB_BATCHES batches at once from jobs, more than
+ * can be held back together, and exit with an error if any stage ran
+ * before the one it waits on */
+static void stress_jobs(int rounds) {
+  Arena arena;
+  arena_init(&arena, sizeof(StressBatch) * STRESS_JOB_BATCHES +
+                         sizeof(int) * STRESS_JOB_ITEMS * STRESS_JOB_BATCHES +
+                         (STRESS_JOB_BATCHES + 1) * ARENA_ALIGNMENT);
+  StressBatch *batches =
+      arena_alloc(&arena, sizeof(StressBatch) * STRESS_JOB_BATCHES);
+  for (int b = 0; b < STRESS_JOB_BATCHES; b++)
+    batches[b].items = arena_alloc(&arena, sizeof(int) * STRESS_JOB_ITEMS);
+  int errors = 0;
+  for (int round = 0; round < rounds; round++) {
+    for (int b = 0; b < STRESS_JOB_BATCHES; b++)
+      SDL_SetAtomicInt(&batches[b].errors, 0);
+    JobCounter done = {0};
+    jobs_for(&done, NULL, stress_batch_job, batches, STRESS_JOB_BATCHES, 1);
+    jobs_wait(&done);
+    for (int b = 0; b < STRESS_JOB_BATCHES; b++)
+      errors += SDL_GetAtomicInt(&batches[b].errors);
+  }
+  arena_release(&arena);
+  if (errors > 0) {
+    fprintf(stderr, "Error: jobs stress saw %d items out of order\n", errors);
+    exit(1);
+  }
+  fprintf(stderr, "jobs: stress passed, %d rounds of %d batches\n", rounds,
+          STRESS_JOB_BATCHES);
+}
 
-  render_3D_projections(color_buffer, rays, player);
-  render_map(color_buffer);
-  render_rays(color_buffer, 0xFFFF0000, rays, player);
-  SDL_RenderPresent(renderer);
+/* save map to path and load it back, which validates it, and exit with an
+ * error unless the image loaded is the one saved */
+static void check_map_round_trip(const Map *map, const char *path) {
+  map_save(map, path);
+  Map loaded = {0};
+  map_load(&loaded, path);
+  if (loaded.header->file_size != map->header->file_size ||
+      memcmp(loaded.header, map->header, map->header->file_size) != 0) {
+    fprintf(stderr, "Error: map %s does not load as it was saved\n", path);
+    exit(1);
+  }
+  fprintf(stderr, "map: round trip passed, %dx%d through %s\n",
+          map_num_rows(&loaded), map_num_cols(&loaded), path);
+  map_unload(&loaded);
 }
 
-void update(Player *player, Ray *rays) {
-  player->rotationAngle += player->turnDirection * player->turnSpeed;
-  float move_step = player->walkDirection * player->walkSpeed;
+/* The color buffer reaches the screen one frame late: each frame uploads
+ * what the one before drew. pending_upload says whether the buffer holds a
+ * frame that has not been uploaded yet. draw holds the phases of the view to
+ * draw, one bit each, with rays for every phase; with none nothing new is
+ * drawn and the buffer is not touched. */
+void render(SDL_Renderer *sdl_renderer, SDL_Texture *texture,
+            Renderer *renderer, Player *player, const RayBuffer *rays,
+            unsigned draw, Arena *frame_arena, bool *pending_upload) {
+  SDL_SetRenderDrawColor(sdl_renderer, 0, 0, 0, 255);
+  SDL_RenderClear(sdl_renderer);
 
-  float new_x = player->x + move_step * cos(player->rotationAngle);
-  float new_y = player->y + move_step * sin(player->rotationAngle);
-  if (map_content((int)(new_y / TILE_SIZE), (int)(new_x / TILE_SIZE)) == 0) {
-    player->x = new_x;
-    player->y = new_y;
+  render_color_buffer(sdl_renderer, texture,
+                      *pending_upload ? &renderer->target : NULL);
+  *pending_upload = false;
+  if (draw != 0) {
+    renderer_draw(renderer, rays, draw, player, frame_arena);
+    *pending_upload = true;
   }
-  cast_all_rays(player, rays);
+  SDL_RenderPresent(sdl_renderer);
 }
 
-int main(void) {
+/* One frame from the player's pose to the rays it is drawn from. Frames are
+ * prepared into a ring of two slots, so the next one can be cast as a job
+ * while the main thread draws and presents this one. */
+typedef struct FrameSlot {
+  Arena arena; /* the frame's rays and what drawing it allocates */
+  Player player;
+  RayBuffer rays[2]; /* one per phase of the view, owned by the slot */
+  unsigned cast;     /* the phases cast for this frame, one bit each */
+  FrameKey key;
+  uint64_t rays_cast;
+  uint64_t rays_marched;
+} FrameSlot;
+
+/* What preparing frames carries over from one to the next. It owns the
+ * player and the view's ray histories, phase bookkeeping included. */
+typedef struct FramePrep {
+  Renderer *renderer;
+  Player *player;
+  FrameKey last;
+  bool have_last;
+  FrameSlot *slot; /* the slot the next frame goes into */
+} FramePrep;
+
+/* move the player and cast what changed into prep->slot */
+static void frame_prepare(FramePrep *prep) {
+  FrameSlot *slot = prep->slot;
+  Renderer *renderer = prep->renderer;
+  View *view = &renderer->view;
+  arena_reset(&slot->arena, 0);
+  player_update(prep->player, renderer->map);
+  slot->player = *prep->player;
+  FrameKey key = {slot->player.x, slot->player.y, slot->player.rotationAngle,
+                  map_revision(renderer->map), 0};
+  /* the same pose on the same level casts the same rays as last time */
+  bool same_scene = prep->have_last && key.x == prep->last.x &&
+                    key.y == prep->last.y &&
+                    key.rotation == prep->last.rotation &&
+                    key.map_revision == prep->last.map_revision;
+  unsigned all = (1u << view->phases) - 1;
+  unsigned cast = 0;
+  if (!same_scene)
+    cast = renderer_phases_to_draw(renderer, &slot->player,
+                                   prep->have_last ? &prep->last : NULL);
+  else if (view->stale)
+    cast = 1u << view->next_phase;
+  slot->rays_cast = slot->rays_marched = 0;
+  for (int phase = 0; phase < view->phases; phase++) {
+    RayHistory *history = &view->history[phase];
+    slot->rays[phase] =
+        ray_buffer_alloc_columns(&slot->arena, history->rays.layout);
+    if ((cast & (1u << phase)) == 0) {
+      /* the history is cast into again while this frame is drawn */
+      ray_buffer_copy(&slot->rays[phase], &history->rays);
+      continue;
+    }
+    cast_all_rays(renderer, &slot->player, &slot->rays[phase], history);
+    slot->rays_cast += slot->rays[phase].count;
+    slot->rays_marched += history->marched;
+  }
+  if (cast != 0) {
+    if (cast != all)
+      view->next_phase = cast == 1u ? 1 : 0;
+    view->stale = renderer_is_stale(renderer, &slot->player);
+  }
+  slot->cast = cast;
+  slot->key = key;
+  prep->last = key;
+  prep->have_last = true;
+}
+
+static void frame_prepare_job(void *data, int first, int last) {
+  (void)first;
+  (void)last;
+  frame_prepare(data);
+}
+
+int main(int argc, char **argv) {
+  const char *map_path = NULL;
+  const char *export_map_path = NULL;
+  const char *check_map_path = NULL;
+  const char *texture_list_path = NULL;
+  CpuIsa isa = cpu_isa_detect();
+  int ray_step = RAY_ADAPTIVE_STEP;
+  int render_scale = 1;
+  bool interlace = false;
+  bool pipeline = false;
+  int threads = SDL_GetNumLogicalCPUCores() - 1;
+  UpscaleFilter upscale_filter = UPSCALE_NEAREST;
+  int bench_env_count = 0;
+  int stress_rounds = 0;
+  bool hash_textures = false;
+  int env_width = BENCH_ENV_WIDTH, env_height = BENCH_ENV_HEIGHT;
+  ObservationFormat env_format = OBSERVATION_RGBA;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--export-map") == 0 && i + 1 < argc) {
+      export_map_path = argv[++i];
+    } else if (strcmp(argv[i], "--check-map") == 0 && i + 1 < argc) {
+      check_map_path = argv[++i];
+    } else if (strcmp(argv[i], "--textures") == 0 && i + 1 < argc) {
+      texture_list_path = argv[++i];
+    } else if (strcmp(argv[i], "--hash-textures") == 0) {
+      hash_textures = true;
+    } else if (strcmp(argv[i], "--isa") == 0 && i + 1 < argc) {
+      /* never above what the CPU supports */
+      CpuIsa requested = cpu_isa_parse(argv[++i]);
+      if (requested < isa)
+        isa = requested;
+    } else if (strcmp(argv[i], "--ray-step") == 0 && i + 1 < argc) {
+      ray_step = atoi(argv[++i]);
+      if (ray_step < 1 || (ray_step & (ray_step - 1)) != 0) {
+        fprintf(stderr, "Error: --ray-step takes a power of two\n");
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--render-scale") == 0 && i + 1 < argc) {
+      render_scale = atoi(argv[++i]);
+      if (render_scale < 1 || render_scale > RENDER_SCALE_MAX) {
+        fprintf(stderr, "Error: --render-scale takes 1 to %d\n",
+                RENDER_SCALE_MAX);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--interlace") == 0) {
+      interlace = true;
+    } else if (strcmp(argv[i], "--serial") == 0) {
+      pipeline = false;
+    } else if (strcmp(argv[i], "--pipelined") == 0) {
+      pipeline = true;
+    } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      threads = atoi(argv[++i]);
+      if (threads < 0 || threads > JOBS_MAX_THREADS) {
+        fprintf(stderr, "Error: --threads takes 0 to %d\n", JOBS_MAX_THREADS);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--bench-envs") == 0 && i + 1 < argc) {
+      bench_env_count = atoi(argv[++i]);
+      if (bench_env_count < 1) {
+        fprintf(stderr, "Error: --bench-envs takes a count\n");
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--stress-jobs") == 0 && i + 1 < argc) {
+      stress_rounds = atoi(argv[++i]);
+      if (stress_rounds < 1) {
+        fprintf(stderr, "Error: --stress-jobs takes a number of rounds\n");
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--env-size") == 0 && i + 1 < argc) {
+      if (sscanf(argv[++i], "%dx%d", &env_width, &env_height) != 2 ||
+          env_width < 1 || env_height < 1 || env_width > WINDOW_WIDTH ||
+          env_height > WINDOW_HEIGHT) {
+        fprintf(stderr, "Error: --env-size takes WxH, at most %dx%d\n",
+                (int)WINDOW_WIDTH, (int)WINDOW_HEIGHT);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--env-format") == 0 && i + 1 < argc) {
+      env_format = observation_format_parse(argv[++i]);
+    } else if (strcmp(argv[i], "--upscale") == 0 && i + 1 < argc) {
+      upscale_filter = upscale_filter_parse(argv[++i]);
+    } else if (argv[i][0] != '-' && map_path == NULL) {
+      map_path = argv[i];
+    } else {
+      fprintf(stderr,
+              "Usage: %s [--export-map out.rcmap] [--check-map out.rcmap] "
+              "[--textures list.txt] [--hash-textures] "
+              "[--isa scalar|sse2|avx2|avx512] [--ray-step 1|2|4|8...] "
+              "[--render-scale 1-%d] [--upscale nearest|bilinear] "
+              "[--interlace] [--serial|--pipelined] [--threads N] "
+              "[--bench-envs N] [--env-size WxH] "
+              "[--env-format rgba|rgb|gray|depth] "
+              "[--stress-jobs ROUNDS] [map.rcmap]\n",
+              argv[0], RENDER_SCALE_MAX);
+      return 1;
+    }
+  }
+
+  if (stress_rounds > 0) {
+    jobs_init(threads);
+    stress_jobs(stress_rounds);
+    jobs_shutdown();
+    return 0;
+  }
+
+  Map map = {0};
+  map_load(&map, map_path);
+  if (export_map_path != NULL) {
+    map_save(&map, export_map_path);
+    map_unload(&map);
+    return 0;
+  }
+  if (check_map_path != NULL) {
+    check_map_round_trip(&map, check_map_path);
+    map_unload(&map);
+    return 0;
+  }
+  /* every player starts in the middle of the window */
+  if (map_is_wall(&map, tile_trunc(WINDOW_HEIGHT / 2),
+                  tile_trunc(WINDOW_WIDTH / 2))) {
+    fprintf(stderr, "Error loading map %s: the player starts in a wall\n",
+            map_path);
+    return 1;
+  }
+  use_isa(isa);
+  if (hash_textures) {
+    textures_print_hashes(texture_list_path);
+    map_unload(&map);
+    return 0;
+  }
+  TextureAtlas atlas;
+  textures_load(&atlas, texture_list_path);
+  if (bench_env_count > 0) {
+    jobs_init(threads);
+    bench_envs(&map, &atlas, bench_env_count, env_width, env_height,
+               env_format);
+    jobs_shutdown();
+    map_unload(&map);
+    textures_unload(&atlas);
+    return 0;
+  }
+
   SDL_Window *window = initializeWindow();
-  SDL_Renderer *renderer = initializeRenderer(window);
+  SDL_Renderer *sdl_renderer = initializeRenderer(window);
   Player player = {
       WINDOW_WIDTH / 2,
       WINDOW_HEIGHT / 2,
@@ -114,33 +446,38 @@ int main(void) {
       1 * (M_PI / 180),
   };
 
-  Ray *rays = mmap(NULL, sizeof(Ray) * NUM_RAYS, PROT_READ | PROT_WRITE,
-                   MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
-  Uint32 *color_buffer =
-      mmap(NULL, sizeof(Uint32) * (Uint32)WINDOW_WIDTH * (Uint32)WINDOW_HEIGHT,
-           PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
-
-  textures[0] = upng_new_from_file("c/images/redbrick.png");
-  textures[1] = upng_new_from_file("c/images/purplestone.png");
-  textures[2] = upng_new_from_file("c/images/mossystone.png");
-  textures[3] = upng_new_from_file("c/images/graystone.png");
-  textures[4] = upng_new_from_file("c/images/colorstone.png");
-  textures[5] = upng_new_from_file("c/images/bluestone.png");
-  textures[6] = upng_new_from_file("c/images/wood.png");
-  textures[7] = upng_new_from_file("c/images/eagle.png");
-
-  for (int i = 0; i < NUM_TEXTURES; i++) {
-    assert(textures[i] != NULL);
-    upng_decode(textures[i]);
-    assert(upng_get_error(textures[i]) == UPNG_EOK);
-  }
+  Renderer renderer;
+  renderer_init(&renderer, &map, &atlas,
+                &(RendererConfig){WINDOW_WIDTH, WINDOW_HEIGHT, render_scale,
+                                  upscale_filter, interlace, ray_step});
+  int phases = renderer.view.phases;
+  FrameSlot slots[2];
+  for (int i = 0; i < 2; i++)
+    arena_init(&slots[i].arena, FRAME_ARENA_SIZE);
+  FramePrep prep = {&renderer, &player, {0, 0, 0, 0, 0}, false, NULL};
+  int current = 0;
+  JobCounter prepared = {0};
+  jobs_init(threads);
+  /* casting ahead is asked for until it has been measured to pay off, and
+   * only ever does with a worker to cast on */
+  bool pipelined = pipeline && jobs_threads() > 0;
+  bool primed = false;
+  fprintf(stderr, "frames: %s\n",
+          pipelined ? "pipelined, cast one frame ahead" : "serial");
+  FrameKey drawn = {0};
+  bool have_drawn = false;
+  bool pending_upload = true;
+  FrameStats stats = {0, 0, 0, 0};
 
   SDL_Texture *color_buffer_texture = SDL_CreateTexture(
-      renderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STREAMING,
+      sdl_renderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STREAMING,
       WINDOW_WIDTH, WINDOW_HEIGHT);
 
   unsigned int last_frame_ticks = 0;
   while (true) {
+    /* preparing moves the player, so it is done before input changes it */
+    jobs_wait(&prepared);
+
     float delta_time = (SDL_GetTicks() - last_frame_ticks) / 1000.0;
     if (delta_time < 1000.0 / FRAME_RATE) {
       SDL_Delay(1000.0 / FRAME_RATE - delta_time);
@@ -180,17 +517,62 @@ int main(void) {
         }
         break;
       }
+      /* fall through - escape quits */
     case SDL_EVENT_QUIT:
-      munmap(color_buffer,
-             sizeof(Uint32) * (Uint32)WINDOW_WIDTH * (Uint32)WINDOW_HEIGHT);
-      munmap(rays, sizeof(Ray) * NUM_RAYS);
+      fprintf(stderr, "frames: %llu rendered, %llu skipped\n",
+              (unsigned long long)stats.rendered,
+              (unsigned long long)stats.skipped);
+      fprintf(stderr, "rays: %llu cast, %llu marched\n",
+              (unsigned long long)stats.rays_cast,
+              (unsigned long long)stats.rays_marched);
+      jobs_shutdown();
+      for (int i = 0; i < 2; i++)
+        arena_release(&slots[i].arena);
+      renderer_release(&renderer);
+      map_unload(&map);
+      textures_unload(&atlas);
       SDL_DestroyTexture(color_buffer_texture);
-      SDL_DestroyRenderer(renderer);
+      SDL_DestroyRenderer(sdl_renderer);
       SDL_DestroyWindow(window);
       SDL_Quit();
       return 0;
     }
-    update(&player, rays);
-    render(renderer, color_buffer_texture, color_buffer, &player, rays);
+    /* pipelined, the frame drawn now was cast during the last one, and the
+     * next one is cast while this one is drawn */
+    FrameSlot *slot = &slots[current];
+    if (pipelined) {
+      prep.slot = &slots[current ^ 1];
+      /* waits on the drawing jobs leave it to the workers */
+      jobs_for_background(&prepared, frame_prepare_job, &prep, 1, 1);
+      current ^= 1;
+    } else {
+      prep.slot = slot;
+      frame_prepare(&prep);
+    }
+    if (pipelined && !primed) {
+      /* nothing was cast before the first frame */
+      render(sdl_renderer, color_buffer_texture, &renderer, &player, NULL, 0,
+             &slot->arena, &pending_upload);
+      primed = true;
+      continue;
+    }
+
+    textures_update(&map, slot->rays, phases, &slot->player);
+    slot->key.texture_revision = textures_revision();
+    /* newly streamed textures may show in any column */
+    unsigned draw = slot->cast;
+    if (have_drawn && slot->key.texture_revision != drawn.texture_revision)
+      draw = (1u << phases) - 1;
+    render(sdl_renderer, color_buffer_texture, &renderer, &slot->player,
+           slot->rays, draw, &slot->arena, &pending_upload);
+    stats.rays_cast += slot->rays_cast;
+    stats.rays_marched += slot->rays_marched;
+    if (draw != 0) {
+      drawn = slot->key;
+      have_drawn = true;
+      stats.rendered++;
+    } else {
+      stats.skipped++;
+    }
   }
 }
@@ -1,7 +1,15 @@
 #include "map.h"
+#include "renderer.h"
+#include <errno.h>
+#include <fcntl.h>
 #include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-const int map[MAP_NUM_ROWS][MAP_NUM_COLS] = {
+static const int default_map[MAP_NUM_ROWS][MAP_NUM_COLS] = {
     {1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1},
     {1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 1},
     {1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 8, 0, 0, 0, 1},
@@ -16,16 +24,213 @@ const int map[MAP_NUM_ROWS][MAP_NUM_COLS] = {
     {1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 5},
     {1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 5, 5, 5, 5, 5, 5}};
 
-int map_content(int x, int y) { return map[x][y]; }
+static bool solid_bit(const uint64_t *row, uint32_t col) {
+  return (row[col / 64] >> (col % 64)) & 1;
+}
+
+static const char *map_validate(const MapFileHeader *h, size_t size) {
+  if (size < sizeof(MapFileHeader))
+    return "file too small";
+  if (memcmp(h->magic, MAP_FILE_MAGIC, sizeof(h->magic)) != 0)
+    return "bad magic";
+  if (h->version != MAP_FILE_VERSION)
+    return "unsupported version";
+  if (h->file_size != size)
+    return "size mismatch";
+  if (h->rows == 0 || h->cols == 0 || h->solid_stride != (h->cols + 63) / 64)
+    return "bad dimensions";
+  if (h->solid_offset % sizeof(uint64_t) != 0 ||
+      h->solid_offset < sizeof(MapFileHeader) ||
+      (uint64_t)h->solid_offset +
+              (uint64_t)h->rows * h->solid_stride * sizeof(uint64_t) >
+          size)
+    return "bad solid section";
+  if (h->tiles_offset < sizeof(MapFileHeader) ||
+      (uint64_t)h->tiles_offset + (uint64_t)h->rows * h->cols > size)
+    return "bad tiles section";
+
+  /* the player is only kept from walking off the map by walls, so every cell
+   * on its edge must be one */
+  const uint64_t *solid =
+      (const uint64_t *)((const unsigned char *)h + h->solid_offset);
+  for (uint32_t i = 0; i < h->rows; i++) {
+    const uint64_t *row = solid + (uint64_t)i * h->solid_stride;
+    if (!solid_bit(row, 0) || !solid_bit(row, h->cols - 1))
+      return "open border";
+    if (i == 0 || i == h->rows - 1)
+      for (uint32_t j = 1; j < h->cols - 1; j++)
+        if (!solid_bit(row, j))
+          return "open border";
+  }
+
+  /* walls are marched through the bitmask and drawn from the tiles, so the
+   * two must agree on every cell */
+  const uint8_t *tiles = (const uint8_t *)h + h->tiles_offset;
+  for (uint32_t i = 0; i < h->rows; i++) {
+    const uint64_t *row = solid + (uint64_t)i * h->solid_stride;
+    for (uint32_t j = 0; j < h->cols; j++)
+      if (solid_bit(row, j) != (tiles[(uint64_t)i * h->cols + j] != 0))
+        return "solid bitmask does not match the tiles";
+  }
+  return NULL;
+}
+
+/* image is either a read-only mapping of a map file or an anonymous mapping
+ * built from default_map */
+static void map_bind(Map *map, const MapFileHeader *image) {
+  map->header = image;
+  map->revision++;
+  map->rows = image->rows;
+  map->cols = image->cols;
+  map->solid_stride = image->solid_stride;
+  map->solid =
+      (const uint64_t *)((const unsigned char *)image + image->solid_offset);
+  map->tiles = (const uint8_t *)image + image->tiles_offset;
+}
+
+static void map_build_default(Map *map) {
+  uint32_t stride = (MAP_NUM_COLS + 63) / 64;
+  uint32_t solid_offset = sizeof(MapFileHeader);
+  uint32_t tiles_offset =
+      solid_offset + sizeof(uint64_t) * stride * MAP_NUM_ROWS;
+  uint32_t size = tiles_offset + MAP_NUM_ROWS * MAP_NUM_COLS;
+
+  unsigned char *image = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (image == MAP_FAILED) {
+    fprintf(stderr, "Error allocating map: %s\n", strerror(errno));
+    exit(1);
+  }
+
+  MapFileHeader *h = (MapFileHeader *)image;
+  memcpy(h->magic, MAP_FILE_MAGIC, sizeof(h->magic));
+  h->version = MAP_FILE_VERSION;
+  h->rows = MAP_NUM_ROWS;
+  h->cols = MAP_NUM_COLS;
+  h->solid_stride = stride;
+  h->solid_offset = solid_offset;
+  h->tiles_offset = tiles_offset;
+  h->file_size = size;
 
-void render_map(Uint32 *color_buffer) {
+  uint64_t *bits = (uint64_t *)(image + solid_offset);
   for (int i = 0; i < MAP_NUM_ROWS; i++) {
     for (int j = 0; j < MAP_NUM_COLS; j++) {
+      image[tiles_offset + i * MAP_NUM_COLS + j] = default_map[i][j];
+      if (default_map[i][j] != 0)
+        bits[i * stride + j / 64] |= (uint64_t)1 << (j % 64);
+    }
+  }
+  mprotect(image, size, PROT_READ);
+  map_bind(map, h);
+}
+
+/* map the level at path, or the built-in level if path is NULL. Only the
+ * header and the walls on the border are touched here, the rest is paged in
+ * on first access and shared between every process that maps the same
+ * file. */
+void map_load(Map *map, const char *path) {
+  map_unload(map);
+  if (path == NULL) {
+    map_build_default(map);
+    return;
+  }
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Error opening map %s: %s\n", path, strerror(errno));
+    exit(1);
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(MapFileHeader)) {
+    fprintf(stderr, "Error reading map %s: file too small\n", path);
+    exit(1);
+  }
+  void *image = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (image == MAP_FAILED) {
+    fprintf(stderr, "Error mapping map %s: %s\n", path, strerror(errno));
+    exit(1);
+  }
+
+  const char *error = map_validate(image, st.st_size);
+  if (error != NULL) {
+    fprintf(stderr, "Error loading map %s: %s\n", path, error);
+    exit(1);
+  }
+  map_bind(map, image);
+}
+
+void map_save(const Map *map, const char *path) {
+  FILE *file = fopen(path, "wb");
+  if (file == NULL) {
+    fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+    exit(1);
+  }
+  const MapFileHeader *header = map->header;
+  if (fwrite(header, 1, header->file_size, file) != header->file_size ||
+      fclose(file) != 0) {
+    fprintf(stderr, "Error writing map %s\n", path);
+    exit(1);
+  }
+}
+
+void map_unload(Map *map) {
+  if (map->header != NULL)
+    munmap((void *)map->header, map->header->file_size);
+  map->header = NULL;
+  map->solid = NULL;
+  map->tiles = NULL;
+  map->rows = map->cols = map->solid_stride = 0;
+}
+
+int map_num_rows(const Map *map) { return map->rows; }
+
+int map_num_cols(const Map *map) { return map->cols; }
+
+const uint64_t *map_solid_bits(const Map *map) { return map->solid; }
+
+int map_solid_stride(const Map *map) { return map->solid_stride; }
+
+unsigned map_revision(const Map *map) { return map->revision; }
+
+bool map_is_wall(const Map *map, int x, int y) {
+  if ((unsigned)x >= map->rows || (unsigned)y >= map->cols)
+    return true;
+  return (map->solid[x * map->solid_stride + y / 64] >> (y % 64)) & 1;
+}
+
+int map_content(const Map *map, int x, int y) {
+  if ((unsigned)x >= map->rows || (unsigned)y >= map->cols)
+    return 0;
+  return map->tiles[x * map->cols + y];
+}
+
+void map_minimap_extent(const Map *map, int max_width, int max_height,
+                        int *width, int *height) {
+  /* one past the last tile, which draw_rectangle() fills inclusively */
+  *width = (map_num_cols(map) + 1) * TILE_SIZE * MINIMAP_SCALE_FACTOR + 2;
+  *height = (map_num_rows(map) + 1) * TILE_SIZE * MINIMAP_SCALE_FACTOR + 2;
+  if (*width > max_width)
+    *width = max_width;
+  if (*height > max_height)
+    *height = max_height;
+}
+
+void render_map(const Renderer *renderer) {
+  const Map *map = renderer->map;
+  const ColorBuffer *target = &renderer->target;
+  for (int i = 0; i < map_num_rows(map); i++) {
+    for (int j = 0; j < map_num_cols(map); j++) {
       int tile_x = j * TILE_SIZE * MINIMAP_SCALE_FACTOR;
       int tile_y = i * TILE_SIZE * MINIMAP_SCALE_FACTOR;
-      int tile_color = map[i][j] == 0 ? 0xFFFFFFFF : 0x000000FF;
+      int tile_color = map_content(map, i, j) == 0 ? 0xFFFFFFFF : 0x000000FF;
+
+      /* large levels only show the part of the minimap that fits on screen */
+      if (tile_x + TILE_SIZE * MINIMAP_SCALE_FACTOR >= target->width ||
+          tile_y + TILE_SIZE * MINIMAP_SCALE_FACTOR >= target->height)
+        continue;
 
-      draw_rectangle(color_buffer, tile_color, tile_x, tile_y,
+      draw_rectangle(target, tile_color, tile_x, tile_y,
                      TILE_SIZE * MINIMAP_SCALE_FACTOR,
                      TILE_SIZE * MINIMAP_SCALE_FACTOR);
     }
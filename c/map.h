@@ -2,8 +2,73 @@
 
 #include "defs.h"
 #include "graphics.h"
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 
-void render_map(Uint32 *color_buffer);
-int map_content(int x, int y);
+#define MAP_FILE_MAGIC "RCMP"
+#define MAP_FILE_VERSION 1
+
+/* On-disk (and in-memory) level image. All fields are little-endian and every
+ * section offset is relative to the start of the file, so the file can be
+ * mapped and used in place without any parsing:
+ *
+ *   MapFileHeader
+ *   uint64_t solid[rows][solid_stride]  one bit per cell, set for walls
+ *   uint8_t  tiles[rows][cols]          wall content (0 = empty)
+ *
+ * Every cell on the border must be solid, so a map is closed, and a cell is
+ * solid exactly where its tile is not 0.
+ */
+typedef struct MapFileHeader MapFileHeader;
+
+struct MapFileHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t rows;
+  uint32_t cols;
+  uint32_t solid_stride; /* uint64_t words per row of the solid bitmask */
+  uint32_t solid_offset;
+  uint32_t tiles_offset;
+  uint32_t file_size;
+};
+
+/* A bound level. A Map only reads its image, so any number of renderers can
+ * share one; a file-backed image is also shared with every other process
+ * that maps the same file. */
+typedef struct Map Map;
+
+struct Map {
+  const MapFileHeader *header;
+  const uint64_t *solid;
+  const uint8_t *tiles;
+  unsigned rows, cols, solid_stride;
+  unsigned revision;
+};
+
+typedef struct Renderer Renderer;
+
+/* map starts zeroed or holds a level loaded before, which is unloaded */
+void map_load(Map *map, const char *path);
+void map_save(const Map *map, const char *path);
+void map_unload(Map *map);
+
+int map_num_rows(const Map *map);
+int map_num_cols(const Map *map);
+/* cells outside the map are walls too */
+bool map_is_wall(const Map *map, int x, int y);
+/* the solid bitmask with map_solid_stride() words per row, for kernels that
+ * test several cells at once */
+const uint64_t *map_solid_bits(const Map *map);
+int map_solid_stride(const Map *map);
+/* changes whenever a different level is bound, so a frame drawn for one
+ * revision can be kept for as long as it stays current */
+unsigned map_revision(const Map *map);
+
+/* the minimap of the renderer's level into its color buffer */
+void render_map(const Renderer *renderer);
+/* the rectangle from the top left corner of a width x height buffer that the
+ * minimap, and anything drawn on it in level coordinates, stays within */
+void map_minimap_extent(const Map *map, int max_width, int max_height,
+                        int *width, int *height);
+int map_content(const Map *map, int x, int y);
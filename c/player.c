@@ -0,0 +1,16 @@
+#include "player.h"
+#include "map.h"
+#include "tile.h"
+#include <math.h>
+
+void player_update(Player *player, const Map *map) {
+  player->rotationAngle += player->turnDirection * player->turnSpeed;
+  float move_step = player->walkDirection * player->walkSpeed;
+
+  float new_x = player->x + move_step * cos(player->rotationAngle);
+  float new_y = player->y + move_step * sin(player->rotationAngle);
+  if (!map_is_wall(map, tile_trunc(new_y), tile_trunc(new_x))) {
+    player->x = new_x;
+    player->y = new_y;
+  }
+}
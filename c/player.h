@@ -1,6 +1,7 @@
 #pragma once
 
 typedef struct Player Player;
+typedef struct Map Map;
 
 struct Player {
   float x;
@@ -13,3 +14,7 @@ struct Player {
   float walkSpeed;
   float turnSpeed;
 };
+
+/* turn and walk one step as the directions say, unless that walks into a
+ * wall of map */
+void player_update(Player *player, const Map *map);
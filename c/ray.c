@@ -1,7 +1,68 @@
 #include "ray.h"
 #include "defs.h"
 #include "graphics.h"
+#include "jobs.h"
 #include "player.h"
+#include "renderer.h"
+#include "tile.h"
+#include <string.h>
+
+int ray_columns_count(RayColumns layout) {
+  return (layout.columns - layout.first + layout.stride - 1) / layout.stride;
+}
+
+RayBuffer ray_buffer_alloc(Arena *arena, int count) {
+  return ray_buffer_alloc_columns(arena, (RayColumns){count, 0, 1});
+}
+
+size_t ray_buffer_bytes(int count) {
+  size_t padded =
+      (count + RAY_BUFFER_LANES - 1) / RAY_BUFFER_LANES * RAY_BUFFER_LANES;
+  /* six arrays, each rounded up to the arena alignment */
+  return (sizeof(float) * 4 + sizeof(int32_t) + sizeof(uint8_t)) * padded +
+         6 * ARENA_ALIGNMENT;
+}
+
+RayBuffer ray_buffer_alloc_columns(Arena *arena, RayColumns layout) {
+  int count = ray_columns_count(layout);
+  size_t padded =
+      (count + RAY_BUFFER_LANES - 1) / RAY_BUFFER_LANES * RAY_BUFFER_LANES;
+  RayBuffer rays;
+  rays.angle = arena_alloc(arena, sizeof(float) * padded);
+  rays.hitX = arena_alloc(arena, sizeof(float) * padded);
+  rays.hitY = arena_alloc(arena, sizeof(float) * padded);
+  rays.distance = arena_alloc(arena, sizeof(float) * padded);
+  rays.content = arena_alloc(arena, sizeof(int32_t) * padded);
+  rays.side = arena_alloc(arena, sizeof(uint8_t) * padded);
+  rays.count = count;
+  rays.layout = layout;
+  return rays;
+}
+
+void ray_buffer_copy(RayBuffer *dst, const RayBuffer *src) {
+  memcpy(dst->angle, src->angle, sizeof(float) * src->count);
+  memcpy(dst->hitX, src->hitX, sizeof(float) * src->count);
+  memcpy(dst->hitY, src->hitY, sizeof(float) * src->count);
+  memcpy(dst->distance, src->distance, sizeof(float) * src->count);
+  memcpy(dst->content, src->content, sizeof(int32_t) * src->count);
+  memcpy(dst->side, src->side, sizeof(uint8_t) * src->count);
+}
+
+void ray_buffer_merge(RayBuffer *rays, const RayBuffer *phases,
+                      int num_phases) {
+  for (int p = 0; p < num_phases; p++) {
+    const RayBuffer *phase = &phases[p];
+    for (int i = 0; i < phase->count; i++) {
+      int column = phase->layout.first + i * phase->layout.stride;
+      rays->angle[column] = phase->angle[i];
+      rays->hitX[column] = phase->hitX[i];
+      rays->hitY[column] = phase->hitY[i];
+      rays->distance[column] = phase->distance[i];
+      rays->content[column] = phase->content[i];
+      rays->side[column] = phase->side[i];
+    }
+  }
+}
 
 float normalizeAngle(float angle) {
   angle = remainder(angle, M_PI * 2);
@@ -11,129 +72,683 @@ float normalizeAngle(float angle) {
   return angle;
 }
 
-void cast_all_rays(Player *player, Ray *rays) {
-  float projection_plane_distance = (WINDOW_WIDTH / 2) / tan(FOV_ANGLE / 2);
-  for (int ray_id = 0; ray_id < NUM_RAYS; ray_id++) {
-    float newRay =
-        normalizeAngle(player->rotationAngle + atan((ray_id - NUM_RAYS / 2) /
-                                                    projection_plane_distance));
-    bool isRayDown = newRay > 0 && newRay < M_PI;
-    bool isRayRight = newRay < 0.5 * M_PI || newRay > 1.5 * M_PI;
-    bool hit_horizonal, hit_vertical = false;
-
-    // horizontal interception
-    float horizontal_y_intercept =
-        floor(player->y / TILE_SIZE) * TILE_SIZE + (isRayDown ? TILE_SIZE : 0);
-    float horizontal_x_intercept =
-        player->x + (horizontal_y_intercept - player->y) / tan(newRay);
-
-    float horizontal_x_step = TILE_SIZE / tan(newRay);
-    horizontal_x_step *= (!isRayRight && horizontal_x_step > 0 ? -1 : 1);
-    horizontal_x_step *= (isRayRight && horizontal_x_step < 0 ? -1 : 1);
-    float horizontal_y_step = TILE_SIZE * (!isRayDown ? -1 : 1);
-
-    float next_horizontal_touch_x = horizontal_x_intercept;
-    float next_horizontal_touch_y = horizontal_y_intercept;
-
-    float horizontal_wall_hit_x = 0, horizontal_wall_hit_y = 0;
-
-    int horizontal_wall_id_x = 0, horizontal_wall_id_y = 0;
-
-    while (next_horizontal_touch_x >= 0 &&
-           next_horizontal_touch_x <= MAP_NUM_COLS * TILE_SIZE &&
-           next_horizontal_touch_y >= 0 &&
-           next_horizontal_touch_y <= MAP_NUM_ROWS * TILE_SIZE) {
-      if (map_content(
-              (int)floor((next_horizontal_touch_y + (!isRayDown ? -1 : 0)) /
-                         TILE_SIZE),
-              (int)floor(next_horizontal_touch_x / TILE_SIZE)) != 0) {
-        horizontal_wall_hit_x = next_horizontal_touch_x;
-        horizontal_wall_hit_y = next_horizontal_touch_y;
-        horizontal_wall_id_y =
-            (int)((next_horizontal_touch_y - (!isRayDown ? 1 : 0)) / TILE_SIZE);
-        horizontal_wall_id_x = (int)(next_horizontal_touch_x / TILE_SIZE);
-        hit_horizonal = true;
+/* a coordinate of where a ray crosses the line-th grid line of a family
+ * after the one it crosses at first. Marching and intersecting a face both
+ * find a hit this way, in one multiply and one add rather than a running
+ * sum, so they agree to the bit on where a ray meets a face. */
+static inline float ray_line_point(float first, float step, int line) {
+  return first + (float)line * step;
+}
+
+/* Up to RAY_BUFFER_LANES rays stepping across one family of grid lines. The
+ * cell tested at each point is ((y + adjust_y) / TILE_SIZE,
+ * (x + adjust_x) / TILE_SIZE), rounded down when round_down is set and toward
+ * zero otherwise. A march leaves x and y at the hit point of every ray that
+ * hit a wall before it left the map. */
+typedef struct RayMarch RayMarch;
+
+struct RayMarch {
+  float x[RAY_BUFFER_LANES];
+  float y[RAY_BUFFER_LANES];
+  float step_x[RAY_BUFFER_LANES];
+  float step_y[RAY_BUFFER_LANES];
+  float adjust_x[RAY_BUFFER_LANES];
+  float adjust_y[RAY_BUFFER_LANES];
+  int32_t hit[RAY_BUFFER_LANES];
+  int lanes;
+  bool round_down;
+  const Map *map;
+  float map_width;
+  float map_height;
+};
+
+static void march_rays_scalar(RayMarch *march) {
+  for (int lane = 0; lane < march->lanes; lane++) {
+    float x = march->x[lane], y = march->y[lane];
+    march->hit[lane] = false;
+    for (int line = 1; x >= 0 && x <= march->map_width && y >= 0 &&
+                       y <= march->map_height;
+         line++) {
+      float cell_y = y + march->adjust_y[lane];
+      float cell_x = x + march->adjust_x[lane];
+      int row = march->round_down ? tile_floor(cell_y) : tile_trunc(cell_y);
+      int col = march->round_down ? tile_floor(cell_x) : tile_trunc(cell_x);
+      if (map_is_wall(march->map, row, col)) {
+        march->hit[lane] = true;
         break;
-      } else {
-        next_horizontal_touch_x += horizontal_x_step;
-        next_horizontal_touch_y += horizontal_y_step;
       }
+      x = ray_line_point(march->x[lane], march->step_x[lane], line);
+      y = ray_line_point(march->y[lane], march->step_y[lane], line);
     }
+    march->x[lane] = x;
+    march->y[lane] = y;
+  }
+}
 
-    // vertical_interception
-    float vertical_x_intercept =
-        floor(player->x / TILE_SIZE) * TILE_SIZE + (isRayRight ? TILE_SIZE : 0);
-    float vertical_y_intercept =
-        player->y + (vertical_x_intercept - player->x) * tan(newRay);
-
-    float vertical_y_step = TILE_SIZE * tan(newRay);
-    vertical_y_step *= (!isRayDown && vertical_y_step > 0 ? -1 : 1);
-    vertical_y_step *= (isRayDown && vertical_y_step < 0 ? -1 : 1);
-    float vertical_x_step = TILE_SIZE * (!isRayRight ? -1 : 1);
-
-    float next_vertical_touch_x = vertical_x_intercept;
-    float next_vertical_touch_y = vertical_y_intercept;
-
-    float vertical_wall_hit_x = 0;
-    float vertical_wall_hit_y = 0;
-    int vertical_wall_id_x, vertical_wall_id_y = 0;
-
-    while ((next_vertical_touch_x >= 0) &&
-           (next_vertical_touch_x <= MAP_NUM_COLS * TILE_SIZE) &&
-           (next_vertical_touch_y >= 0) &&
-           (next_vertical_touch_y <= MAP_NUM_ROWS * TILE_SIZE)) {
-      if (map_content((int)(next_vertical_touch_y / TILE_SIZE),
-                      (int)((next_vertical_touch_x + (!isRayRight ? -1 : 0)) /
-                            TILE_SIZE)) != 0) {
-        vertical_wall_hit_x = next_vertical_touch_x;
-        vertical_wall_hit_y = next_vertical_touch_y;
-        vertical_wall_id_x =
-            (int)((next_vertical_touch_x - (!isRayRight ? 1 : 0)) / TILE_SIZE);
-        vertical_wall_id_y = (int)(next_vertical_touch_y / TILE_SIZE);
-        hit_vertical = true;
-        break;
+#if defined(CPU_X86_SIMD)
+/* tile_trunc() of 8 whole coordinates: a signed division by the tile size */
+CPU_TARGET("avx2")
+static inline __m256i tile_trunc_avx2(__m256i whole) {
+  __m256i bias = _mm256_and_si256(_mm256_srai_epi32(whole, 31),
+                                  _mm256_set1_epi32(TILE_SIZE_INT - 1));
+  return _mm256_srai_epi32(_mm256_add_epi32(whole, bias), TILE_SHIFT);
+}
+
+/* all lanes step together; a lane drops out when it hits a wall or leaves the
+ * map, and the cells are tested with one gather from the solid bitmask. Cells
+ * are found with shifts, so this is only used for power-of-two tiles. */
+CPU_TARGET("avx2")
+static void march_rays_avx2(RayMarch *march) {
+  __m256 first_x = _mm256_loadu_ps(march->x);
+  __m256 first_y = _mm256_loadu_ps(march->y);
+  __m256 x = first_x, y = first_y, line = _mm256_setzero_ps();
+  __m256 step_x = _mm256_loadu_ps(march->step_x);
+  __m256 step_y = _mm256_loadu_ps(march->step_y);
+  __m256 adjust_x = _mm256_loadu_ps(march->adjust_x);
+  __m256 adjust_y = _mm256_loadu_ps(march->adjust_y);
+  __m256 zero = _mm256_setzero_ps();
+  __m256 width = _mm256_set1_ps(march->map_width);
+  __m256 height = _mm256_set1_ps(march->map_height);
+  __m256i rows = _mm256_set1_epi32(map_num_rows(march->map));
+  __m256i cols = _mm256_set1_epi32(map_num_cols(march->map));
+  __m256i words_per_row =
+      _mm256_set1_epi32(map_solid_stride(march->map) * 2);
+  __m256i minus_one = _mm256_set1_epi32(-1);
+  __m256i one = _mm256_set1_epi32(1);
+  const int *solid = (const int *)map_solid_bits(march->map);
+
+  __m256i active =
+      _mm256_cmpgt_epi32(_mm256_set1_epi32(march->lanes),
+                         _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+  __m256i hit = _mm256_setzero_si256();
+  for (;;) {
+    __m256 inside = _mm256_and_ps(
+        _mm256_and_ps(_mm256_cmp_ps(x, zero, _CMP_GE_OQ),
+                      _mm256_cmp_ps(x, width, _CMP_LE_OQ)),
+        _mm256_and_ps(_mm256_cmp_ps(y, zero, _CMP_GE_OQ),
+                      _mm256_cmp_ps(y, height, _CMP_LE_OQ)));
+    active = _mm256_and_si256(active, _mm256_castps_si256(inside));
+    if (_mm256_testz_si256(active, active))
+      break;
+
+    __m256 cell_y = _mm256_add_ps(y, adjust_y);
+    __m256 cell_x = _mm256_add_ps(x, adjust_x);
+    __m256i row, col;
+    if (march->round_down) {
+      row = _mm256_srai_epi32(_mm256_cvttps_epi32(_mm256_floor_ps(cell_y)),
+                              TILE_SHIFT);
+      col = _mm256_srai_epi32(_mm256_cvttps_epi32(_mm256_floor_ps(cell_x)),
+                              TILE_SHIFT);
+    } else {
+      row = tile_trunc_avx2(_mm256_cvttps_epi32(cell_y));
+      col = tile_trunc_avx2(_mm256_cvttps_epi32(cell_x));
+    }
+
+    __m256i in_map = _mm256_and_si256(
+        _mm256_and_si256(_mm256_cmpgt_epi32(row, minus_one),
+                         _mm256_cmpgt_epi32(rows, row)),
+        _mm256_and_si256(_mm256_cmpgt_epi32(col, minus_one),
+                         _mm256_cmpgt_epi32(cols, col)));
+    in_map = _mm256_and_si256(in_map, active);
+    __m256i word = _mm256_add_epi32(_mm256_mullo_epi32(row, words_per_row),
+                                    _mm256_srli_epi32(col, 5));
+    __m256i bits = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), solid,
+                                               word, in_map, 4);
+    bits = _mm256_and_si256(
+        _mm256_srlv_epi32(bits, _mm256_and_si256(col, _mm256_set1_epi32(31))),
+        one);
+    __m256i wall = _mm256_and_si256(_mm256_cmpeq_epi32(bits, one), in_map);
+
+    hit = _mm256_or_si256(hit, wall);
+    active = _mm256_andnot_si256(wall, active);
+    __m256 step = _mm256_castsi256_ps(active);
+    line = _mm256_blendv_ps(line, _mm256_add_ps(line, _mm256_set1_ps(1)),
+                            step);
+    x = _mm256_blendv_ps(
+        x, _mm256_add_ps(first_x, _mm256_mul_ps(line, step_x)), step);
+    y = _mm256_blendv_ps(
+        y, _mm256_add_ps(first_y, _mm256_mul_ps(line, step_y)), step);
+  }
+  _mm256_storeu_ps(march->x, x);
+  _mm256_storeu_ps(march->y, y);
+  _mm256_storeu_si256((__m256i *)march->hit, _mm256_and_si256(hit, one));
+}
+#endif
+
+static void (*march_rays)(RayMarch *march) = march_rays_scalar;
+
+CpuIsa ray_use_isa(CpuIsa limit) {
+#if defined(CPU_X86_SIMD)
+  if (limit >= CPU_ISA_AVX2 && TILE_SIZE_IS_POW2) {
+    march_rays = march_rays_avx2;
+    return CPU_ISA_AVX2;
+  }
+#endif
+  (void)limit;
+  march_rays = march_rays_scalar;
+  return CPU_ISA_SCALAR;
+}
+
+/* angle of a ray relative to the view direction */
+static double ray_offset(int ray_id, RayColumns layout) {
+  int column = layout.first + ray_id * layout.stride;
+  double projection_plane_distance = (float)((layout.columns / 2.0) /
+                                             tan(FOV_ANGLE / 2));
+  return atan((column - layout.columns / 2.0) / projection_plane_distance);
+}
+
+/* where a ray crosses the first grid line of one family, and the step from
+ * each line to the next. The horizontal lines step y by a whole tile, the
+ * vertical lines x. */
+typedef struct RayIntercept {
+  float x, y;
+  float step_x, step_y;
+} RayIntercept;
+
+static bool ray_is_down(float angle) { return angle > 0 && angle < M_PI; }
+
+static bool ray_is_right(float angle) {
+  return angle < 0.5 * M_PI || angle > 1.5 * M_PI;
+}
+
+static RayIntercept ray_intercept(const Player *player, float angle,
+                                  bool vertical) {
+  bool isRayDown = ray_is_down(angle);
+  bool isRayRight = ray_is_right(angle);
+  RayIntercept line;
+  if (!vertical) {
+    line.y = tile_floor(player->y) * TILE_SIZE + (isRayDown ? TILE_SIZE : 0);
+    line.x = player->x + (line.y - player->y) / tan(angle);
+    line.step_x = TILE_SIZE / tan(angle);
+    line.step_x *= (!isRayRight && line.step_x > 0 ? -1 : 1);
+    line.step_x *= (isRayRight && line.step_x < 0 ? -1 : 1);
+    line.step_y = TILE_SIZE * (!isRayDown ? -1 : 1);
+  } else {
+    line.x = tile_floor(player->x) * TILE_SIZE + (isRayRight ? TILE_SIZE : 0);
+    line.y = player->y + (line.x - player->x) * tan(angle);
+    line.step_y = TILE_SIZE * tan(angle);
+    line.step_y *= (!isRayDown && line.step_y > 0 ? -1 : 1);
+    line.step_y *= (isRayDown && line.step_y < 0 ? -1 : 1);
+    line.step_x = TILE_SIZE * (!isRayRight ? -1 : 1);
+  }
+  return line;
+}
+
+/* march rays ids[begin] to ids[end - 1], or rays begin to end - 1 when ids
+ * is NULL, and store their hits */
+static void march_ray_range(const Map *map, Player *player, RayBuffer *rays,
+                            const int32_t *ids, int begin, int end) {
+  float map_width = map_num_cols(map) * TILE_SIZE;
+  float map_height = map_num_rows(map) * TILE_SIZE;
+  for (int first = begin; first < end; first += RAY_BUFFER_LANES) {
+    RayMarch horizontal = {.lanes = end - first,
+                           .round_down = true,
+                           .map = map,
+                           .map_width = map_width,
+                           .map_height = map_height};
+    if (horizontal.lanes > RAY_BUFFER_LANES)
+      horizontal.lanes = RAY_BUFFER_LANES;
+    RayMarch vertical = horizontal;
+    vertical.round_down = false;
+    bool down[RAY_BUFFER_LANES], right[RAY_BUFFER_LANES];
+
+    for (int lane = 0; lane < horizontal.lanes; lane++) {
+      int ray_id = ids != NULL ? ids[first + lane] : first + lane;
+      float newRay = normalizeAngle(player->rotationAngle +
+                                    ray_offset(ray_id, rays->layout));
+      bool isRayDown = ray_is_down(newRay);
+      bool isRayRight = ray_is_right(newRay);
+      rays->angle[ray_id] = newRay;
+      down[lane] = isRayDown;
+      right[lane] = isRayRight;
+
+      // horizontal interception
+      RayIntercept line = ray_intercept(player, newRay, false);
+      horizontal.x[lane] = line.x;
+      horizontal.y[lane] = line.y;
+      horizontal.step_x[lane] = line.step_x;
+      horizontal.step_y[lane] = line.step_y;
+      horizontal.adjust_x[lane] = 0;
+      horizontal.adjust_y[lane] = !isRayDown ? -1 : 0;
+
+      // vertical_interception
+      line = ray_intercept(player, newRay, true);
+      vertical.x[lane] = line.x;
+      vertical.y[lane] = line.y;
+      vertical.step_x[lane] = line.step_x;
+      vertical.step_y[lane] = line.step_y;
+      vertical.adjust_x[lane] = !isRayRight ? -1 : 0;
+      vertical.adjust_y[lane] = 0;
+    }
+
+    march_rays(&horizontal);
+    march_rays(&vertical);
+
+    for (int lane = 0; lane < horizontal.lanes; lane++) {
+      int ray_id = ids != NULL ? ids[first + lane] : first + lane;
+      float horizontal_wall_hit_x = horizontal.x[lane];
+      float horizontal_wall_hit_y = horizontal.y[lane];
+      float vertical_wall_hit_x = vertical.x[lane];
+      float vertical_wall_hit_y = vertical.y[lane];
+
+      float horizontal_hit_distance =
+          horizontal.hit[lane]
+              ? sqrt(pow(player->x - horizontal_wall_hit_x, 2) +
+                     pow(player->y - horizontal_wall_hit_y, 2))
+              : FLT_MAX;
+      float vertical_hit_distance =
+          vertical.hit[lane] ? sqrt(pow(player->x - vertical_wall_hit_x, 2) +
+                                    pow(player->y - vertical_wall_hit_y, 2))
+                             : FLT_MAX;
+
+      float res_x, res_y, distance = 0;
+      int wallHitContent = 0;
+      bool end_hit_vertical = false;
+      if (horizontal_hit_distance <= vertical_hit_distance) {
+        res_x = horizontal.hit[lane] ? horizontal_wall_hit_x : 0;
+        res_y = horizontal.hit[lane] ? horizontal_wall_hit_y : 0;
+        distance = horizontal_hit_distance;
+        int horizontal_wall_id_x = 0, horizontal_wall_id_y = 0;
+        if (horizontal.hit[lane]) {
+          horizontal_wall_id_y =
+              tile_trunc(horizontal_wall_hit_y - (!down[lane] ? 1 : 0));
+          horizontal_wall_id_x = tile_trunc(horizontal_wall_hit_x);
+        }
+        wallHitContent =
+            map_content(map, horizontal_wall_id_y, horizontal_wall_id_x);
       } else {
-        next_vertical_touch_x += vertical_x_step;
-        next_vertical_touch_y += vertical_y_step;
+        res_x = vertical_wall_hit_x;
+        res_y = vertical_wall_hit_y;
+        distance = vertical_hit_distance;
+        int vertical_wall_id_x =
+            tile_trunc(vertical_wall_hit_x - (!right[lane] ? 1 : 0));
+        int vertical_wall_id_y = tile_trunc(vertical_wall_hit_y);
+        wallHitContent =
+            map_content(map, vertical_wall_id_y, vertical_wall_id_x);
+        end_hit_vertical = true;
       }
+
+      rays->hitX[ray_id] = res_x;
+      rays->hitY[ray_id] = res_y;
+      rays->distance[ray_id] = distance;
+      rays->content[ray_id] = wallHitContent;
+      rays->side[ray_id] = end_hit_vertical;
     }
+  }
+}
+
+typedef struct RayMarchJob {
+  const Map *map;
+  Player *player;
+  RayBuffer *rays;
+  const int32_t *ids;
+} RayMarchJob;
+
+static void march_ray_job(void *data, int first, int last) {
+  RayMarchJob *job = data;
+  march_ray_range(job->map, job->player, job->rays, job->ids, first, last);
+}
+
+/* march the count rays listed in ids, or the first count rays when ids is
+ * NULL, and store their hits. A far ray steps across many more cells than a
+ * near one, so the rays go out in small jobs that idle threads steal. */
+static void march_ray_list(const Map *map, Player *player, RayBuffer *rays,
+                           const int32_t *ids, int count) {
+  RayMarchJob job = {map, player, rays, ids};
+  JobCounter marched = {0};
+  jobs_for(&marched, NULL, march_ray_job, &job, count, RAY_JOB_SIZE);
+  jobs_wait(&marched);
+}
+
+void ray_history_init(RayHistory *history, int count) {
+  ray_history_init_columns(history, (RayColumns){count, 0, 1});
+}
+
+size_t ray_history_bytes(RayColumns layout) {
+  /* a RayBuffer, the offsets and three id lists, each rounded up */
+  return 64 * (size_t)(ray_columns_count(layout) + RAY_BUFFER_LANES) +
+         16 * ARENA_ALIGNMENT;
+}
+
+void ray_history_init_columns(RayHistory *history, RayColumns layout) {
+  Arena arena;
+  arena_init(&arena, ray_history_bytes(layout));
+  ray_history_init_in(history, layout, &arena);
+  history->arena = arena;
+}
 
-    float horizontal_hit_distance =
-        hit_horizonal ? sqrt(pow(player->x - horizontal_wall_hit_x, 2) +
-                             pow(player->y - horizontal_wall_hit_y, 2))
-                      : FLT_MAX;
-    float vertical_hit_distance =
-        hit_vertical ? sqrt(pow(player->x - vertical_wall_hit_x, 2) +
-                            pow(player->y - vertical_wall_hit_y, 2))
-                     : FLT_MAX;
-
-    float res_x, res_y, distance = 0;
-    int wallHitContent = 0;
-    bool end_hit_vertical = false;
-    if (horizontal_hit_distance <= vertical_hit_distance) {
-      res_x = horizontal_wall_hit_x;
-      res_y = horizontal_wall_hit_y;
-      distance = horizontal_hit_distance;
-      wallHitContent = map_content(horizontal_wall_id_y, horizontal_wall_id_x);
+void ray_history_init_in(RayHistory *history, RayColumns layout,
+                         Arena *arena) {
+  int count = ray_columns_count(layout);
+  history->arena = (Arena){NULL, 0, 0};
+  history->rays = ray_buffer_alloc_columns(arena, layout);
+  history->offset = arena_alloc(arena, sizeof(double) * count);
+  for (int i = 0; i < count; i++)
+    history->offset[i] = ray_offset(i, layout);
+  history->pending = arena_alloc(arena, sizeof(int32_t) * count);
+  history->open[0] = arena_alloc(arena, sizeof(int32_t) * count);
+  history->open[1] = arena_alloc(arena, sizeof(int32_t) * count);
+  history->valid = false;
+  history->step = RAY_ADAPTIVE_STEP;
+  history->marched = 0;
+}
+
+void ray_history_release(RayHistory *history) {
+  arena_release(&history->arena);
+  history->valid = false;
+}
+
+/* whether old rays a and b hit the same face of the same wall tile. The rays
+ * between them do too, unless the corner of a nearer wall juts in between;
+ * see ray_wedge_clear() */
+static bool ray_same_face(const RayBuffer *old, int a, int b) {
+  if (old->distance[a] == FLT_MAX || old->distance[b] == FLT_MAX ||
+      old->content[a] != old->content[b] || old->side[a] != old->side[b])
+    return false;
+  if (old->side[a])
+    return old->hitX[a] == old->hitX[b] &&
+           tile_floor(old->hitY[a]) == tile_floor(old->hitY[b]);
+  return old->hitY[a] == old->hitY[b] &&
+         tile_floor(old->hitX[a]) == tile_floor(old->hitX[b]);
+}
+
+/* whether rays a and b hit the same face heading into the same quadrant, as
+ * the two sides of a wedge must */
+static bool ray_same_run(const RayBuffer *rays, int a, int b) {
+  return ray_same_face(rays, a, b) &&
+         ray_is_down(rays->angle[a]) == ray_is_down(rays->angle[b]) &&
+         ray_is_right(rays->angle[a]) == ray_is_right(rays->angle[b]);
+}
+
+/* ray ray_id of this cast, at angle, hits the face old ray face hit. The
+ * lines to the face are counted and the hit found from the first line as a
+ * march finds it, so it is the same point to the bit. */
+static void ray_intersect_face(Player *player, RayBuffer *rays, int ray_id,
+                               float angle, const RayBuffer *old, int face) {
+  RayIntercept line = ray_intercept(player, angle, old->side[face]);
+  /* the axis the lines step along by a whole tile meets the face exactly */
+  int lines = old->side[face] ? (int)((old->hitX[face] - line.x) / line.step_x)
+                              : (int)((old->hitY[face] - line.y) / line.step_y);
+  float hit_x = ray_line_point(line.x, line.step_x, lines);
+  float hit_y = ray_line_point(line.y, line.step_y, lines);
+  rays->hitX[ray_id] = hit_x;
+  rays->hitY[ray_id] = hit_y;
+  rays->distance[ray_id] =
+      sqrt(pow(player->x - hit_x, 2) + pow(player->y - hit_y, 2));
+  rays->content[ray_id] = old->content[face];
+  rays->side[ray_id] = old->side[face];
+}
+
+/* whether the cells that rays between a and b enter on the first count lines
+ * of one family are all open. Both rays cross the same lines, and where a ray
+ * between them crosses one lies between where they do, so the cells between
+ * theirs are the only ones it can enter. */
+static bool ray_lines_open(const Map *map, bool vertical, RayIntercept a,
+                           RayIntercept b, float adjust, int count) {
+  for (int line = 0; line < count; line++) {
+    if (!vertical) {
+      int row = tile_floor(ray_line_point(a.y, a.step_y, line) + adjust);
+      float x_a = ray_line_point(a.x, a.step_x, line);
+      float x_b = ray_line_point(b.x, b.step_x, line);
+      int last = tile_floor(x_a > x_b ? x_a : x_b);
+      for (int col = tile_floor(x_a < x_b ? x_a : x_b); col <= last; col++)
+        if (map_is_wall(map, row, col))
+          return false;
     } else {
-      res_x = vertical_wall_hit_x;
-      res_y = vertical_wall_hit_y;
-      distance = vertical_hit_distance;
-      wallHitContent = map_content(vertical_wall_id_y, vertical_wall_id_x);
-      end_hit_vertical = true;
+      int col = tile_trunc(ray_line_point(a.x, a.step_x, line) + adjust);
+      float y_a = ray_line_point(a.y, a.step_y, line);
+      float y_b = ray_line_point(b.y, b.step_y, line);
+      int last = tile_trunc(y_a > y_b ? y_a : y_b);
+      for (int row = tile_trunc(y_a < y_b ? y_a : y_b); row <= last; row++)
+        if (map_is_wall(map, row, col))
+          return false;
     }
+  }
+  return true;
+}
 
-    rays[ray_id] =
-        (Ray){newRay, res_x, res_y, distance, wallHitContent, end_hit_vertical};
+/* Whether ray i hits its face far enough from the tile's corners for the
+ * rays next to it to be intersected with the face. Near a corner, rounding
+ * decides which of two faces a march sees first. A hit point and its
+ * distance are off by a few units in the last place of the coordinates and
+ * the distance travelled, so the margin is a fixed fraction of those, many
+ * times that rounding. */
+static bool ray_clear_of_corner(const RayBuffer *rays, int i) {
+  float along = rays->side[i] ? rays->hitY[i] : rays->hitX[i];
+  float offset = along - tile_floor(along) * TILE_SIZE;
+  float margin = (along + rays->distance[i]) * 0x1p-16f;
+  return offset >= margin && offset <= TILE_SIZE - margin;
+}
+
+/* Whether every ray between rays a and b of rays, which hit the same face,
+ * hits that face where a march would. Two rays on one face say nothing about
+ * the corner of a nearer wall that juts in between them, so the cells in the
+ * wedge between the two rays are tested, out to the face: those on the lines
+ * of the face's family before it, and those on the other family's lines
+ * before the face's tile. A face hit near the tile's corner is refused, as
+ * there rounding may just as well let a march see the next face. */
+static bool ray_wedge_clear(const Map *map, const Player *player,
+                            const RayBuffer *rays, int a, int b) {
+  float angle_a = rays->angle[a], angle_b = rays->angle[b];
+  if (ray_is_down(angle_a) != ray_is_down(angle_b) ||
+      ray_is_right(angle_a) != ray_is_right(angle_b))
+    return false;
+  bool down = ray_is_down(angle_a), right = ray_is_right(angle_a);
+  bool side = rays->side[a];
+  if (!ray_clear_of_corner(rays, a) || !ray_clear_of_corner(rays, b))
+    return false;
+  /* the coordinate of the hits along the face, and across it */
+  float along = side ? rays->hitY[a] : rays->hitX[a];
+  float across = side ? rays->hitX[a] : rays->hitY[a];
+  float tile_start = tile_floor(along) * TILE_SIZE;
+
+  RayIntercept face_a = ray_intercept(player, angle_a, side);
+  RayIntercept face_b = ray_intercept(player, angle_b, side);
+  RayIntercept other_a = ray_intercept(player, angle_a, !side);
+  RayIntercept other_b = ray_intercept(player, angle_b, !side);
+  int face_lines = side ? (int)((across - face_a.x) / face_a.step_x)
+                        : (int)((across - face_a.y) / face_a.step_y);
+  /* the other family's lines up to the edge of the face's tile the rays
+   * reach first */
+  bool forward = side ? down : right;
+  float edge = tile_start + (forward ? 0 : TILE_SIZE);
+  int other_lines =
+      1 + (int)(side ? (edge - other_a.y) / other_a.step_y
+                     : (edge - other_a.x) / other_a.step_x);
+  if (other_lines < 0)
+    other_lines = 0;
+  if (!side)
+    return ray_lines_open(map, false, face_a, face_b, !down ? -1 : 0,
+                          face_lines) &&
+           ray_lines_open(map, true, other_a, other_b, !right ? -1 : 0,
+                          other_lines);
+  return ray_lines_open(map, true, face_a, face_b, !right ? -1 : 0,
+                        face_lines) &&
+         ray_lines_open(map, false, other_a, other_b, !down ? -1 : 0,
+                        other_lines);
+}
+
+/* whether angle lies strictly between two rays' angles, from low to high
+ * across 0 if need be */
+static bool ray_angle_between(float low, float angle, float high) {
+  if (low <= high)
+    return low < angle && angle < high;
+  return low < angle || angle < high;
+}
+
+/* intersect the rays between a and b, which hit the same face, with it */
+static void ray_fill_gap(Player *player, RayBuffer *rays,
+                         const double *offsets, int a, int b) {
+  for (int ray_id = a + 1; ray_id < b; ray_id++) {
+    rays->angle[ray_id] =
+        normalizeAngle(player->rotationAngle + offsets[ray_id]);
+    ray_intersect_face(player, rays, ray_id, rays->angle[ray_id], rays, a);
+  }
+}
+
+/* march every history->step-th ray and the last one, then halve each gap
+ * whose two end rays do not hit the same face with a clear wedge between
+ * them by marching its middle ray, until the gaps are one column wide; the
+ * rays in the other gaps are intersected with their face. Gaps in a row on
+ * one face share a single wedge test. */
+static void cast_adaptive(const Map *map, Player *player, RayBuffer *rays,
+                          RayHistory *history) {
+  int last = rays->count - 1;
+  int step = history->step;
+  int32_t *open = history->open[0], *next = history->open[1];
+  int pending = 0, num_open = 0;
+  for (int ray_id = 0; ray_id < last; ray_id += step) {
+    history->pending[pending++] = ray_id;
+    open[num_open++] = ray_id;
+  }
+  history->pending[pending++] = last;
+  march_ray_list(map, player, rays, history->pending, pending);
+  history->marched = pending;
+
+  for (; step > 1; step /= 2) {
+    int num_next = 0;
+    int tested_alone = -1; /* gaps up to this one failed as part of a run */
+    pending = 0;
+    for (int i = 0; i < num_open; i++) {
+      int a = open[i];
+      int b = a + step < last ? a + step : last;
+      if (b - a <= 1)
+        continue;
+      if (ray_same_run(rays, a, b)) {
+        /* the gaps that follow on the same face are tested along with it */
+        int run = i, run_end = b;
+        while (i > tested_alone && run + 1 < num_open &&
+               open[run + 1] == run_end) {
+          int end = run_end + step < last ? run_end + step : last;
+          if (!ray_same_run(rays, a, end))
+            break;
+          run++;
+          run_end = end;
+        }
+        if (ray_wedge_clear(map, player, rays, a, run_end)) {
+          for (; i < run; i++)
+            ray_fill_gap(player, rays, history->offset, open[i], open[i + 1]);
+          ray_fill_gap(player, rays, history->offset, open[run], run_end);
+          continue;
+        }
+        tested_alone = run;
+        if (run > i && ray_wedge_clear(map, player, rays, a, b)) {
+          ray_fill_gap(player, rays, history->offset, a, b);
+          continue;
+        }
+      }
+      next[num_next++] = a;
+      /* the gap at the end of the view may be shorter than step */
+      if (a + step / 2 < b) {
+        history->pending[pending++] = a + step / 2;
+        next[num_next++] = a + step / 2;
+      }
+    }
+    march_ray_list(map, player, rays, history->pending, pending);
+    history->marched += pending;
+    int32_t *swap = open;
+    open = next;
+    next = swap;
+    num_open = num_next;
+  }
+}
+
+/* the player turned in place since the last cast: a ray at the angle of an
+ * old one hits what that hit, one between two old rays on a face with a
+ * clear wedge is intersected with it, and only the rest are marched */
+static void cast_turned(const Map *map, Player *player, RayBuffer *rays,
+                        RayHistory *history) {
+  const RayBuffer *old = &history->rays;
+  const double *offsets = history->offset;
+  double turn = (double)player->rotationAngle - history->rotation;
+  int pending = 0;
+  /* the old rays up to run_end hit one face, and the new rays between old
+   * rays clear_start and clear_end may be intersected with it */
+  int run_end = -1, clear_start = -1, clear_end = -1;
+  for (int ray_id = 0, j = 0; ray_id < rays->count; ray_id++) {
+    double offset = turn + offsets[ray_id];
+    float angle = normalizeAngle(player->rotationAngle + offsets[ray_id]);
+    rays->angle[ray_id] = angle;
+    if (offset < offsets[0] || offset > offsets[old->count - 1]) {
+      history->pending[pending++] = ray_id;
+      continue;
+    }
+    /* old rays are sorted by angle, as are the new ones */
+    while (j + 1 < old->count && offsets[j + 1] <= offset)
+      j++;
+    int same = angle == old->angle[j]                           ? j
+               : j + 1 < old->count && angle == old->angle[j + 1] ? j + 1
+                                                                  : -1;
+    if (same >= 0) {
+      rays->hitX[ray_id] = old->hitX[same];
+      rays->hitY[ray_id] = old->hitY[same];
+      rays->distance[ray_id] = old->distance[same];
+      rays->content[ray_id] = old->content[same];
+      rays->side[ray_id] = old->side[same];
+      continue;
+    }
+    if (j >= run_end && j + 1 < old->count && ray_same_run(old, j, j + 1)) {
+      run_end = j + 1;
+      while (run_end + 1 < old->count && ray_same_run(old, j, run_end + 1))
+        run_end++;
+      /* the wedge test refuses the rays next to the tile's corners, so the
+       * new rays beside them are marched */
+      clear_start = j;
+      clear_end = run_end;
+      while (clear_start < clear_end && !ray_clear_of_corner(old, clear_start))
+        clear_start++;
+      while (clear_end > clear_start && !ray_clear_of_corner(old, clear_end))
+        clear_end--;
+      if (clear_start == clear_end ||
+          !ray_wedge_clear(map, player, old, clear_start, clear_end))
+        clear_end = clear_start;
+    }
+    if (j >= clear_start && j < clear_end &&
+        ray_angle_between(old->angle[j], angle, old->angle[j + 1]))
+      ray_intersect_face(player, rays, ray_id, angle, old, j);
+    else
+      history->pending[pending++] = ray_id;
   }
+  march_ray_list(map, player, rays, history->pending, pending);
+  history->marched = pending;
+}
+
+void cast_all_rays(const Renderer *renderer, Player *player, RayBuffer *rays,
+                   RayHistory *history) {
+  const Map *map = renderer->map;
+  if (history == NULL) {
+    march_ray_list(map, player, rays, NULL, rays->count);
+    return;
+  }
+
+  const RayBuffer *old = &history->rays;
+  bool reuse = history->valid && old->count == rays->count &&
+               old->layout.columns == rays->layout.columns &&
+               old->layout.first == rays->layout.first &&
+               old->layout.stride == rays->layout.stride &&
+               history->x == player->x && history->y == player->y;
+  if (reuse) {
+    cast_turned(map, player, rays, history);
+  } else if (history->step > 1 && rays->count > 1) {
+    cast_adaptive(map, player, rays, history);
+  } else {
+    march_ray_list(map, player, rays, NULL, rays->count);
+    history->marched = rays->count;
+  }
+
+  ray_buffer_copy(&history->rays, rays);
+  history->x = player->x;
+  history->y = player->y;
+  history->rotation = player->rotationAngle;
+  history->valid = true;
 }
 
-void render_rays(Uint32 *color_buffer, Uint32 color, Ray *rays,
+void render_rays(const Renderer *renderer, Uint32 color, const RayBuffer *rays,
                  Player *player) {
-  for (int i = 0; i < NUM_RAYS; i++) {
-    draw_line(player->x * MINIMAP_SCALE_FACTOR,
+  for (int i = 0; i < rays->count; i++) {
+    draw_line(&renderer->target, player->x * MINIMAP_SCALE_FACTOR,
               player->y * MINIMAP_SCALE_FACTOR,
-              rays[i].wallHitX * MINIMAP_SCALE_FACTOR,
-              rays[i].wallHitY * MINIMAP_SCALE_FACTOR, color, color_buffer);
+              rays->hitX[i] * MINIMAP_SCALE_FACTOR,
+              rays->hitY[i] * MINIMAP_SCALE_FACTOR, color);
   }
 }
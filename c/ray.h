@@ -1,22 +1,108 @@
 #pragma once
 
+#include "arena.h"
+#include "cpu.h"
 #include "defs.h"
 #include "map.h"
 #include "player.h"
 #include <float.h>
 #include <math.h>
 #include <stdbool.h>
-typedef struct Ray Ray;
-
-struct Ray {
-  float rayAngle;
-  float wallHitX;
-  float wallHitY;
-  float distance;
-  int wallHitContent;
-  bool wasHitVertical;
+#include <stdint.h>
+
+typedef struct RayBuffer RayBuffer;
+typedef struct RayColumns RayColumns;
+
+/* which columns of a view a set of rays is for: ray i is column
+ * first + i * stride of a view columns wide */
+struct RayColumns {
+  int columns;
+  int first;
+  int stride;
+};
+
+/* The rays of one frame, one per screen column, stored as separate arrays so
+ * a consumer only streams the fields it reads and can process 8 columns at a
+ * time. Every array is ARENA_ALIGNMENT aligned and padded to a multiple of
+ * RAY_BUFFER_LANES entries. */
+struct RayBuffer {
+  float *angle;
+  float *hitX;
+  float *hitY;
+  float *distance;
+  int32_t *content; /* map content of the wall hit, 0 for none */
+  uint8_t *side;    /* 1 when the hit is on a vertical grid line */
+  int count;
+  RayColumns layout;
+};
+
+#define RAY_BUFFER_LANES 8
+/* rays marched per job, a whole number of lanes */
+#define RAY_JOB_SIZE (8 * RAY_BUFFER_LANES)
+
+/* rays for every column of a view count columns wide */
+RayBuffer ray_buffer_alloc(Arena *arena, int count);
+/* rays for the columns in layout */
+RayBuffer ray_buffer_alloc_columns(Arena *arena, RayColumns layout);
+/* arena bytes a buffer of count rays takes */
+size_t ray_buffer_bytes(int count);
+/* the rays of src into dst, which holds at least as many */
+void ray_buffer_copy(RayBuffer *dst, const RayBuffer *src);
+int ray_columns_count(RayColumns layout);
+/* gather num_phases buffers, each holding every num_phases-th column, into
+ * rays, which holds every column */
+void ray_buffer_merge(RayBuffer *rays, const RayBuffer *phases,
+                      int num_phases);
+
+typedef struct RayHistory RayHistory;
+
+/* columns between the rays of the first, coarse pass of an adaptive cast; a
+ * power of two, 1 marches every column */
+#define RAY_ADAPTIVE_STEP 8
+
+/* The rays of the last cast, kept from frame to frame. While the player
+ * stands still, a ray that falls between two old rays hitting the same wall
+ * face is found by intersecting that face; only rays at edges and in the
+ * newly exposed part of the view are marched again.
+ *
+ * Once the player moves, with a step above 1, the cast is adaptive: every
+ * step-th ray is marched, then the gaps are halved until the rays on both
+ * sides of a gap hit the same face, and the rays in such a gap are
+ * intersected with it.
+ *
+ * Either way a ray is only intersected once no cell in the wedge between the
+ * two rays around it, out to their face, could stop it sooner, and it is
+ * found at the point a march finds, so the rays are the same as if every one
+ * had been marched. */
+struct RayHistory {
+  Arena arena; /* its own, unless made by ray_history_init_in() */
+  RayBuffer rays;
+  double *offset;   /* angle of each ray relative to the view direction */
+  int32_t *pending; /* ids of the rays to march this cast */
+  int32_t *open[2]; /* gaps still to split in an adaptive cast */
+  float x, y, rotation;
+  bool valid;
+  int step;    /* RAY_ADAPTIVE_STEP unless changed after init */
+  int marched; /* rays the last cast had to march */
 };
 
+void ray_history_init(RayHistory *history, int count);
+void ray_history_init_columns(RayHistory *history, RayColumns layout);
+/* as ray_history_init_columns(), with ray_history_bytes() of arena instead
+ * of an arena of its own */
+void ray_history_init_in(RayHistory *history, RayColumns layout,
+                         Arena *arena);
+size_t ray_history_bytes(RayColumns layout);
+void ray_history_release(RayHistory *history);
+
+/* pick the grid march variant for the best level up to limit, returns it */
+CpuIsa ray_use_isa(CpuIsa limit);
+
 float normalizeAngle(float angle);
-void cast_all_rays(Player *player, Ray *rays);
-void render_rays(Uint32 *color_buffer, Uint32 color, Ray *rays, Player *player);
+/* cast rays across the renderer's level; history may be NULL to march every
+ * ray */
+void cast_all_rays(const Renderer *renderer, Player *player, RayBuffer *rays,
+                   RayHistory *history);
+/* the ray fan onto the renderer's minimap */
+void render_rays(const Renderer *renderer, Uint32 color, const RayBuffer *rays,
+                 Player *player);
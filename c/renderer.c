@@ -0,0 +1,223 @@
+#include "renderer.h"
+#include "graphics.h"
+#include "jobs.h"
+#include "map.h"
+#include "ray.h"
+#include "scaler.h"
+#include "upscale.h"
+#include "wall.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* the ray histories come from arena, or from their own when it is NULL */
+static void view_init(View *view, const Map *map,
+                      const RendererConfig *config, Arena *arena) {
+  bool interlace = config->interlace;
+  view->width = config->width / config->scale;
+  view->height = config->height / config->scale;
+  view->scaled = config->scale > 1;
+  view->phases = interlace ? 2 : 1;
+  view->next_phase = 0;
+  view->stale = false;
+  view->pixels = NULL;
+  view->under = NULL;
+  view->under_width = view->under_height = 0;
+  for (int phase = 0; phase < view->phases; phase++) {
+    RayColumns layout = {view->width, phase, view->phases};
+    if (arena != NULL)
+      ray_history_init_in(&view->history[phase], layout, arena);
+    else
+      ray_history_init_columns(&view->history[phase], layout);
+    view->history[phase].step = config->ray_step;
+  }
+  if (!view->scaled && !interlace)
+    return;
+
+  size_t size = view->scaled ? (size_t)view->width * view->height : 0;
+  if (interlace && !view->scaled)
+    map_minimap_extent(map, config->width, config->height, &view->under_width,
+                       &view->under_height);
+  size_t under = (size_t)view->under_width * view->under_height;
+  arena_init(&view->arena,
+             sizeof(Uint32) * (size + under) + 2 * ARENA_ALIGNMENT);
+  if (size > 0)
+    view->pixels = arena_alloc(&view->arena, sizeof(Uint32) * size);
+  if (under > 0)
+    view->under = arena_alloc(&view->arena, sizeof(Uint32) * under);
+  if (view->scaled)
+    upscaler_init(&view->upscaler, view->width, view->height, config->width,
+                  config->height, config->filter);
+  fprintf(stderr, "view: %dx%d%s%s%s\n", view->width, view->height,
+          interlace ? ", interlaced" : "",
+          view->scaled ? ", scaled up " : "",
+          view->scaled ? upscale_filter_name(config->filter) : "");
+}
+
+static void view_release(View *view) {
+  for (int phase = 0; phase < view->phases; phase++)
+    ray_history_release(&view->history[phase]);
+  if (view->scaled)
+    upscaler_release(&view->upscaler);
+  if (view->scaled || view->phases > 1)
+    arena_release(&view->arena);
+}
+
+void renderer_init(Renderer *renderer, const Map *map,
+                   const TextureAtlas *atlas, const RendererConfig *config) {
+  renderer->map = map;
+  renderer->atlas = atlas;
+  size_t pixels = (size_t)config->width * config->height;
+  arena_init(&renderer->arena, sizeof(Uint32) * pixels);
+  renderer->target = (ColorBuffer){
+      arena_alloc(&renderer->arena, sizeof(Uint32) * pixels), config->width,
+      config->height};
+  view_init(&renderer->view, map, config, NULL);
+  renderer->scaler = &renderer->own_scaler;
+  scaler_cache_init(renderer->scaler, renderer->view.width,
+                    renderer->view.height);
+}
+
+void renderer_init_observer(Renderer *renderer, const Map *map,
+                            const TextureAtlas *atlas,
+                            const RendererConfig *config, ScalerCache *scaler,
+                            Arena *arena) {
+  if (config->scale != 1 || config->interlace) {
+    fprintf(stderr, "Error: observations are drawn at a scale of 1, not "
+                    "interlaced\n");
+    exit(1);
+  }
+  renderer->map = map;
+  renderer->atlas = atlas;
+  renderer->arena = (Arena){NULL, 0, 0};
+  renderer->target = (ColorBuffer){NULL, config->width, config->height};
+  view_init(&renderer->view, map, config, arena);
+  renderer->scaler = scaler;
+  renderer->own_scaler = (ScalerCache){0};
+}
+
+size_t renderer_observer_bytes(const RendererConfig *config) {
+  return ray_history_bytes((RayColumns){config->width, 0, 1});
+}
+
+void renderer_release(Renderer *renderer) {
+  view_release(&renderer->view);
+  if (renderer->scaler == &renderer->own_scaler)
+    scaler_cache_release(renderer->scaler);
+  arena_release(&renderer->arena);
+  renderer->target = (ColorBuffer){NULL, 0, 0};
+}
+
+/* copy the part of the view under the minimap between the color buffer and
+ * the view's copy of it */
+static void view_swap_under(View *view, const ColorBuffer *target,
+                            bool restore) {
+  for (int y = 0; y < view->under_height; y++) {
+    Uint32 *screen = target->pixels + (size_t)y * target->width;
+    Uint32 *kept = view->under + (size_t)y * view->under_width;
+    if (restore)
+      memcpy(screen, kept, sizeof(Uint32) * view->under_width);
+    else
+      memcpy(kept, screen, sizeof(Uint32) * view->under_width);
+  }
+}
+
+unsigned renderer_phases_to_draw(const Renderer *renderer,
+                                 const Player *player, const FrameKey *drawn) {
+  const View *view = &renderer->view;
+  unsigned all = (1u << view->phases) - 1;
+  if (view->phases == 1 || drawn == NULL)
+    return all;
+  /* turning at the player's own speed is not a large motion; one phase a
+   * frame then lags the other by a frame's turn, as it lags a step */
+  float dx = player->x - drawn->x, dy = player->y - drawn->y;
+  if (fabsf(player->rotationAngle - drawn->rotation) >
+          fabsf(player->turnSpeed) + INTERLACE_TURN_SLACK ||
+      dx * dx + dy * dy > INTERLACE_MAX_STEP * INTERLACE_MAX_STEP)
+    return all;
+  return 1u << view->next_phase;
+}
+
+bool renderer_is_stale(const Renderer *renderer, const Player *player) {
+  const View *view = &renderer->view;
+  for (int phase = 0; phase < view->phases; phase++) {
+    const RayHistory *history = &view->history[phase];
+    if (history->x != player->x || history->y != player->y ||
+        history->rotation != player->rotationAngle)
+      return true;
+  }
+  return false;
+}
+
+/* draw the phases in draw into the view and bring it to the color buffer */
+static void view_draw(Renderer *renderer, const RayBuffer *rays,
+                      unsigned draw, Player *player, Arena *frame_arena) {
+  View *view = &renderer->view;
+  const ColorBuffer *color_buffer = &renderer->target;
+  Uint32 *target = view->scaled ? view->pixels : color_buffer->pixels;
+  if (draw == (1u << view->phases) - 1) {
+    /* every column at once, as one buffer */
+    RayBuffer merged = rays[0];
+    if (view->phases > 1) {
+      merged = ray_buffer_alloc(frame_arena, view->width);
+      ray_buffer_merge(&merged, rays, view->phases);
+    }
+    JobCounter cleared = {0}, drawn = {0};
+    if (!view->scaled)
+      clear_color_buffer(color_buffer, 0xFF00EE30, frame_arena, &cleared);
+    render_3D_projections(renderer, target, view->height, &merged, player,
+                          frame_arena, &cleared, &drawn);
+    jobs_wait(&drawn);
+  } else {
+    if (view->under != NULL)
+      view_swap_under(view, color_buffer, true);
+    for (int phase = 0; phase < view->phases; phase++) {
+      if ((draw & (1u << phase)) == 0)
+        continue;
+      /* straight into the phase's columns, between the other phase's */
+      JobCounter drawn = {0};
+      render_3D_projections_strided(renderer, target + phase, view->width,
+                                    view->phases, view->height, &rays[phase],
+                                    player, frame_arena, NULL, &drawn);
+      jobs_wait(&drawn);
+    }
+  }
+  if (view->scaled)
+    upscale(&view->upscaler, view->pixels, color_buffer->pixels);
+  else if (view->under != NULL)
+    view_swap_under(view, color_buffer, false);
+}
+
+/* what the minimap and the ray fan on it are drawn from */
+typedef struct Overlay {
+  const Renderer *renderer;
+  Player *player;
+  const RayBuffer *rays;
+} Overlay;
+
+static void overlay_map_job(void *data, int first, int last) {
+  Overlay *overlay = data;
+  (void)first;
+  (void)last;
+  render_map(overlay->renderer);
+}
+
+static void overlay_rays_job(void *data, int first, int last) {
+  Overlay *overlay = data;
+  for (int phase = first; phase < last; phase++)
+    render_rays(overlay->renderer, 0xFFFF0000, &overlay->rays[phase],
+                overlay->player);
+}
+
+void renderer_draw(Renderer *renderer, const RayBuffer *rays, unsigned draw,
+                   Player *player, Arena *frame_arena) {
+  view_draw(renderer, rays, draw, player, frame_arena);
+  /* the ray fan goes on top of the minimap, all phases in one job */
+  Overlay overlay = {renderer, player, rays};
+  JobCounter map_drawn = {0}, rays_drawn = {0};
+  jobs_for(&map_drawn, NULL, overlay_map_job, &overlay, 1, 1);
+  jobs_for(&rays_drawn, &map_drawn, overlay_rays_job, &overlay,
+           renderer->view.phases, renderer->view.phases);
+  jobs_wait(&rays_drawn);
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include "arena.h"
+#include "graphics.h"
+#include "map.h"
+#include "player.h"
+#include "ray.h"
+#include "scaler.h"
+#include "texture.h"
+#include "upscale.h"
+#include <stdbool.h>
+
+typedef struct RendererConfig RendererConfig;
+typedef struct View View;
+typedef struct FrameKey FrameKey;
+
+/* how a renderer draws; see View */
+struct RendererConfig {
+  int width, height; /* of the color buffer */
+  int scale;         /* the 3D view is drawn this many times smaller */
+  UpscaleFilter filter;
+  bool interlace;
+  int ray_step; /* RayHistory.step of the view's histories */
+};
+
+/* What a frame is drawn from. While it stays the same, so does the picture,
+ * and the last frame is shown again instead of being cast and drawn. The
+ * minimap and the ray fan only depend on the pose and the level. */
+struct FrameKey {
+  float x, y, rotation;
+  unsigned map_revision;
+  unsigned texture_revision;
+};
+
+/* The 3D view, one ray per column. At a render scale of 1 it is drawn
+ * straight into the color buffer; otherwise into its own buffer scale times
+ * smaller on each side, which is scaled up into the color buffer before the
+ * minimap goes on top at full resolution.
+ *
+ * An interlaced view is split into two phases, its even and its odd columns,
+ * each cast with its own ray history. While the camera moves little, one
+ * phase is drawn per frame, straight into its columns of the view; the other
+ * phase shows what it showed the frame before. At a render scale of 1 the
+ * view is the color buffer, so what the minimap covers of it is kept aside
+ * for the next frame. */
+struct View {
+  Uint32 *pixels; /* NULL when drawn straight into the color buffer */
+  Uint32 *under;  /* the view under the minimap, when pixels is NULL */
+  int under_width, under_height;
+  int width, height;
+  bool scaled;
+  int phases;     /* 2 when interlaced, 1 otherwise */
+  int next_phase; /* the phase drawn next while only one is */
+  bool stale;     /* one phase shows an older frame than the other */
+  RayHistory history[2];
+  Arena arena;
+  Upscaler upscaler;
+};
+
+/* Everything one view of a level is cast and drawn with. The map and the
+ * texture atlas are only read, so one copy of each serves every renderer
+ * made from it; a renderer owns its color buffer, its view with the ray
+ * histories and their camera tables, and its wall scalers. A renderer made
+ * by renderer_init_observer() has no color buffer, keeps its view in an
+ * arena of the caller's and only reads the complete scalers it shares with
+ * others. Different renderers share nothing they write and may be cast and
+ * drawn at the same
+ * time, from jobs too, as long as the map is not reloaded and
+ * textures_update() does not run meanwhile. However many draws hold their
+ * walls back for their clear at once, the job scheduler takes them all,
+ * waiting rather than failing once its table of held back batches is
+ * full. */
+struct Renderer {
+  const Map *map;
+  const TextureAtlas *atlas;
+  ColorBuffer target;
+  Arena arena; /* the color buffer's pixels */
+  View view;
+  ScalerCache *scaler; /* own_scaler, or shared ones */
+  ScalerCache own_scaler;
+};
+
+void renderer_init(Renderer *renderer, const Map *map,
+                   const TextureAtlas *atlas, const RendererConfig *config);
+/* a renderer for render_observation() only, at a scale of 1 and not
+ * interlaced: its view comes out of renderer_observer_bytes() of arena, and
+ * it draws through scaler, made by scaler_cache_init_complete() for the
+ * config's height and kept until the renderer is released */
+void renderer_init_observer(Renderer *renderer, const Map *map,
+                            const TextureAtlas *atlas,
+                            const RendererConfig *config, ScalerCache *scaler,
+                            Arena *arena);
+size_t renderer_observer_bytes(const RendererConfig *config);
+void renderer_release(Renderer *renderer);
+
+/* the phases of the view to draw, one bit each, for a player that moved
+ * since the frame drawn last, NULL before the first: all of them, or only
+ * the next one while interlaced and the camera moved little */
+unsigned renderer_phases_to_draw(const Renderer *renderer,
+                                 const Player *player, const FrameKey *drawn);
+/* whether some phase was last cast from another pose than the player's */
+bool renderer_is_stale(const Renderer *renderer, const Player *player);
+/* draw the phases in draw into the view, with rays for every phase, and the
+ * minimap with the ray fan on top into the color buffer; what drawing needs
+ * for the frame is allocated from frame_arena */
+void renderer_draw(Renderer *renderer, const RayBuffer *rays, unsigned draw,
+                   Player *player, Arena *frame_arena);
@@ -0,0 +1,168 @@
+#include "scaler.h"
+#include "arena.h"
+#include "defs.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct ScalerSlot {
+  int32_t height;
+  uint16_t texture_height; /* 0 for a free slot */
+  int32_t rows;            /* scaler_rows() of the table */
+};
+
+static void scaler_cache_flush(ScalerCache *cache) {
+  arena_reset(&cache->arena, cache->tables_mark);
+  memset(cache->slots, 0, sizeof(ScalerSlot) * cache->num_slots);
+  cache->used_slots = 0;
+}
+
+/* an index of at least wanted slots and bytes of tables */
+static void scaler_cache_reserve(ScalerCache *cache, int wanted,
+                                 size_t bytes) {
+  cache->num_slots = 1;
+  while (cache->num_slots < wanted)
+    cache->num_slots *= 2;
+  arena_init(&cache->arena, sizeof(ScalerSlot) * cache->num_slots + bytes);
+  cache->slots =
+      arena_alloc(&cache->arena, sizeof(ScalerSlot) * cache->num_slots);
+  cache->tables_mark = arena_mark(&cache->arena);
+  cache->table_base =
+      (const uint16_t *)(cache->arena.base + cache->tables_mark);
+  cache->complete = false;
+  scaler_cache_flush(cache);
+}
+
+/* a table no taller than the view, plus alignment and the 2 bytes a 32-bit
+ * gather may read past */
+static size_t scaler_table_bytes(int height) {
+  return sizeof(uint16_t) * ((size_t)height + 1) + ARENA_ALIGNMENT;
+}
+
+void scaler_cache_init(ScalerCache *cache, int width, int height) {
+  /* a table per column */
+  size_t frame_bytes = (size_t)width * scaler_table_bytes(height);
+  size_t bytes = SCALER_CACHE_FRAMES * frame_bytes;
+  if (bytes > SCALER_CACHE_BYTES)
+    bytes = SCALER_CACHE_BYTES > frame_bytes ? SCALER_CACHE_BYTES : frame_bytes;
+  /* the index is kept at most half full, with room for a frame's columns */
+  int wanted = 2 * SCALER_CACHE_FRAMES * width;
+  if (wanted > SCALER_CACHE_SLOTS)
+    wanted = SCALER_CACHE_SLOTS > 4 * width ? SCALER_CACHE_SLOTS : 4 * width;
+  scaler_cache_reserve(cache, wanted, bytes);
+  cache->frame_bytes = frame_bytes;
+  cache->width = width;
+  cache->view_height = 0;
+}
+
+void scaler_cache_init_complete(ScalerCache *cache, int height,
+                                const int *texture_heights, int count) {
+  int heights = SCALER_MAX_VIEWS * height + 1;
+  scaler_cache_reserve(cache, 2 * heights * count,
+                       (size_t)heights * count * scaler_table_bytes(height));
+  cache->frame_bytes = 0;
+  cache->width = 0;
+  cache->view_height = height;
+  for (int i = 0; i < count; i++)
+    if (texture_heights[i] > 0)
+      for (int strip = 0; strip < heights; strip++)
+        scaler_rows(cache, strip, texture_heights[i]);
+  cache->complete = true;
+}
+
+void scaler_cache_begin_frame(ScalerCache *cache, int height) {
+  if (cache->complete) {
+    if (height != cache->view_height) {
+      fprintf(stderr, "Error: scalers for %d rows drawing %d\n",
+              cache->view_height, height);
+      exit(1);
+    }
+    return;
+  }
+  /* every table depends on the view height */
+  if (height != cache->view_height ||
+      cache->arena.capacity - cache->arena.offset < cache->frame_bytes ||
+      cache->used_slots + cache->width > cache->num_slots / 2)
+    scaler_cache_flush(cache);
+  cache->view_height = height;
+}
+
+void scaler_cache_release(ScalerCache *cache) {
+  arena_release(&cache->arena);
+  cache->slots = NULL;
+  cache->table_base = NULL;
+  cache->used_slots = 0;
+  cache->view_height = 0;
+  cache->complete = false;
+}
+
+int scaler_height(const ScalerCache *cache, float height) {
+  float max = (float)SCALER_MAX_VIEWS * cache->view_height;
+  return height < max ? (int)height : (int)max;
+}
+
+int scaler_y_start(const ScalerCache *cache, int height) {
+  int y_start = cache->view_height / 2.0 - height / 2.0;
+  return y_start < 0 ? 0 : y_start;
+}
+
+int scaler_y_end(const ScalerCache *cache, int height) {
+  int y_end = scaler_y_start(cache, height) + height;
+  return y_end >= cache->view_height ? cache->view_height - 1 : y_end;
+}
+
+double scaler_center(const ScalerCache *cache, int height) {
+  return height / 2.0 - cache->view_height / 2.0;
+}
+
+double scaler_scale(int height, int texture_height) {
+  return (float)texture_height / height;
+}
+
+/* the texel row of every visible screen row, clamped to the texture: short
+ * strips start up to a texel above it */
+static int32_t scaler_build(ScalerCache *cache, int height,
+                            int texture_height) {
+  int y_start = scaler_y_start(cache, height);
+  int y_end = scaler_y_end(cache, height);
+  double center = scaler_center(cache, height);
+  double scale = scaler_scale(height, texture_height);
+  uint16_t *rows = arena_alloc(&cache->arena,
+                               sizeof(uint16_t) * (y_end - y_start + 1));
+  for (int y = y_start; y < y_end; y++) {
+    int row = (y + center) * scale;
+    if (row < 0)
+      row = 0;
+    if (row >= texture_height)
+      row = texture_height - 1;
+    rows[y - y_start] = row;
+  }
+  rows[y_end - y_start] = 0;
+  return (int32_t)(rows - cache->table_base) - y_start;
+}
+
+int32_t scaler_rows(ScalerCache *cache, int height, int texture_height) {
+  unsigned hash =
+      ((unsigned)height * 2654435761u) ^ ((unsigned)texture_height * 40503u);
+  for (unsigned i = hash;; i++) {
+    ScalerSlot *slot = &cache->slots[i & (cache->num_slots - 1)];
+    if (slot->texture_height == 0) {
+      if (cache->complete) {
+        fprintf(stderr, "Error: no scaler for %d rows of a %d texel texture\n",
+                height, texture_height);
+        exit(1);
+      }
+      *slot = (ScalerSlot){height, texture_height,
+                           scaler_build(cache, height, texture_height)};
+      cache->used_slots++;
+      return slot->rows;
+    }
+    if (slot->height == height && slot->texture_height == texture_height)
+      return slot->rows;
+  }
+}
+
+const uint16_t *scaler_table(const ScalerCache *cache) {
+  return cache->table_base;
+}
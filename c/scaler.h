@@ -0,0 +1,76 @@
+#pragma once
+
+#include "arena.h"
+#include "defs.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+/* tables kept at once at most, whatever heights the walls are drawn at; a
+ * cache for a small view keeps a few frames' worth */
+#define SCALER_CACHE_BYTES ((size_t)16 << 20)
+#define SCALER_CACHE_SLOTS 16384
+#define SCALER_CACHE_FRAMES 4
+/* strips are drawn at most this many view heights tall; closer walls are
+ * drawn as if this close, still showing a quarter of the texture height,
+ * and only a player touching a wall sees the difference */
+#define SCALER_MAX_VIEWS 4
+
+/* Wall scalers. For a strip height tall drawn with a texture height texels
+ * tall, a table maps every visible screen row of the strip to the texel row
+ * it shows, so a wall pixel costs one table load and one texel load. Tables
+ * are built the first time a height is drawn and dropped all at once when
+ * the cache is full.
+ *
+ * Only the scalar and SSE2 wall kernels read the tables. The AVX2 and
+ * AVX-512 ones work the same rows out from the same whole heights, so every
+ * level draws the same frames; there the rounding to whole heights changes
+ * about 0.5% of the pixels of a frame and saves nothing. */
+
+typedef struct ScalerSlot ScalerSlot;
+typedef struct ScalerCache ScalerCache;
+
+/* the tables of one view: a slot index over the built tables, then the
+ * tables themselves */
+struct ScalerCache {
+  Arena arena;
+  ScalerSlot *slots;
+  int num_slots; /* a power of two */
+  int used_slots;
+  const uint16_t *table_base;
+  ArenaMark tables_mark;
+  size_t frame_bytes; /* room one frame of new tables can take */
+  int width;          /* strips drawn per frame at most */
+  int view_height;
+  bool complete; /* holds every table there is, and is only read */
+};
+
+/* a cache for views up to width columns and height rows */
+void scaler_cache_init(ScalerCache *cache, int width, int height);
+/* a cache for views height rows tall, filled with the table of every strip
+ * height up to SCALER_MAX_VIEWS view heights for each of the count texture
+ * heights. It never changes after, so any number of renderers may draw
+ * through it at once. */
+void scaler_cache_init_complete(ScalerCache *cache, int height,
+                                const int *texture_heights, int count);
+void scaler_cache_release(ScalerCache *cache);
+/* once per frame, before any scaler_rows() call of the frame, with the
+ * height of the view the strips are drawn into, at most the height the cache
+ * was made for. Flushes the cache when that height changed or when it could
+ * not take another frame's worth of new tables. */
+void scaler_cache_begin_frame(ScalerCache *cache, int height);
+
+/* entries of the table for a strip of the given height, indexed by screen
+ * row, as an offset from scaler_table(). Stays valid until the next
+ * scaler_cache_begin_frame(). */
+int32_t scaler_rows(ScalerCache *cache, int height, int texture_height);
+const uint16_t *scaler_table(const ScalerCache *cache);
+
+/* the whole height a strip of the given exact height is drawn at, at most
+ * SCALER_MAX_VIEWS view heights */
+int scaler_height(const ScalerCache *cache, float height);
+/* first and one past the last view row of a strip of the given height */
+int scaler_y_start(const ScalerCache *cache, int height);
+int scaler_y_end(const ScalerCache *cache, int height);
+/* the table of a strip holds clamp((int)((y + center) * scale)) */
+double scaler_center(const ScalerCache *cache, int height);
+double scaler_scale(int height, int texture_height);
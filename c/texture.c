@@ -0,0 +1,895 @@
+#include "texture.h"
+#include "arena.h"
+#include "map.h"
+#include "upng.h"
+#include <SDL3/SDL_mutex.h>
+#include <SDL3/SDL_thread.h>
+#include <SDL3/SDL_timer.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define TEXTURE_ARENA_SIZE ((size_t)16 << 20)
+#define TEXTURE_SCRATCH_ARENA_SIZE ((size_t)64 << 20)
+#define TEXTURE_LIST_LINE_MAX 4096
+/* streamer threads decoding at once, at most one per core */
+#define TEXTURE_STREAMERS_MAX 4
+
+static const char *default_texture_paths[] = {
+    "c/images/redbrick.png", "c/images/purplestone.png",
+    "c/images/mossystone.png", "c/images/graystone.png",
+    "c/images/colorstone.png", "c/images/bluestone.png",
+    "c/images/wood.png", "c/images/eagle.png",
+};
+
+/* Cache file layout, a decoded copy of the whole texture set:
+ *
+ *   TextureCacheHeader
+ *   TextureSource     sources[count]      what each texture was decoded from
+ *   TextureDescriptor descriptors[count]  offsets into the cache's texels
+ *   uint32_t          texels[]            from texels_offset
+ *
+ * The texel block and every texture in it start on a TEXTURE_ATLAS_ALIGNMENT
+ * boundary. The cache is only trusted while each source PNG still has the
+ * recorded path, size and modification time. When it is missing or stale,
+ * a fresh one is written from the textures the streamer threads decode
+ * anyway, and threads with nothing else to do decode the rest. */
+typedef struct TextureCacheHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t count;
+  uint32_t descriptors_offset;
+  uint32_t texels_offset;
+  uint32_t file_size;
+} TextureCacheHeader;
+
+typedef struct TextureSource {
+  uint64_t path_hash;
+  uint64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+} TextureSource;
+
+typedef enum TextureState {
+  TEXTURE_ABSENT,
+  TEXTURE_QUEUED,
+  TEXTURE_RESIDENT,
+} TextureState;
+
+/* residency of one texture; only touched on the main thread */
+typedef struct TextureEntry {
+  const char *path;
+  TextureState state;
+  int slot;
+  uint64_t last_used;
+} TextureEntry;
+
+typedef struct TextureJob {
+  int texture;
+  int slot;
+  uint32_t fallback;
+} TextureJob;
+
+/* streaming counts, printed by textures_unload() */
+typedef struct TextureStats {
+  unsigned decoded;
+  unsigned copied; /* from the cache */
+  unsigned evicted;
+  Uint64 load_ticks;
+  Uint64 decode_ticks;
+} TextureStats;
+
+/* the texture set, its descriptors and slot bookkeeping, all allocated from
+ * one arena for the lifetime of the set */
+static Arena texture_arena;
+static TextureEntry *entries;
+static TextureSource *sources;
+static TextureDescriptor *descriptors;
+static unsigned count;
+static uint64_t frame;
+static int player_row = -1, player_col = -1;
+/* bumped whenever a descriptor changes, see textures_revision() */
+static unsigned revision;
+
+/* the residency pool: num_slots slots of slot_texels texels each, then the
+ * luma of each texel at the same index */
+static uint32_t *pool;
+static uint8_t *luma;
+static size_t pool_size;
+static uint32_t slot_texels;
+static int num_slots;
+static int *slot_texture;
+
+static struct {
+  unsigned char *image; /* mapping of a valid cache file, or NULL */
+  size_t size;
+  const TextureDescriptor *descriptors;
+  const uint32_t *texels;
+  /* a cache being written. Each texture is written by the first thread to
+   * claim it under the streamer lock, its descriptor included; the thread
+   * to finish the last one writes the header and renames the file. */
+  bool writing;
+  int fd;
+  bool *claimed;
+  unsigned next; /* every texture before it is claimed */
+  /* idle threads may decode textures nobody asked for yet; only once the
+   * first frame's are in, or they would race it for the same ones */
+  bool backfill;
+  unsigned finished;
+  bool ok;
+  uint32_t descriptors_offset;
+  uint32_t texels_offset;
+  TextureDescriptor *build_descriptors;
+  char tmp_path[256];
+} cache;
+
+/* Background decoders. Jobs fill a slot the main thread already reserved
+ * for them, up to one per streamer thread at once; finished jobs are handed
+ * back and published by textures_update(), so the descriptors are only ever
+ * written on the main thread. One thread at a time writes the cache. */
+static struct {
+  SDL_Thread *threads[TEXTURE_STREAMERS_MAX];
+  Arena scratch[TEXTURE_STREAMERS_MAX]; /* each thread's own */
+  int num_threads;
+  SDL_Mutex *lock;
+  SDL_Condition *wake; /* work queued or quit requested */
+  SDL_Condition *idle; /* a job finished */
+  TextureJob *queue;   /* ring of num_slots jobs, visible ones in front */
+  int head;
+  int queued;
+  TextureJob *done;
+  int num_done;
+  int busy; /* jobs queued or being decoded */
+  TextureStats stats;
+  bool quit;
+} streamer;
+
+static uint64_t hash_path(const char *path) {
+  uint64_t hash = 1469598103934665603ull;
+  for (; *path != '\0'; path++) {
+    hash ^= (unsigned char)*path;
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+static bool texture_source(TextureSource *source, const char *path) {
+  struct stat st;
+  if (stat(path, &st) != 0)
+    return false;
+  source->path_hash = hash_path(path);
+  source->size = st.st_size;
+  source->mtime_sec = st.st_mtim.tv_sec;
+  source->mtime_nsec = st.st_mtim.tv_nsec;
+  return true;
+}
+
+/* the texels, their luma and room to read 4 bytes at the last luma */
+static size_t pool_mapping_size(void) {
+  return pool_size + pool_size / sizeof(uint32_t) + sizeof(uint32_t);
+}
+
+static uint32_t atlas_align(uint32_t offset) {
+  return (offset + TEXTURE_ATLAS_ALIGNMENT - 1) &
+         ~(uint32_t)(TEXTURE_ATLAS_ALIGNMENT - 1);
+}
+
+static const char *arena_strdup(Arena *arena, const char *text) {
+  size_t length = strlen(text) + 1;
+  return memcpy(arena_alloc(arena, length), text, length);
+}
+
+/* fill entries with the texture paths, in map content order */
+static void textures_read_list(const char *list_path) {
+  if (list_path == NULL) {
+    count = sizeof(default_texture_paths) / sizeof(default_texture_paths[0]);
+    entries = arena_alloc(&texture_arena, sizeof(TextureEntry) * count);
+    for (unsigned i = 0; i < count; i++)
+      entries[i] = (TextureEntry){default_texture_paths[i], TEXTURE_ABSENT, -1,
+                                  0};
+    return;
+  }
+
+  FILE *file = fopen(list_path, "r");
+  if (file == NULL) {
+    fprintf(stderr, "Error opening texture list %s: %s\n", list_path,
+            strerror(errno));
+    exit(1);
+  }
+  /* one path per line; blank lines and lines starting with # are skipped */
+  char line[TEXTURE_LIST_LINE_MAX];
+  for (int pass = 0; pass < 2; pass++) {
+    unsigned n = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+      line[strcspn(line, "\r\n")] = '\0';
+      if (line[0] == '\0' || line[0] == '#')
+        continue;
+      if (pass == 1)
+        entries[n] = (TextureEntry){arena_strdup(&texture_arena, line),
+                                    TEXTURE_ABSENT, -1, 0};
+      n++;
+    }
+    if (pass == 0) {
+      count = n;
+      entries = arena_alloc(&texture_arena, sizeof(TextureEntry) * count);
+      rewind(file);
+    }
+  }
+  fclose(file);
+  if (count == 0) {
+    fprintf(stderr, "Error: texture list %s is empty\n", list_path);
+    exit(1);
+  }
+}
+
+static bool textures_map_cache(void) {
+  int fd = open(TEXTURE_CACHE_PATH, O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0 ||
+      st.st_size < (off_t)(sizeof(TextureCacheHeader) +
+                           count * (sizeof(TextureSource) +
+                                    sizeof(TextureDescriptor)))) {
+    close(fd);
+    return false;
+  }
+  unsigned char *image = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (image == MAP_FAILED)
+    return false;
+
+  const TextureCacheHeader *header = (const TextureCacheHeader *)image;
+  const TextureSource *cached_sources =
+      (const TextureSource *)(image + sizeof(TextureCacheHeader));
+  bool valid =
+      memcmp(header->magic, TEXTURE_CACHE_MAGIC, 4) == 0 &&
+      header->version == TEXTURE_CACHE_VERSION && header->count == count &&
+      header->file_size == st.st_size &&
+      header->descriptors_offset ==
+          sizeof(TextureCacheHeader) + count * sizeof(TextureSource) &&
+      header->texels_offset % TEXTURE_ATLAS_ALIGNMENT == 0 &&
+      header->texels_offset >=
+          header->descriptors_offset + count * sizeof(TextureDescriptor) &&
+      header->texels_offset <= header->file_size;
+  const TextureDescriptor *cached =
+      (const TextureDescriptor *)(image + header->descriptors_offset);
+  uint64_t texel_count =
+      valid ? (header->file_size - header->texels_offset) / sizeof(uint32_t)
+            : 0;
+
+  for (unsigned i = 0; valid && i < count; i++) {
+    valid = memcmp(&cached_sources[i], &sources[i], sizeof(TextureSource)) ==
+                0 &&
+            cached[i].layout == TEXTURE_LAYOUT_COLUMN_MAJOR &&
+            cached[i].width_shift == texture_size_shift(cached[i].width) &&
+            cached[i].height_shift == texture_size_shift(cached[i].height) &&
+            cached[i].offset * sizeof(uint32_t) % TEXTURE_ATLAS_ALIGNMENT ==
+                0 &&
+            (uint64_t)cached[i].offset +
+                    (uint64_t)cached[i].width * cached[i].height <=
+                texel_count;
+  }
+
+  if (!valid) {
+    munmap(image, st.st_size);
+    return false;
+  }
+  cache.image = image;
+  cache.size = st.st_size;
+  cache.descriptors = cached;
+  cache.texels = (const uint32_t *)(image + header->texels_offset);
+  return true;
+}
+
+static void *texture_scratch_alloc(void *context, unsigned long size) {
+  return arena_alloc(context, size);
+}
+
+static double ticks_to_ms(Uint64 ticks) {
+  return ticks * 1000.0 / SDL_GetPerformanceFrequency();
+}
+
+/* decode a PNG into column-major texels of the size its descriptor records,
+ * with scratch for the PNG, adding how long reading and decoding took to
+ * stats */
+static void texture_decode(unsigned i, uint32_t *columns, Arena *scratch,
+                           TextureStats *stats) {
+  const TextureDescriptor *descriptor = &descriptors[i];
+  ArenaMark mark = arena_mark(scratch);
+  upng_allocator allocator = {texture_scratch_alloc, NULL, scratch};
+  Uint64 start = SDL_GetPerformanceCounter();
+  upng_t *png = upng_new_from_file_using(entries[i].path, &allocator);
+  Uint64 loaded = SDL_GetPerformanceCounter();
+  if (png == NULL || upng_decode(png) != UPNG_EOK ||
+      upng_get_format(png) != UPNG_RGBA8 ||
+      upng_get_width(png) != descriptor->width ||
+      upng_get_height(png) != descriptor->height) {
+    fprintf(stderr, "Error decoding texture %s\n", entries[i].path);
+    exit(1);
+  }
+
+  unsigned width = descriptor->width;
+  unsigned height = descriptor->height;
+  const uint32_t *rows = (const uint32_t *)upng_get_buffer(png);
+  for (unsigned y = 0; y < height; y++)
+    for (unsigned x = 0; x < width; x++)
+      columns[x * height + y] = rows[y * width + x];
+  upng_free(png);
+  arena_reset(scratch, mark);
+  stats->decoded++;
+  stats->load_ticks += loaded - start;
+  stats->decode_ticks += SDL_GetPerformanceCounter() - loaded;
+}
+
+/* per-channel mean of the texels, shown while the texture is not resident */
+static uint32_t texture_average(const uint32_t *texels, size_t n) {
+  uint64_t sum[4] = {0, 0, 0, 0};
+  for (size_t i = 0; i < n; i++)
+    for (int c = 0; c < 4; c++)
+      sum[c] += (texels[i] >> (8 * c)) & 0xFF;
+  uint32_t average = 0;
+  for (int c = 0; c < 4; c++)
+    average |= (uint32_t)(sum[c] / (n > 0 ? n : 1)) << (8 * c);
+  return average;
+}
+
+/* read the PNG headers of every texture, for their sizes */
+static void textures_read_headers(Arena *scratch) {
+  for (unsigned i = 0; i < count; i++) {
+    ArenaMark mark = arena_mark(scratch);
+    upng_allocator allocator = {texture_scratch_alloc, NULL, scratch};
+    upng_t *png = upng_new_from_file_using(entries[i].path, &allocator);
+    if (png == NULL || upng_header(png) != UPNG_EOK ||
+        upng_get_format(png) != UPNG_RGBA8 ||
+        upng_get_width(png) > UINT16_MAX ||
+        upng_get_height(png) > UINT16_MAX) {
+      fprintf(stderr, "Error reading texture %s\n", entries[i].path);
+      exit(1);
+    }
+    unsigned width = upng_get_width(png);
+    unsigned height = upng_get_height(png);
+    descriptors[i] = (TextureDescriptor){TEXTURE_NOT_RESIDENT,
+                                         width,
+                                         height,
+                                         TEXTURE_LAYOUT_COLUMN_MAJOR,
+                                         texture_size_shift(width),
+                                         texture_size_shift(height),
+                                         TEXTURE_FALLBACK_COLOR};
+    upng_free(png);
+    arena_reset(scratch, mark);
+  }
+}
+
+/* start writing a fresh cache, laid out from the descriptors as read from
+ * the PNG headers; runs on the main thread before any streamer starts. The
+ * file goes next to a temporary name and is renamed into place once
+ * complete, so processes starting concurrently never map a partial one. */
+static void cache_begin(void) {
+  cache.descriptors_offset =
+      sizeof(TextureCacheHeader) + count * sizeof(TextureSource);
+  cache.texels_offset =
+      atlas_align(cache.descriptors_offset + count * sizeof(TextureDescriptor));
+  cache.build_descriptors =
+      arena_alloc(&texture_arena, sizeof(TextureDescriptor) * count);
+  cache.claimed = arena_alloc(&texture_arena, sizeof(bool) * count);
+  uint64_t offset = 0;
+  for (unsigned i = 0; i < count; i++) {
+    cache.build_descriptors[i] = descriptors[i];
+    cache.build_descriptors[i].offset = offset / sizeof(uint32_t);
+    cache.claimed[i] = false;
+    offset += atlas_align(sizeof(uint32_t) * descriptors[i].width *
+                          descriptors[i].height);
+  }
+  if (cache.texels_offset + offset > UINT32_MAX) {
+    fprintf(stderr, "Warning: texture set too large to cache\n");
+    return;
+  }
+
+  snprintf(cache.tmp_path, sizeof(cache.tmp_path), "%s.%d",
+           TEXTURE_CACHE_PATH, (int)getpid());
+  cache.fd = open(cache.tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (cache.fd < 0) {
+    fprintf(stderr, "Warning: cannot write texture cache %s: %s\n",
+            cache.tmp_path, strerror(errno));
+    return;
+  }
+  cache.writing = true;
+  cache.next = 0;
+  cache.finished = 0;
+  cache.ok = true;
+}
+
+/* under the streamer lock: whether texture i is still to be written to the
+ * cache, claiming it for the caller if so */
+static bool cache_claim(unsigned i) {
+  if (!cache.writing || cache.claimed[i])
+    return false;
+  cache.claimed[i] = true;
+  return true;
+}
+
+/* under the streamer lock: claim the first texture nobody has, or -1 */
+static int cache_claim_next(void) {
+  if (!cache.writing || !cache.backfill)
+    return -1;
+  while (cache.next < count && cache.claimed[cache.next])
+    cache.next++;
+  if (cache.next == count)
+    return -1;
+  cache.claimed[cache.next] = true;
+  return (int)cache.next;
+}
+
+static bool write_at(int fd, const void *data, size_t size, off_t offset) {
+  const unsigned char *bytes = data;
+  while (size > 0) {
+    ssize_t n = pwrite(fd, bytes, size, offset);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    bytes += n;
+    size -= n;
+    offset += n;
+  }
+  return true;
+}
+
+/* write the column-major texels of claimed texture i; threads write
+ * disjoint ranges, so no lock is needed */
+static bool cache_write(unsigned i, const uint32_t *columns,
+                        uint32_t fallback) {
+  TextureDescriptor *descriptor = &cache.build_descriptors[i];
+  descriptor->fallback = fallback;
+  return write_at(cache.fd, columns,
+                  sizeof(uint32_t) * descriptor->width * descriptor->height,
+                  cache.texels_offset +
+                      (off_t)descriptor->offset * sizeof(uint32_t));
+}
+
+/* under the streamer lock: count a claimed texture as written, or failed.
+ * Returns whether it was the last, so the caller has to cache_finish(). */
+static bool cache_written(bool ok) {
+  cache.ok = cache.ok && ok;
+  if (++cache.finished < count)
+    return false;
+  cache.writing = false;
+  return true;
+}
+
+/* write the header, sources and descriptors once every texture is written,
+ * and rename the file into place */
+static void cache_finish(void) {
+  off_t end = lseek(cache.fd, 0, SEEK_END);
+  /* nothing but empty textures leaves the file short of the texel block */
+  if (end >= 0 && end < (off_t)cache.texels_offset)
+    end = ftruncate(cache.fd, cache.texels_offset) == 0
+              ? (off_t)cache.texels_offset
+              : -1;
+  TextureCacheHeader header = {
+      TEXTURE_CACHE_MAGIC,      TEXTURE_CACHE_VERSION, count,
+      cache.descriptors_offset, cache.texels_offset,   (uint32_t)end};
+  bool ok =
+      cache.ok && end >= 0 &&
+      write_at(cache.fd, &header, sizeof(header), 0) &&
+      write_at(cache.fd, sources, sizeof(TextureSource) * count,
+               sizeof(header)) &&
+      write_at(cache.fd, cache.build_descriptors,
+               sizeof(TextureDescriptor) * count, cache.descriptors_offset);
+  if (close(cache.fd) != 0 || !ok ||
+      rename(cache.tmp_path, TEXTURE_CACHE_PATH) != 0) {
+    fprintf(stderr, "Warning: cannot write texture cache %s\n",
+            TEXTURE_CACHE_PATH);
+    unlink(cache.tmp_path);
+  } else {
+    fprintf(stderr, "textures: wrote %s\n", TEXTURE_CACHE_PATH);
+  }
+  cache.fd = -1;
+}
+
+/* decode claimed texture i, which no slot needed, just for the cache; runs
+ * on a streamer thread with nothing else to do, with its scratch */
+static bool cache_decode(unsigned i, Arena *scratch, TextureStats *stats) {
+  const TextureDescriptor *descriptor = &cache.build_descriptors[i];
+  size_t n = (size_t)descriptor->width * descriptor->height;
+  ArenaMark mark = arena_mark(scratch);
+  uint32_t *columns = arena_alloc(scratch, sizeof(uint32_t) * n);
+  texture_decode(i, columns, scratch, stats);
+  bool ok = cache_write(i, columns, texture_average(columns, n));
+  arena_reset(scratch, mark);
+  return ok;
+}
+
+/* stream one texture into its slot, with its luma, and work out its
+ * fallback color. A texture decoded for the first time goes into the cache
+ * being written too, when write_cache, and returns whether that worked. */
+static bool texture_fill(TextureJob *job, bool write_cache, Arena *scratch,
+                         TextureStats *stats) {
+  const TextureDescriptor *descriptor = &descriptors[job->texture];
+  size_t n = (size_t)descriptor->width * descriptor->height;
+  uint32_t *slot = pool + (size_t)job->slot * slot_texels;
+  bool ok = true;
+  if (cache.image != NULL) {
+    memcpy(slot, cache.texels + cache.descriptors[job->texture].offset,
+           sizeof(uint32_t) * n);
+    job->fallback = cache.descriptors[job->texture].fallback;
+    stats->copied++;
+  } else {
+    texture_decode(job->texture, slot, scratch, stats);
+    job->fallback = texture_average(slot, n);
+    if (write_cache)
+      ok = cache_write(job->texture, slot, job->fallback);
+  }
+  uint8_t *slot_luma = luma + (size_t)job->slot * slot_texels;
+  for (size_t i = 0; i < n; i++)
+    slot_luma[i] = texture_luma(slot[i]);
+  return ok;
+}
+
+static int texture_streamer_thread(void *data) {
+  Arena *scratch = &streamer.scratch[(intptr_t)data];
+  TextureStats stats = {0, 0, 0, 0, 0};
+  SDL_LockMutex(streamer.lock);
+  while (!streamer.quit) {
+    int uncached;
+    bool finish = false;
+    if (streamer.queued > 0) {
+      TextureJob job = streamer.queue[streamer.head];
+      streamer.head = (streamer.head + 1) % num_slots;
+      streamer.queued--;
+      bool write_cache = cache_claim(job.texture);
+      SDL_UnlockMutex(streamer.lock);
+      bool ok = texture_fill(&job, write_cache, scratch, &stats);
+      SDL_LockMutex(streamer.lock);
+      streamer.done[streamer.num_done++] = job;
+      streamer.busy--;
+      SDL_BroadcastCondition(streamer.idle);
+      finish = write_cache && cache_written(ok);
+    } else if ((uncached = cache_claim_next()) >= 0) {
+      /* after a write failed there is no point decoding the rest */
+      bool ok = cache.ok;
+      SDL_UnlockMutex(streamer.lock);
+      ok = ok && cache_decode(uncached, scratch, &stats);
+      SDL_LockMutex(streamer.lock);
+      finish = cache_written(ok);
+    } else {
+      SDL_WaitCondition(streamer.wake, streamer.lock);
+    }
+    if (finish) {
+      SDL_UnlockMutex(streamer.lock);
+      cache_finish();
+      SDL_LockMutex(streamer.lock);
+    }
+  }
+  streamer.stats.decoded += stats.decoded;
+  streamer.stats.copied += stats.copied;
+  streamer.stats.load_ticks += stats.load_ticks;
+  streamer.stats.decode_ticks += stats.decode_ticks;
+  SDL_UnlockMutex(streamer.lock);
+  return 0;
+}
+
+/* make the finished jobs visible to the renderer */
+static void textures_publish(void) {
+  SDL_LockMutex(streamer.lock);
+  for (int i = 0; i < streamer.num_done; i++) {
+    const TextureJob *job = &streamer.done[i];
+    entries[job->texture].state = TEXTURE_RESIDENT;
+    descriptors[job->texture].offset = (uint32_t)job->slot * slot_texels;
+    descriptors[job->texture].fallback = job->fallback;
+    revision++;
+  }
+  streamer.num_done = 0;
+  SDL_UnlockMutex(streamer.lock);
+}
+
+/* reserve a slot for texture i and queue it for streaming. A free slot is
+ * taken first, then the least recently used resident texture that has not
+ * been seen for min_age frames is evicted. */
+static void texture_request(unsigned i, bool visible, uint64_t min_age) {
+  if (entries[i].state != TEXTURE_ABSENT)
+    return;
+
+  int victim = -1;
+  uint64_t oldest = UINT64_MAX;
+  for (int s = 0; s < num_slots; s++) {
+    if (slot_texture[s] < 0) {
+      victim = s;
+      break;
+    }
+    const TextureEntry *entry = &entries[slot_texture[s]];
+    if (entry->state == TEXTURE_RESIDENT &&
+        frame - entry->last_used >= min_age && entry->last_used < oldest) {
+      victim = s;
+      oldest = entry->last_used;
+    }
+  }
+  if (victim < 0)
+    return;
+
+  if (slot_texture[victim] >= 0) {
+    TextureEntry *evicted = &entries[slot_texture[victim]];
+    evicted->state = TEXTURE_ABSENT;
+    evicted->slot = -1;
+    descriptors[slot_texture[victim]].offset = TEXTURE_NOT_RESIDENT;
+    streamer.stats.evicted++;
+    revision++;
+  }
+  slot_texture[victim] = i;
+  entries[i].state = TEXTURE_QUEUED;
+  entries[i].slot = victim;
+
+  TextureJob job = {i, victim, 0};
+  SDL_LockMutex(streamer.lock);
+  if (visible) {
+    streamer.head = (streamer.head + num_slots - 1) % num_slots;
+    streamer.queue[streamer.head] = job;
+  } else {
+    streamer.queue[(streamer.head + streamer.queued) % num_slots] = job;
+  }
+  streamer.queued++;
+  streamer.busy++;
+  SDL_SignalCondition(streamer.wake);
+  SDL_UnlockMutex(streamer.lock);
+}
+
+void textures_load(TextureAtlas *atlas, const char *list_path) {
+  Uint64 start = SDL_GetPerformanceCounter();
+  arena_init(&texture_arena, TEXTURE_ARENA_SIZE);
+  streamer.num_threads = SDL_GetNumLogicalCPUCores();
+  if (streamer.num_threads > TEXTURE_STREAMERS_MAX)
+    streamer.num_threads = TEXTURE_STREAMERS_MAX;
+  if (streamer.num_threads < 1)
+    streamer.num_threads = 1;
+  for (int t = 0; t < streamer.num_threads; t++)
+    arena_init(&streamer.scratch[t], TEXTURE_SCRATCH_ARENA_SIZE);
+  textures_read_list(list_path);
+
+  sources = arena_alloc(&texture_arena, sizeof(TextureSource) * count);
+  descriptors = arena_alloc(&texture_arena, sizeof(TextureDescriptor) * count);
+  for (unsigned i = 0; i < count; i++) {
+    if (!texture_source(&sources[i], entries[i].path)) {
+      fprintf(stderr, "Error reading texture %s: %s\n", entries[i].path,
+              strerror(errno));
+      exit(1);
+    }
+  }
+  if (textures_map_cache()) {
+    for (unsigned i = 0; i < count; i++) {
+      descriptors[i] = cache.descriptors[i];
+      descriptors[i].offset = TEXTURE_NOT_RESIDENT;
+    }
+  } else {
+    textures_read_headers(&streamer.scratch[0]);
+    cache_begin();
+  }
+
+  /* every slot fits the largest texture of the set */
+  slot_texels = 0;
+  for (unsigned i = 0; i < count; i++) {
+    uint32_t size = atlas_align(sizeof(uint32_t) * descriptors[i].width *
+                                descriptors[i].height);
+    if (size / sizeof(uint32_t) > slot_texels)
+      slot_texels = size / sizeof(uint32_t);
+  }
+  if (slot_texels == 0)
+    slot_texels = TEXTURE_ATLAS_ALIGNMENT / sizeof(uint32_t);
+  size_t slots = TEXTURE_BUDGET_BYTES / (sizeof(uint32_t) * slot_texels);
+  if (slots == 0) {
+    fprintf(stderr, "Error: largest texture exceeds the %zu byte budget\n",
+            TEXTURE_BUDGET_BYTES);
+    exit(1);
+  }
+  num_slots = slots < count ? (int)slots : (int)count;
+  pool_size = sizeof(uint32_t) * slot_texels * num_slots;
+  pool = mmap(NULL, pool_mapping_size(), PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (pool == MAP_FAILED) {
+    fprintf(stderr, "Error allocating texture pool: %s\n", strerror(errno));
+    exit(1);
+  }
+  luma = (uint8_t *)(pool + (size_t)slot_texels * num_slots);
+  slot_texture = arena_alloc(&texture_arena, sizeof(int) * num_slots);
+  for (int s = 0; s < num_slots; s++)
+    slot_texture[s] = -1;
+
+  streamer.queue = arena_alloc(&texture_arena, sizeof(TextureJob) * num_slots);
+  streamer.done = arena_alloc(&texture_arena, sizeof(TextureJob) * num_slots);
+  streamer.lock = SDL_CreateMutex();
+  streamer.wake = SDL_CreateCondition();
+  streamer.idle = SDL_CreateCondition();
+  if (streamer.lock == NULL || streamer.wake == NULL || streamer.idle == NULL) {
+    fprintf(stderr, "Error starting texture streamer %s\n", SDL_GetError());
+    exit(1);
+  }
+  for (int t = 0; t < streamer.num_threads; t++) {
+    streamer.threads[t] = SDL_CreateThread(
+        texture_streamer_thread, "texture streamer", (void *)(intptr_t)t);
+    if (streamer.threads[t] == NULL) {
+      fprintf(stderr, "Error starting texture streamer %s\n", SDL_GetError());
+      exit(1);
+    }
+  }
+
+  frame = 0;
+  player_row = player_col = -1;
+  *atlas = (TextureAtlas){pool, luma, descriptors, count};
+  fprintf(stderr,
+          "textures: %u textures, %d slots of %u KB, %s, %d streamers, in "
+          "%.2f ms\n",
+          count, num_slots, (unsigned)(slot_texels * sizeof(uint32_t) / 1024),
+          cache.image != NULL ? "streaming from " TEXTURE_CACHE_PATH
+                              : "decoding on demand",
+          streamer.num_threads,
+          ticks_to_ms(SDL_GetPerformanceCounter() - start));
+}
+
+/* look ahead whenever the player enters another tile */
+static void textures_prefetch(const Map *map, const Player *player) {
+  int row = (int)(player->y / TILE_SIZE);
+  int col = (int)(player->x / TILE_SIZE);
+  if (row == player_row && col == player_col)
+    return;
+  player_row = row;
+  player_col = col;
+  for (int y = row - TEXTURE_PREFETCH_RADIUS;
+       y <= row + TEXTURE_PREFETCH_RADIUS; y++) {
+    for (int x = col - TEXTURE_PREFETCH_RADIUS;
+         x <= col + TEXTURE_PREFETCH_RADIUS; x++) {
+      int content = map_content(map, y, x);
+      if (content >= 1 && (unsigned)content <= count)
+        texture_request(content - 1, false, TEXTURE_PREFETCH_MIN_AGE);
+    }
+  }
+}
+
+void textures_update(const Map *map, const RayBuffer *rays, int num_buffers,
+                     const Player *player) {
+  textures_publish();
+
+  /* every texture seen this frame is stamped before any is requested, so a
+   * request cannot evict one seen this frame but further along the rays */
+  for (int b = 0; b < num_buffers; b++) {
+    for (int i = 0; i < rays[b].count; i++) {
+      int content = rays[b].content[i];
+      if (content >= 1 && (unsigned)content <= count)
+        entries[content - 1].last_used = frame;
+    }
+  }
+  for (int b = 0; b < num_buffers; b++) {
+    for (int i = 0; i < rays[b].count; i++) {
+      int content = rays[b].content[i];
+      if (content >= 1 && (unsigned)content <= count &&
+          entries[content - 1].state == TEXTURE_ABSENT)
+        texture_request(content - 1, true, 1);
+    }
+  }
+
+  if (player != NULL)
+    textures_prefetch(map, player);
+
+  /* nothing has been drawn yet; rather than flash fallback colors on the
+   * first frame, wait for what it needs */
+  if (frame == 0) {
+    textures_wait();
+    SDL_LockMutex(streamer.lock);
+    cache.backfill = true;
+    SDL_BroadcastCondition(streamer.wake);
+    SDL_UnlockMutex(streamer.lock);
+  }
+  frame++;
+}
+
+void textures_wait(void) {
+  SDL_LockMutex(streamer.lock);
+  while (streamer.busy > 0)
+    SDL_WaitCondition(streamer.idle, streamer.lock);
+  SDL_UnlockMutex(streamer.lock);
+  textures_publish();
+}
+
+void textures_require(const Map *map) {
+  for (int row = 0; row < map_num_rows(map); row++) {
+    for (int col = 0; col < map_num_cols(map); col++) {
+      int content = map_content(map, row, col);
+      if (content >= 1 && (unsigned)content <= count)
+        texture_request(content - 1, false, UINT64_MAX);
+    }
+  }
+  textures_wait();
+}
+
+void textures_unload(TextureAtlas *atlas) {
+  if (streamer.num_threads > 0) {
+    SDL_LockMutex(streamer.lock);
+    streamer.quit = true;
+    SDL_BroadcastCondition(streamer.wake);
+    SDL_UnlockMutex(streamer.lock);
+  }
+  for (int t = 0; t < streamer.num_threads; t++)
+    SDL_WaitThread(streamer.threads[t], NULL);
+  if (count > 0)
+    fprintf(stderr,
+            "textures: %u decoded, load %.2f ms decode %.2f ms, %u copied "
+            "from the cache, %u evicted\n",
+            streamer.stats.decoded, ticks_to_ms(streamer.stats.load_ticks),
+            ticks_to_ms(streamer.stats.decode_ticks), streamer.stats.copied,
+            streamer.stats.evicted);
+  SDL_DestroyCondition(streamer.idle);
+  SDL_DestroyCondition(streamer.wake);
+  SDL_DestroyMutex(streamer.lock);
+  if (cache.writing) {
+    close(cache.fd);
+    unlink(cache.tmp_path);
+  }
+  if (cache.image != NULL)
+    munmap(cache.image, cache.size);
+  if (pool != NULL)
+    munmap(pool, pool_mapping_size());
+  for (int t = 0; t < streamer.num_threads; t++)
+    arena_release(&streamer.scratch[t]);
+  arena_release(&texture_arena);
+  memset(&streamer, 0, sizeof(streamer));
+  memset(&cache, 0, sizeof(cache));
+  pool = NULL;
+  luma = NULL;
+  pool_size = 0;
+  entries = NULL;
+  sources = NULL;
+  descriptors = NULL;
+  count = 0;
+  revision++;
+  *atlas = (TextureAtlas){NULL, NULL, NULL, 0};
+}
+
+void textures_print_hashes(const char *list_path) {
+  arena_init(&texture_arena, TEXTURE_ARENA_SIZE);
+  Arena scratch;
+  arena_init(&scratch, TEXTURE_SCRATCH_ARENA_SIZE);
+  textures_read_list(list_path);
+  for (unsigned i = 0; i < count; i++) {
+    ArenaMark mark = arena_mark(&scratch);
+    upng_allocator allocator = {texture_scratch_alloc, NULL, &scratch};
+    upng_t *png = upng_new_from_file_using(entries[i].path, &allocator);
+    if (png == NULL || upng_decode(png) != UPNG_EOK) {
+      fprintf(stderr, "Error decoding texture %s\n", entries[i].path);
+      exit(1);
+    }
+    /* the bytes as decoded, whatever the format */
+    const unsigned char *bytes = upng_get_buffer(png);
+    uint64_t hash = 1469598103934665603ull;
+    for (unsigned b = 0; b < upng_get_size(png); b++)
+      hash = (hash ^ bytes[b]) * 1099511628211ull;
+    printf("%s %ux%u format %d %016llx\n", entries[i].path,
+           upng_get_width(png), upng_get_height(png), (int)upng_get_format(png),
+           (unsigned long long)hash);
+    upng_free(png);
+    arena_reset(&scratch, mark);
+  }
+  arena_release(&scratch);
+  arena_release(&texture_arena);
+  entries = NULL;
+  count = 0;
+}
+
+unsigned textures_revision(void) { return revision; }
+
+const TextureDescriptor *texture_atlas_lookup(const TextureAtlas *atlas,
+                                              int content) {
+  if (content < 1 || (unsigned)content > atlas->count)
+    return NULL;
+  return &atlas->descriptors[content - 1];
+}
+
+uint8_t texture_size_shift(unsigned size) {
+  if (size == 0 || (size & (size - 1)) != 0)
+    return TEXTURE_NO_SHIFT;
+  return __builtin_ctz(size);
+}
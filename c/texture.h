@@ -0,0 +1,102 @@
+#pragma once
+
+#include "defs.h"
+#include "player.h"
+#include "ray.h"
+#include <stdint.h>
+
+#define TEXTURE_CACHE_PATH "target/textures.cache"
+#define TEXTURE_CACHE_MAGIC "RCTX"
+#define TEXTURE_CACHE_VERSION 4
+#define TEXTURE_ATLAS_ALIGNMENT 64
+#define TEXTURE_MISSING_COLOR 0xFFFF00FF
+#define TEXTURE_FALLBACK_COLOR 0xFF808080
+#define TEXTURE_NOT_RESIDENT UINT32_MAX
+/* size shift of a texture side that is not a power of two */
+#define TEXTURE_NO_SHIFT 0xFF
+
+/* texels kept decoded at any one time, whatever the size of the set */
+#define TEXTURE_BUDGET_BYTES ((size_t)32 << 20)
+/* tiles around the player whose textures are streamed in ahead of time */
+#define TEXTURE_PREFETCH_RADIUS 6
+/* frames a texture has to go unseen before a prefetch may evict it */
+#define TEXTURE_PREFETCH_MIN_AGE 120
+
+typedef struct TextureDescriptor TextureDescriptor;
+typedef struct TextureAtlas TextureAtlas;
+
+typedef enum TextureLayout {
+  /* texel (x, y) at offset + height * x + y, so a wall strip reads one
+   * contiguous run of height texels */
+  TEXTURE_LAYOUT_COLUMN_MAJOR = 0,
+} TextureLayout;
+
+/* where one RGBA8 wall texture sits in the atlas */
+struct TextureDescriptor {
+  uint32_t offset; /* in texels from the atlas base, TEXTURE_ATLAS_ALIGNMENT
+                      aligned; TEXTURE_NOT_RESIDENT until streamed in */
+  uint16_t width;
+  uint16_t height;
+  uint16_t layout;
+  uint8_t width_shift;  /* log2(width), or TEXTURE_NO_SHIFT */
+  uint8_t height_shift; /* log2(height), or TEXTURE_NO_SHIFT */
+  uint32_t fallback;    /* average color, drawn while not resident */
+};
+
+/* The wall textures, indexed by map content - 1. Texels of resident textures
+ * live in one aligned block of fixed-size slots; the rest are streamed in on
+ * demand and evicted least recently used first. */
+struct TextureAtlas {
+  const uint32_t *texels;
+  /* texture_luma() of every texel at its offset, readable 3 bytes past the
+   * last for gathers of 4 */
+  const uint8_t *luma;
+  const TextureDescriptor *descriptors;
+  unsigned count;
+};
+
+/* list_path names a file with one PNG path per line, NULL for the built-in
+ * wall set. Returns once every header is known; no texels are decoded. */
+void textures_load(TextureAtlas *atlas, const char *list_path);
+/* once per frame, after the rays are cast and before they are drawn: publish
+ * textures that finished streaming, and queue those hit by the num_buffers
+ * ray buffers at rays and those near the player on map, if there is one.
+ * Publishing changes the atlas every renderer reads, so no renderer may draw
+ * meanwhile. */
+void textures_update(const Map *map, const RayBuffer *rays, int num_buffers,
+                     const Player *player);
+/* wait until every texture queued so far is streamed in, then publish it,
+ * so what is resident no longer depends on how fast the streamer was */
+void textures_wait(void);
+/* queue the texture of every wall on map, as many as the budget holds
+ * without evicting any, and textures_wait() for them */
+void textures_require(const Map *map);
+void textures_unload(TextureAtlas *atlas);
+/* decode every PNG of the list (NULL for the built-in set) and print its
+ * path, size, format and a hash of the decoded bytes, one line each on
+ * stdout, to diff the inflate of one build against another's */
+void textures_print_hashes(const char *list_path);
+/* changes whenever a texture is published or evicted, that is whenever the
+ * same rays may draw differently than they did before */
+unsigned textures_revision(void);
+
+/* descriptor for a map content value, NULL when there is no such texture */
+const TextureDescriptor *texture_atlas_lookup(const TextureAtlas *atlas,
+                                              int content);
+/* log2(size) when size is a power of two, TEXTURE_NO_SHIFT otherwise */
+uint8_t texture_size_shift(unsigned size);
+
+/* the brightness of an RGBA8 color, 0 to 255, by weights summing to 256 */
+static inline uint8_t texture_luma(uint32_t color) {
+  return (77 * (color & 0xFF) + 150 * (color >> 8 & 0xFF) +
+          29 * (color >> 16 & 0xFF) + 128) >>
+         8;
+}
+
+/* atlas offset of texel column x, by shifting for power-of-two heights */
+static inline uint32_t texture_column(const TextureDescriptor *texture,
+                                      int x) {
+  if (texture->height_shift != TEXTURE_NO_SHIFT)
+    return texture->offset + ((uint32_t)x << texture->height_shift);
+  return texture->offset + (uint32_t)x * texture->height;
+}
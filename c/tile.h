@@ -0,0 +1,37 @@
+#pragma once
+
+#include "defs.h"
+#include <math.h>
+
+/* Cell lookups. When TILE_SIZE is a whole power of two they compile down to
+ * integer shifts and masks, for any other size they fall back to dividing;
+ * both give the same cells. */
+#define TILE_SIZE_INT ((int)TILE_SIZE)
+#define TILE_SIZE_IS_POW2                                                      \
+  (TILE_SIZE == TILE_SIZE_INT && (TILE_SIZE_INT & (TILE_SIZE_INT - 1)) == 0)
+/* log2(TILE_SIZE), only meaningful when TILE_SIZE_IS_POW2 */
+#define TILE_SHIFT __builtin_ctz(TILE_SIZE_INT)
+
+/* floor(coordinate / TILE_SIZE) */
+static inline int tile_floor(float coordinate) {
+  if (TILE_SIZE_IS_POW2) {
+    int whole = (int)coordinate;
+    whole -= coordinate < whole;
+    return whole >> TILE_SHIFT;
+  }
+  return (int)floor(coordinate / TILE_SIZE);
+}
+
+/* coordinate / TILE_SIZE rounded toward zero */
+static inline int tile_trunc(float coordinate) {
+  if (TILE_SIZE_IS_POW2)
+    return (int)coordinate / TILE_SIZE_INT;
+  return (int)(coordinate / TILE_SIZE);
+}
+
+/* position of a coordinate >= 0 within its tile */
+static inline int tile_offset(int coordinate) {
+  if (TILE_SIZE_IS_POW2)
+    return coordinate & (TILE_SIZE_INT - 1);
+  return coordinate % TILE_SIZE_INT;
+}
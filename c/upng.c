@@ -25,12 +25,28 @@ must not be misrepresented as being the original software.
 */
 
 #include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "upng.h"
 
+#if defined(__unix__) || defined(__APPLE__)
+#define UPNG_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) &&        \
+    !defined(UPNG_NO_SIMD)
+#define UPNG_X86_SIMD 1
+#include <immintrin.h>
+#define UPNG_TARGET(isa) __attribute__((target(isa)))
+#endif
+
 #define MAKE_BYTE(b) ((b) & 0xFF)
 #define MAKE_DWORD(a, b, c, d)                                                 \
   ((MAKE_BYTE(a) << 24) | (MAKE_BYTE(b) << 16) | (MAKE_BYTE(c) << 8) |         \
@@ -86,10 +102,17 @@ typedef enum upng_color {
   UPNG_RGBA = 6
 } upng_color;
 
+/* who releases the source buffer in upng_free_source() */
+typedef enum upng_source_owner {
+  UPNG_SOURCE_BORROWED = 0, /* caller's memory, left alone */
+  UPNG_SOURCE_HEAP = 1,     /* file read into the decoder's allocator */
+  UPNG_SOURCE_MAPPED = 2    /* read-only mapping of a file */
+} upng_source_owner;
+
 typedef struct upng_source {
   const unsigned char *buffer;
   unsigned long size;
-  char owning;
+  upng_source_owner owner;
 } upng_source;
 
 struct upng_t {
@@ -102,14 +125,49 @@ struct upng_t {
 
   unsigned char *buffer;
   unsigned long size;
+  char buffer_owning;
 
   upng_error error;
   unsigned error_line;
 
   upng_state state;
   upng_source source;
+  upng_allocator allocator;
 };
 
+static void *upng_default_alloc(void *context, unsigned long size) {
+  (void)context;
+  return malloc(size);
+}
+
+static void upng_default_free(void *context, void *ptr) {
+  (void)context;
+  free(ptr);
+}
+
+static const upng_allocator upng_default_allocator = {
+    upng_default_alloc, upng_default_free, NULL};
+
+static void *upng_alloc(upng_t *upng, unsigned long size) {
+  return upng->allocator.alloc(upng->allocator.context, size);
+}
+
+static void upng_dealloc(upng_t *upng, void *ptr) {
+  if (ptr != NULL && upng->allocator.free != NULL) {
+    upng->allocator.free(upng->allocator.context, ptr);
+  }
+}
+
+/* scanline unfilter implementations, picked per image at decode time */
+static upng_simd unfilter_simd_limit = UPNG_SIMD_AVX2;
+
+static upng_simd unfilter_simd_level(void);
+static void unfilter_scanline(upng_t *upng, unsigned char *recon,
+                              const unsigned char *scanline,
+                              const unsigned char *precon,
+                              unsigned long bytewidth, unsigned char filterType,
+                              unsigned long length, upng_simd simd);
+
 typedef struct huffman_tree {
   unsigned *tree2d;
   unsigned maxbitlen; /*maximum number of bits a single code can get */
@@ -145,6 +203,32 @@ static const unsigned
                                    generated */
     = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
 
+/* check the two byte zlib header in front of the deflate stream */
+static void zlib_header_check(upng_t *upng, unsigned cmf, unsigned flg) {
+  /* 256 * cmf + flg must be a multiple of 31, the FCHECK value is supposed
+   * to be made that way */
+  if ((cmf * 256 + flg) % 31 != 0) {
+    SET_ERROR(upng, UPNG_EMALFORMED);
+    return;
+  }
+
+  /*error: only compression method 8: inflate with sliding window of 32k is
+   * supported by the PNG spec */
+  if ((cmf & 15) != 8 || ((cmf >> 4) & 15) > 7) {
+    SET_ERROR(upng, UPNG_EMALFORMED);
+    return;
+  }
+
+  /* the specification of PNG says about the zlib stream: "The additional flags
+   * shall not specify a preset dictionary." */
+  if (((flg >> 5) & 1) != 0) {
+    SET_ERROR(upng, UPNG_EMALFORMED);
+  }
+}
+
+/* the reference inflate below walks a 2D huffman tree one bit at a time; it is
+ * only compiled in for validating the table-driven path */
+#if defined(UPNG_REFERENCE_INFLATE)
 static const unsigned FIXED_DEFLATE_CODE_TREE[NUM_DEFLATE_CODE_SYMBOLS * 2] = {
     289, 370, 290, 307, 546, 291, 561, 292, 293, 300, 294, 297, 295, 296, 0,
     1,   2,   3,   298, 299, 4,   5,   6,   7,   301, 304, 302, 303, 8,   9,
@@ -517,8 +601,8 @@ static void inflate_huffman(upng_t *upng, unsigned char *out,
                       NUM_DEFLATE_CODE_SYMBOLS, DEFLATE_CODE_BITLEN);
     huffman_tree_init(&codetreeD, (unsigned *)FIXED_DISTANCE_TREE,
                       NUM_DISTANCE_SYMBOLS, DISTANCE_BITLEN);
-  } else if (btype == 2) {
-    /* dynamic trees */
+  } else {
+    /* dynamic trees, btype 2: the caller rejected 3 and stored 0 */
     unsigned codelengthcodetree_buffer[CODE_LENGTH_BUFFER_SIZE];
     huffman_tree codelengthcodetree;
 
@@ -716,24 +800,8 @@ static upng_error uz_inflate(upng_t *upng, unsigned char *out,
     return upng->error;
   }
 
-  /* 256 * in[0] + in[1] must be a multiple of 31, the FCHECK value is supposed
-   * to be made that way */
-  if ((in[0] * 256 + in[1]) % 31 != 0) {
-    SET_ERROR(upng, UPNG_EMALFORMED);
-    return upng->error;
-  }
-
-  /*error: only compression method 8: inflate with sliding window of 32k is
-   * supported by the PNG spec */
-  if ((in[0] & 15) != 8 || ((in[0] >> 4) & 15) > 7) {
-    SET_ERROR(upng, UPNG_EMALFORMED);
-    return upng->error;
-  }
-
-  /* the specification of PNG says about the zlib stream: "The additional flags
-   * shall not specify a preset dictionary." */
-  if (((in[1] >> 5) & 1) != 0) {
-    SET_ERROR(upng, UPNG_EMALFORMED);
+  zlib_header_check(upng, in[0], in[1]);
+  if (upng->error != UPNG_EOK) {
     return upng->error;
   }
 
@@ -743,188 +811,1090 @@ static upng_error uz_inflate(upng_t *upng, unsigned char *out,
   return upng->error;
 }
 
-/*Paeth predicter, used by PNG filter type 4*/
-static int paeth_predictor(int a, int b, int c) {
-  int p = a + b - c;
-  int pa = p > a ? p - a : a - p;
-  int pb = p > b ? p - b : b - p;
-  int pc = p > c ? p - c : c - p;
+#else
 
-  if (pa <= pb && pa <= pc)
-    return a;
-  else if (pb <= pc)
-    return b;
-  else
-    return c;
+/*
+   Table-driven inflate, used unless UPNG_REFERENCE_INFLATE is defined (the
+   bit-by-bit tree walker above is kept for validating this path). Bits are
+   pulled from a 64-bit buffer refilled a word at a time, and a symbol is
+   decoded with one lookup of the next HUFFMAN_ROOT_BITS bits, plus a single
+   subtable lookup for the rare codes longer than that.
+
+   It runs as a stream: the bit reader hops from one IDAT chunk to the next
+   in the source buffer, and the inflated (still filtered) scanlines go to a
+   sliding window that holds the 32K of history back-references may need.
+   Rows are unfiltered straight from the window into the destination image as
+   they complete, so no compressed or inflated copy of the image is made.
+*/
+#define HUFFMAN_ROOT_BITS 10
+#define HUFFMAN_TABLE_SIZE 2048 /* root table plus room for every subtable */
+#define HUFFMAN_ENTRY_LINK 0x20 /* entry points to a subtable */
+#define HUFFMAN_ENTRY_BITS 0x1f /* code bits, or subtable index bits */
+#define HUFFMAN_INVALID 0xffff  /* decoded from an unused code */
+
+#define DEFLATE_WINDOW_SIZE 32768 /* longest back-reference distance */
+#define DEFLATE_MAX_MATCH 258     /* longest back-reference length */
+
+/* table entry: symbol (or subtable offset) << 16 | flags | bits. An entry of
+ * 0 marks a code that is not part of an incomplete code set. */
+typedef struct huffman_table {
+  unsigned root_bits;
+  unsigned entries[HUFFMAN_TABLE_SIZE];
+} huffman_table;
+
+typedef struct bit_reader {
+  const unsigned char *in; /* payload of the current IDAT chunk */
+  unsigned long size;
+  unsigned long pos;   /* next byte to load from in */
+  uint64_t buf;        /* unread bits, next bit in the lsb */
+  unsigned count;      /* number of valid bits in buf */
+  unsigned long zeros; /* zero bytes shifted in after the last IDAT chunk */
+  const unsigned char *chunk; /* current chunk, NULL once all are read */
+  const unsigned char *end;   /* end of the source buffer */
+} bit_reader;
+
+typedef struct inflate_stream {
+  bit_reader br;
+  unsigned char *window; /* filtered scanlines, keeps 32K of history */
+  unsigned long size;    /* window size */
+  unsigned long pos;     /* inflate write position in the window */
+  unsigned long row;     /* window offset of the next scanline to unfilter */
+  unsigned char *out;    /* destination image */
+  unsigned char *rows[2]; /* unfilter targets when rows are bit-padded */
+  unsigned long linebytes;
+  unsigned long bytewidth;
+  unsigned w, h, bpp, y;
+  upng_simd simd;
+} inflate_stream;
+
+static uint64_t load_le64(const unsigned char *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  v = __builtin_bswap64(v);
+#endif
+  return v;
 }
 
-static void unfilter_scanline(upng_t *upng, unsigned char *recon,
-                              const unsigned char *scanline,
-                              const unsigned char *precon,
-                              unsigned long bytewidth, unsigned char filterType,
-                              unsigned long length) {
-  /*
-     For PNG filter method 0
-     unfilter a PNG image scanline by scanline. when the pixels are smaller than
-     1 byte, the filter works byte per byte (bytewidth = 1) precon is the
-     previous unfiltered scanline, recon the result, scanline the current one
-     the incoming scanlines do NOT include the filtertype byte, that one is
-     given in the parameter filterType instead recon and scanline MAY be the
-     same memory address! precon must be disjoint.
-   */
-
-  unsigned long i;
-  switch (filterType) {
-  case 0:
-    for (i = 0; i < length; i++)
-      recon[i] = scanline[i];
-    break;
-  case 1:
-    for (i = 0; i < bytewidth; i++)
-      recon[i] = scanline[i];
-    for (i = bytewidth; i < length; i++)
-      recon[i] = scanline[i] + recon[i - bytewidth];
-    break;
-  case 2:
-    if (precon)
-      for (i = 0; i < length; i++)
-        recon[i] = scanline[i] + precon[i];
-    else
-      for (i = 0; i < length; i++)
-        recon[i] = scanline[i];
-    break;
-  case 3:
-    if (precon) {
-      for (i = 0; i < bytewidth; i++)
-        recon[i] = scanline[i] + precon[i] / 2;
-      for (i = bytewidth; i < length; i++)
-        recon[i] = scanline[i] + ((recon[i - bytewidth] + precon[i]) / 2);
-    } else {
-      for (i = 0; i < bytewidth; i++)
-        recon[i] = scanline[i];
-      for (i = bytewidth; i < length; i++)
-        recon[i] = scanline[i] + recon[i - bytewidth] / 2;
+/* move on to the next IDAT chunk; the chunks were validated up front */
+static int br_next_chunk(bit_reader *br) {
+  const unsigned char *chunk = br->chunk;
+  while (chunk != NULL) {
+    chunk += upng_chunk_length(chunk) + 12;
+    if (chunk >= br->end || upng_chunk_type(chunk) == CHUNK_IEND) {
+      chunk = NULL;
+    } else if (upng_chunk_type(chunk) == CHUNK_IDAT) {
+      br->chunk = chunk;
+      br->in = chunk + 8;
+      br->size = upng_chunk_length(chunk);
+      br->pos = 0;
+      return 1;
     }
-    break;
-  case 4:
-    if (precon) {
-      for (i = 0; i < bytewidth; i++)
-        recon[i] =
-            (unsigned char)(scanline[i] + paeth_predictor(0, precon[i], 0));
-      for (i = bytewidth; i < length; i++)
-        recon[i] =
-            (unsigned char)(scanline[i] +
-                            paeth_predictor(recon[i - bytewidth], precon[i],
-                                            precon[i - bytewidth]));
-    } else {
-      for (i = 0; i < bytewidth; i++)
-        recon[i] = scanline[i];
-      for (i = bytewidth; i < length; i++)
-        recon[i] = (unsigned char)(scanline[i] +
-                                   paeth_predictor(recon[i - bytewidth], 0, 0));
+  }
+  br->chunk = NULL;
+  return 0;
+}
+
+/* top up the bit buffer to at least 56 bits. Past the last IDAT chunk zeros
+ * are shifted in; br_overrun() reports whether any of them got consumed. */
+static void br_refill(bit_reader *br) {
+  if (br->pos + 8 <= br->size) {
+    br->buf |= load_le64(br->in + br->pos) << br->count;
+    br->pos += (63 - br->count) >> 3;
+    br->count |= 56;
+  } else {
+    while (br->count <= 56) {
+      if (br->pos == br->size && !br_next_chunk(br)) {
+        br->zeros++;
+      } else {
+        br->buf |= (uint64_t)br->in[br->pos++] << br->count;
+      }
+      br->count += 8;
     }
-    break;
-  default:
-    SET_ERROR(upng, UPNG_EMALFORMED);
-    break;
   }
 }
 
-static void unfilter(upng_t *upng, unsigned char *out, const unsigned char *in,
-                     unsigned w, unsigned h, unsigned bpp) {
-  /*
-     For PNG filter method 0
-     this function unfilters a single image (e.g. without interlacing this is
-     called once, with Adam7 it's called 7 times) out must have enough bytes
-     allocated already, in must have the scanlines + 1 filtertype byte per
-     scanline w and h are image dimensions or dimensions of reduced image, bpp
-     is bpp per pixel in and out are allowed to be the same memory address!
-   */
+static int br_overrun(const bit_reader *br) {
+  return br->zeros * 8 > br->count;
+}
 
-  unsigned y;
-  unsigned char *prevline = 0;
+static void br_consume(bit_reader *br, unsigned nbits) {
+  br->buf >>= nbits;
+  br->count -= nbits;
+}
 
-  unsigned long bytewidth =
-      (bpp + 7) / 8; /*bytewidth is used for filtering, is 1 when bpp < 8,
-                        number of bytes per pixel otherwise */
-  unsigned long linebytes = (w * bpp + 7) / 8;
+static unsigned br_bits(bit_reader *br, unsigned nbits) {
+  unsigned result;
+  if (br->count < nbits) {
+    br_refill(br);
+  }
+  result = (unsigned)(br->buf & ((1u << nbits) - 1));
+  br_consume(br, nbits);
+  return result;
+}
 
-  for (y = 0; y < h; y++) {
-    unsigned long outindex = linebytes * y;
-    unsigned long inindex =
-        (1 + linebytes) * y; /*the extra filterbyte added to each row */
-    unsigned char filterType = in[inindex];
+/* copy whole bytes out of a byte-aligned stream, across chunk boundaries */
+static int br_read_bytes(bit_reader *br, unsigned char *dst, unsigned long n) {
+  while (n > 0 && br->count >= 8) {
+    *dst++ = (unsigned char)br->buf;
+    br_consume(br, 8);
+    n--;
+  }
+  if (n > 0) {
+    /* a word refill leaves bits beyond count behind; they would be stale once
+     * bytes are taken from the input directly */
+    br->buf = 0;
+  }
+  while (n > 0) {
+    unsigned long available;
+    if (br->pos == br->size && !br_next_chunk(br)) {
+      return 0;
+    }
+    available = br->size - br->pos;
+    if (available > n) {
+      available = n;
+    }
+    memcpy(dst, br->in + br->pos, available);
+    br->pos += available;
+    dst += available;
+    n -= available;
+  }
+  return 1;
+}
 
-    unfilter_scanline(upng, &out[outindex], &in[inindex + 1], prevline,
-                      bytewidth, filterType, linebytes);
-    if (upng->error != UPNG_EOK) {
+/* build the lookup table for the canonical code given by the code lengths */
+static void huffman_table_build(upng_t *upng, huffman_table *table,
+                                const unsigned *bitlen, unsigned numcodes) {
+  unsigned blcount[MAX_BIT_LENGTH + 1];
+  unsigned nextcode[MAX_BIT_LENGTH + 1];
+  unsigned prefixcode[MAX_BIT_LENGTH + 1];
+  unsigned char prefixlen[1 << HUFFMAN_ROOT_BITS];
+  unsigned maxbitlen = 0, root, rootmask, used, code, bits, n, i;
+  long left = 1;
+
+  memset(blcount, 0, sizeof(blcount));
+  for (n = 0; n < numcodes; n++) {
+    blcount[bitlen[n]]++;
+    if (bitlen[n] > maxbitlen) {
+      maxbitlen = bitlen[n];
+    }
+  }
+  blcount[0] = 0;
+
+  /* reject oversubscribed code sets; incomplete ones are allowed and leave
+   * zero (invalid) entries behind */
+  for (bits = 1; bits <= MAX_BIT_LENGTH; bits++) {
+    left = (left << 1) - (long)blcount[bits];
+    if (left < 0) {
+      SET_ERROR(upng, UPNG_EMALFORMED);
       return;
     }
+  }
 
-    prevline = &out[outindex];
+  code = 0;
+  nextcode[0] = 0;
+  for (bits = 1; bits <= MAX_BIT_LENGTH; bits++) {
+    code = (code + blcount[bits - 1]) << 1;
+    nextcode[bits] = code;
   }
-}
 
-static void remove_padding_bits(unsigned char *out, const unsigned char *in,
-                                unsigned long olinebits,
-                                unsigned long ilinebits, unsigned h) {
-  /*
-     After filtering there are still padding bpp if scanlines have non multiple
-     of 8 bit amounts. They need to be removed (except at last scanline of
-     (Adam7-reduced) image) before working with pure image buffers for the Adam7
-     code, the color convert code and the output to the user. in and out are
-     allowed to be the same buffer, in may also be higher but still overlapping;
-     in must have >= ilinebits*h bpp, out must have >= olinebits*h bpp,
-     olinebits must be <= ilinebits also used to move bpp after earlier such
-     operations happened, e.g. in a sequence of reduced images from Adam7 only
-     useful if (ilinebits - olinebits) is a value in the range 1..7
-   */
-  unsigned y;
-  unsigned long diff = ilinebits - olinebits;
-  unsigned long obp = 0, ibp = 0; /*bit pointers */
-  for (y = 0; y < h; y++) {
-    unsigned long x;
-    for (x = 0; x < olinebits; x++) {
-      unsigned char bit =
-          (unsigned char)((in[(ibp) >> 3] >> (7 - ((ibp) & 0x7))) & 1);
-      ibp++;
+  root = maxbitlen < HUFFMAN_ROOT_BITS ? maxbitlen : HUFFMAN_ROOT_BITS;
+  if (root == 0) {
+    root = 1;
+  }
+  rootmask = (1u << root) - 1;
+  table->root_bits = root;
+  memset(table->entries, 0, sizeof(unsigned) << root);
+
+  /* codes longer than the root go to a subtable per root prefix, sized for
+   * the longest code sharing that prefix */
+  used = 1u << root;
+  if (maxbitlen > root) {
+    memset(prefixlen, 0, sizeof(prefixlen));
+    memcpy(prefixcode, nextcode, sizeof(prefixcode));
+    for (n = 0; n < numcodes; n++) {
+      unsigned len = bitlen[n], rev = 0;
+      if (len <= root) {
+        continue;
+      }
+      code = prefixcode[len]++;
+      for (i = 0; i < len; i++) {
+        rev = (rev << 1) | ((code >> i) & 1);
+      }
+      if (len > prefixlen[rev & rootmask]) {
+        prefixlen[rev & rootmask] = (unsigned char)len;
+      }
+    }
+    for (n = 0; n <= rootmask; n++) {
+      unsigned subbits;
+      if (prefixlen[n] == 0) {
+        continue;
+      }
+      subbits = prefixlen[n] - root;
+      if (used + (1u << subbits) > HUFFMAN_TABLE_SIZE) {
+        SET_ERROR(upng, UPNG_EMALFORMED);
+        return;
+      }
+      table->entries[n] = (used << 16) | HUFFMAN_ENTRY_LINK | subbits;
+      memset(table->entries + used, 0, sizeof(unsigned) << subbits);
+      used += 1u << subbits;
+    }
+  }
 
-      if (bit == 0)
-        out[(obp) >> 3] &= (unsigned char)(~(1 << (7 - ((obp) & 0x7))));
-      else
-        out[(obp) >> 3] |= (1 << (7 - ((obp) & 0x7)));
-      ++obp;
+  /* deflate sends codes msb first but we read lsb first, so every code is
+   * stored bit-reversed and replicated over the bits that follow it */
+  for (n = 0; n < numcodes; n++) {
+    unsigned len = bitlen[n], rev = 0;
+    if (len == 0) {
+      continue;
+    }
+    code = nextcode[len]++;
+    for (i = 0; i < len; i++) {
+      rev = (rev << 1) | ((code >> i) & 1);
+    }
+    if (len <= root) {
+      for (i = rev; i <= rootmask; i += 1u << len) {
+        table->entries[i] = (n << 16) | len;
+      }
+    } else {
+      unsigned link = table->entries[rev & rootmask];
+      unsigned base = link >> 16, subbits = link & HUFFMAN_ENTRY_BITS;
+      for (i = rev >> root; i < (1u << subbits); i += 1u << (len - root)) {
+        table->entries[base + i] = (n << 16) | (len - root);
+      }
     }
-    ibp += diff;
   }
 }
 
-/*out must be buffer big enough to contain full image, and in must contain the
- * full decompressed data from the IDAT chunks*/
-static void post_process_scanlines(upng_t *upng, unsigned char *out,
-                                   unsigned char *in, const upng_t *info_png) {
-  unsigned bpp = upng_get_bpp(info_png);
-  unsigned w = info_png->width;
-  unsigned h = info_png->height;
-
-  if (bpp == 0) {
-    SET_ERROR(upng, UPNG_EMALFORMED);
-    return;
+/* the caller guarantees at least MAX_BIT_LENGTH bits in the buffer */
+static unsigned huffman_table_decode(bit_reader *br,
+                                     const huffman_table *table) {
+  unsigned entry =
+      table->entries[br->buf & ((1u << table->root_bits) - 1)];
+  if (entry & HUFFMAN_ENTRY_LINK) {
+    br_consume(br, table->root_bits);
+    entry = table->entries[(entry >> 16) +
+                           (br->buf & ((1u << (entry & HUFFMAN_ENTRY_BITS)) -
+                                       1))];
   }
+  if ((entry & HUFFMAN_ENTRY_BITS) == 0) {
+    return HUFFMAN_INVALID;
+  }
+  br_consume(br, entry & HUFFMAN_ENTRY_BITS);
+  return entry >> 16;
+}
 
-  if (bpp < 8 && w * bpp != ((w * bpp + 7) / 8) * 8) {
-    unfilter(upng, in, in, w, h, bpp);
-    if (upng->error != UPNG_EOK) {
-      return;
-    }
-    remove_padding_bits(out, in, w * bpp, ((w * bpp + 7) / 8) * 8, h);
-  } else {
-    unfilter(upng, out, in, w, h, bpp); /*we can immediatly filter into the out
-                                           buffer, no other steps needed */
+static void huffman_tables_fixed(upng_t *upng, huffman_table *codetable,
+                                 huffman_table *codetableD) {
+  unsigned bitlen[NUM_DEFLATE_CODE_SYMBOLS];
+  unsigned bitlenD[NUM_DISTANCE_SYMBOLS];
+  unsigned n;
+
+  for (n = 0; n < NUM_DEFLATE_CODE_SYMBOLS; n++) {
+    bitlen[n] = n <= 143 ? 8 : n <= 255 ? 9 : n <= 279 ? 7 : 8;
   }
+  for (n = 0; n < NUM_DISTANCE_SYMBOLS; n++) {
+    bitlenD[n] = 5;
+  }
+  huffman_table_build(upng, codetable, bitlen, NUM_DEFLATE_CODE_SYMBOLS);
+  huffman_table_build(upng, codetableD, bitlenD, NUM_DISTANCE_SYMBOLS);
 }
 
-static upng_format determine_format(upng_t *upng) {
+static void huffman_tables_dynamic(upng_t *upng, bit_reader *br,
+                                   huffman_table *codetable,
+                                   huffman_table *codetableD) {
+  unsigned codelengthcode[NUM_CODE_LENGTH_CODES];
+  unsigned bitlen[NUM_DEFLATE_CODE_SYMBOLS + NUM_DISTANCE_SYMBOLS];
+  huffman_table codelengthtable;
+  unsigned hlit, hdist, hclen, i;
+
+  hlit = br_bits(br, 5) + 257;
+  hdist = br_bits(br, 5) + 1;
+  hclen = br_bits(br, 4) + 4;
+
+  for (i = 0; i < NUM_CODE_LENGTH_CODES; i++) {
+    codelengthcode[CLCL[i]] = i < hclen ? br_bits(br, 3) : 0;
+  }
+  huffman_table_build(upng, &codelengthtable, codelengthcode,
+                      NUM_CODE_LENGTH_CODES);
+  if (upng->error != UPNG_EOK) {
+    return;
+  }
+
+  i = 0;
+  while (i < hlit + hdist) {
+    unsigned code, replength, value = 0;
+
+    br_refill(br);
+    code = huffman_table_decode(br, &codelengthtable);
+    if (code <= 15) {
+      bitlen[i++] = code;
+      continue;
+    } else if (code == 16) { /*repeat previous 3-6 times */
+      if (i == 0) {
+        SET_ERROR(upng, UPNG_EMALFORMED);
+        return;
+      }
+      replength = 3 + br_bits(br, 2);
+      value = bitlen[i - 1];
+    } else if (code == 17) { /*repeat "0" 3-10 times */
+      replength = 3 + br_bits(br, 3);
+    } else if (code == 18) { /*repeat "0" 11-138 times */
+      replength = 11 + br_bits(br, 7);
+    } else {
+      SET_ERROR(upng, UPNG_EMALFORMED);
+      return;
+    }
+
+    if (i + replength > hlit + hdist) {
+      SET_ERROR(upng, UPNG_EMALFORMED);
+      return;
+    }
+    while (replength-- > 0) {
+      bitlen[i++] = value;
+    }
+  }
+
+  /* the end code 256 must be present */
+  if (br_overrun(br) || bitlen[256] == 0) {
+    SET_ERROR(upng, UPNG_EMALFORMED);
+    return;
+  }
+
+  huffman_table_build(upng, codetable, bitlen, hlit);
+  if (upng->error == UPNG_EOK) {
+    huffman_table_build(upng, codetableD, bitlen + hlit, hdist);
+  }
+}
+
+/* unfilter every complete scanline in the window straight into the image */
+static void stream_emit_rows(upng_t *upng, inflate_stream *s) {
+  unsigned long stride = s->linebytes + 1;
+
+  while (s->pos - s->row >= stride) {
+    const unsigned char *line = s->window + s->row;
+    unsigned char *recon, *precon;
+
+    if (s->y == s->h) {
+      /* more image data than the header allows for */
+      SET_ERROR(upng, UPNG_EMALFORMED);
+      return;
+    }
+
+    if (s->rows[0] != NULL) {
+      recon = s->rows[s->y & 1];
+      precon = s->y > 0 ? s->rows[(s->y - 1) & 1] : NULL;
+    } else {
+      recon = s->out + s->linebytes * s->y;
+      precon = s->y > 0 ? recon - s->linebytes : NULL;
+    }
+
+    unfilter_scanline(upng, recon, line + 1, precon, s->bytewidth, line[0],
+                      s->linebytes, s->simd);
+    if (upng->error != UPNG_EOK) {
+      return;
+    }
+
+    if (s->rows[0] != NULL) {
+      /* rows are padded to whole bytes, the image is packed bit-tight */
+      unsigned long linebits = (unsigned long)s->w * s->bpp;
+      unsigned long obp = linebits * s->y;
+      unsigned long ibp;
+      for (ibp = 0; ibp < linebits; ibp++, obp++) {
+        if ((recon[ibp >> 3] >> (7 - (ibp & 7))) & 1) {
+          s->out[obp >> 3] |= (unsigned char)(1 << (7 - (obp & 7)));
+        } else {
+          s->out[obp >> 3] &= (unsigned char)~(1 << (7 - (obp & 7)));
+        }
+      }
+      /* the bits past the row's last pixel, which the next row fills, must
+       * not keep what the caller's buffer held before */
+      if (obp & 7) {
+        s->out[obp >> 3] &= (unsigned char)(0xFF << (8 - (obp & 7)));
+      }
+    }
+
+    s->row += stride;
+    s->y++;
+  }
+}
+
+/* flush complete rows and drop window contents that are neither history for
+ * back-references nor part of an unfinished row */
+static void stream_slide(upng_t *upng, inflate_stream *s) {
+  unsigned long keep;
+
+  stream_emit_rows(upng, s);
+  if (upng->error != UPNG_EOK) {
+    return;
+  }
+
+  keep = s->pos > DEFLATE_WINDOW_SIZE ? s->pos - DEFLATE_WINDOW_SIZE : 0;
+  if (s->row < keep) {
+    keep = s->row;
+  }
+  if (keep > 0) {
+    memmove(s->window, s->window + keep, s->pos - keep);
+    s->pos -= keep;
+    s->row -= keep;
+  }
+
+  if (s->size - s->pos < DEFLATE_MAX_MATCH) {
+    SET_ERROR(upng, UPNG_EMALFORMED);
+  }
+}
+
+static void inflate_huffman_fast(upng_t *upng, inflate_stream *s,
+                                 const huffman_table *codetable,
+                                 const huffman_table *codetableD) {
+  bit_reader *br = &s->br;
+  unsigned char *out = s->window;
+  unsigned long limit = s->size - DEFLATE_MAX_MATCH;
+  unsigned long p = s->pos;
+
+  for (;;) {
+    unsigned code, codeD;
+    unsigned long length, distance;
+
+    /* make room for the longest match before decoding the next symbol */
+    if (p > limit) {
+      s->pos = p;
+      stream_slide(upng, s);
+      if (upng->error != UPNG_EOK) {
+        return;
+      }
+      p = s->pos;
+    }
+
+    /* 56 bits cover a length code, its extra bits, a distance code and its
+     * extra bits (15 + 5 + 15 + 13) */
+    br_refill(br);
+    code = huffman_table_decode(br, codetable);
+
+    if (code <= 255) {
+      out[p++] = (unsigned char)code;
+      continue;
+    } else if (code == 256) {
+      break;
+    } else if (code > LAST_LENGTH_CODE_INDEX) {
+      SET_ERROR(upng, UPNG_EMALFORMED);
+      return;
+    }
+
+    code -= FIRST_LENGTH_CODE_INDEX;
+    length = LENGTH_BASE[code] + (unsigned long)(br->buf &
+                                                 ((1u << LENGTH_EXTRA[code]) -
+                                                  1));
+    br_consume(br, LENGTH_EXTRA[code]);
+
+    codeD = huffman_table_decode(br, codetableD);
+    if (codeD > 29) {
+      SET_ERROR(upng, UPNG_EMALFORMED);
+      return;
+    }
+    distance = DISTANCE_BASE[codeD] +
+               (unsigned long)(br->buf & ((1u << DISTANCE_EXTRA[codeD]) - 1));
+    br_consume(br, DISTANCE_EXTRA[codeD]);
+
+    if (distance > p) {
+      SET_ERROR(upng, UPNG_EMALFORMED);
+      return;
+    }
+
+    if (distance >= length) {
+      memcpy(out + p, out + p - distance, length);
+    } else {
+      unsigned char *dst = out + p;
+      const unsigned char *src = dst - distance;
+      unsigned long n;
+      for (n = 0; n < length; n++) {
+        dst[n] = src[n];
+      }
+    }
+    p += length;
+  }
+
+  s->pos = p;
+  if (br_overrun(br)) {
+    SET_ERROR(upng, UPNG_EMALFORMED);
+  }
+}
+
+static void inflate_uncompressed_fast(upng_t *upng, inflate_stream *s) {
+  bit_reader *br = &s->br;
+  unsigned long len, nlen;
+
+  /* go to first boundary of byte */
+  br_consume(br, br->count & 7);
+  len = br_bits(br, 16);
+  nlen = br_bits(br, 16);
+
+  if (br_overrun(br) || len + nlen != 65535) {
+    SET_ERROR(upng, UPNG_EMALFORMED);
+    return;
+  }
+
+  while (len > 0) {
+    unsigned long n;
+
+    if (s->size - s->pos < DEFLATE_MAX_MATCH) {
+      stream_slide(upng, s);
+      if (upng->error != UPNG_EOK) {
+        return;
+      }
+    }
+
+    n = s->size - s->pos;
+    if (n > len) {
+      n = len;
+    }
+    if (!br_read_bytes(br, s->window + s->pos, n) || br_overrun(br)) {
+      SET_ERROR(upng, UPNG_EMALFORMED);
+      return;
+    }
+    s->pos += n;
+    len -= n;
+  }
+}
+
+/* inflate the zlib stream spread over the IDAT chunks starting at idat and
+ * unfilter it into out, which holds upng->size bytes */
+static upng_error uz_inflate_stream(upng_t *upng, unsigned char *out,
+                                    const unsigned char *idat) {
+  inflate_stream s;
+  huffman_table codetable, codetableD;
+  unsigned long image_size;
+  unsigned done = 0;
+
+  memset(&s, 0, sizeof(s));
+  s.bpp = upng_get_bpp(upng);
+  if (s.bpp == 0) {
+    SET_ERROR(upng, UPNG_EMALFORMED);
+    return upng->error;
+  }
+  s.w = upng->width;
+  s.h = upng->height;
+  s.out = out;
+  s.linebytes = ((unsigned long)s.w * s.bpp + 7) / 8;
+  s.bytewidth = (s.bpp + 7) / 8;
+  s.simd = unfilter_simd_level();
+
+  /* the window holds a few times the 32K history, or the whole image when
+   * that is smaller, plus room for the longest match */
+  image_size = (s.linebytes + 1) * s.h;
+  s.size = 8 * DEFLATE_WINDOW_SIZE + s.linebytes + 1;
+  if (s.size > image_size) {
+    s.size = image_size;
+  }
+  s.size += DEFLATE_MAX_MATCH;
+  s.window = (unsigned char *)upng_alloc(upng, s.size);
+  if (s.window == NULL) {
+    SET_ERROR(upng, UPNG_ENOMEM);
+    return upng->error;
+  }
+
+  /* rows that end in padding bits are unfiltered on the side and then packed
+   * into the image */
+  if (s.bpp < 8 && s.w * s.bpp != s.linebytes * 8) {
+    s.rows[0] = (unsigned char *)upng_alloc(upng, 2 * s.linebytes);
+    if (s.rows[0] == NULL) {
+      upng_dealloc(upng, s.window);
+      SET_ERROR(upng, UPNG_ENOMEM);
+      return upng->error;
+    }
+    s.rows[1] = s.rows[0] + s.linebytes;
+  }
+
+  s.br.end = upng->source.buffer + upng->source.size;
+  if (idat != NULL) {
+    s.br.chunk = idat;
+    s.br.in = idat + 8;
+    s.br.size = upng_chunk_length(idat);
+  }
+
+  /* the two byte zlib header comes first */
+  {
+    unsigned cmf = br_bits(&s.br, 8);
+    unsigned flg = br_bits(&s.br, 8);
+    if (br_overrun(&s.br)) {
+      SET_ERROR(upng, UPNG_EMALFORMED);
+    } else {
+      zlib_header_check(upng, cmf, flg);
+    }
+  }
+
+  while (upng->error == UPNG_EOK && done == 0) {
+    unsigned btype;
+
+    if (br_overrun(&s.br)) {
+      SET_ERROR(upng, UPNG_EMALFORMED);
+      break;
+    }
+
+    done = br_bits(&s.br, 1);
+    btype = br_bits(&s.br, 2);
+
+    if (btype == 3) {
+      SET_ERROR(upng, UPNG_EMALFORMED);
+    } else if (btype == 0) {
+      inflate_uncompressed_fast(upng, &s);
+    } else {
+      if (btype == 1) {
+        huffman_tables_fixed(upng, &codetable, &codetableD);
+      } else {
+        huffman_tables_dynamic(upng, &s.br, &codetable, &codetableD);
+      }
+      if (upng->error == UPNG_EOK) {
+        inflate_huffman_fast(upng, &s, &codetable, &codetableD);
+      }
+    }
+  }
+
+  if (upng->error == UPNG_EOK) {
+    stream_emit_rows(upng, &s);
+  }
+  if (upng->error == UPNG_EOK && (s.y != s.h || s.row != s.pos)) {
+    /* the stream ended before the image did */
+    SET_ERROR(upng, UPNG_EMALFORMED);
+  }
+
+  upng_dealloc(upng, s.rows[0]);
+  upng_dealloc(upng, s.window);
+  return upng->error;
+}
+
+#endif /*defined(UPNG_REFERENCE_INFLATE)*/
+
+/*Paeth predicter, used by PNG filter type 4*/
+static int paeth_predictor(int a, int b, int c) {
+  int p = a + b - c;
+  int pa = p > a ? p - a : a - p;
+  int pb = p > b ? p - b : b - p;
+  int pc = p > c ? p - c : c - p;
+
+  if (pa <= pb && pa <= pc)
+    return a;
+  else if (pb <= pc)
+    return b;
+  else
+    return c;
+}
+
+static upng_simd unfilter_simd_supported(void) {
+#if defined(UPNG_X86_SIMD)
+  if (__builtin_cpu_supports("avx2")) {
+    return UPNG_SIMD_AVX2;
+  }
+  if (__builtin_cpu_supports("ssse3")) {
+    return UPNG_SIMD_SSSE3;
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    return UPNG_SIMD_SSE2;
+  }
+#endif
+  return UPNG_SIMD_NONE;
+}
+
+static upng_simd unfilter_simd_level(void) {
+  upng_simd supported = unfilter_simd_supported();
+  return supported < unfilter_simd_limit ? supported : unfilter_simd_limit;
+}
+
+upng_simd upng_set_simd_limit(upng_simd limit) {
+  unfilter_simd_limit = limit;
+  return unfilter_simd_level();
+}
+
+#if defined(UPNG_X86_SIMD)
+/*
+   Vectorized filters for 8-bit RGB and RGBA scanlines. Up is a plain vector
+   add; Sub, Average and Paeth depend on the reconstructed pixel to the left,
+   so they work one 3 or 4 byte pixel per step (Sub on RGBA does a 4 pixel
+   prefix sum instead). All of them produce exactly the scalar results.
+*/
+UPNG_TARGET("sse2") static __m128i load_pixel(const unsigned char *p,
+                                               unsigned long bpp) {
+  int v;
+  if (bpp == 4) {
+    memcpy(&v, p, 4);
+  } else {
+    /* assembled in registers; a 3 byte memcpy goes through the stack */
+    v = p[0] | (p[1] << 8) | (p[2] << 16);
+  }
+  return _mm_cvtsi32_si128(v);
+}
+
+UPNG_TARGET("sse2") static void store_pixel(unsigned char *p, __m128i v,
+                                             unsigned long bpp) {
+  int tmp = _mm_cvtsi128_si32(v);
+  if (bpp == 4) {
+    memcpy(p, &tmp, 4);
+  } else {
+    p[0] = (unsigned char)tmp;
+    p[1] = (unsigned char)(tmp >> 8);
+    p[2] = (unsigned char)(tmp >> 16);
+  }
+}
+
+UPNG_TARGET("sse2") static void unfilter_up_sse2(unsigned char *recon,
+                                                  const unsigned char *scanline,
+                                                  const unsigned char *precon,
+                                                  unsigned long length) {
+  unsigned long i = 0;
+  for (; i + 16 <= length; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(scanline + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(precon + i));
+    _mm_storeu_si128((__m128i *)(recon + i), _mm_add_epi8(x, b));
+  }
+  for (; i < length; i++) {
+    recon[i] = scanline[i] + precon[i];
+  }
+}
+
+UPNG_TARGET("avx2") static void unfilter_up_avx2(unsigned char *recon,
+                                                  const unsigned char *scanline,
+                                                  const unsigned char *precon,
+                                                  unsigned long length) {
+  unsigned long i = 0;
+  for (; i + 32 <= length; i += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(scanline + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(precon + i));
+    _mm256_storeu_si256((__m256i *)(recon + i), _mm256_add_epi8(x, b));
+  }
+  for (; i < length; i++) {
+    recon[i] = scanline[i] + precon[i];
+  }
+}
+
+UPNG_TARGET("sse2") static void unfilter_sub_sse2(unsigned char *recon,
+                                                   const unsigned char *scanline,
+                                                   unsigned long bpp,
+                                                   unsigned long length) {
+  __m128i a = _mm_setzero_si128();
+  unsigned long i = 0;
+  if (bpp == 4) {
+    for (; i + 16 <= length; i += 16) {
+      __m128i x = _mm_loadu_si128((const __m128i *)(scanline + i));
+      x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+      x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+      x = _mm_add_epi8(x, a);
+      _mm_storeu_si128((__m128i *)(recon + i), x);
+      a = _mm_shuffle_epi32(x, 0xff);
+    }
+  }
+  for (; i < length; i += bpp) {
+    a = _mm_add_epi8(a, load_pixel(scanline + i, bpp));
+    store_pixel(recon + i, a, bpp);
+  }
+}
+
+UPNG_TARGET("sse2") static void unfilter_average_sse2(
+    unsigned char *recon, const unsigned char *scanline,
+    const unsigned char *precon, unsigned long bpp, unsigned long length) {
+  const __m128i one = _mm_set1_epi8(1);
+  __m128i a = _mm_setzero_si128();
+  unsigned long i;
+  for (i = 0; i < length; i += bpp) {
+    __m128i b = load_pixel(precon + i, bpp);
+    /* _mm_avg_epu8 rounds up, the filter rounds down */
+    __m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b),
+                               _mm_and_si128(_mm_xor_si128(a, b), one));
+    a = _mm_add_epi8(load_pixel(scanline + i, bpp), avg);
+    store_pixel(recon + i, a, bpp);
+  }
+}
+
+/* a, b and c are the left, up and upper-left pixels widened to 16 bits */
+UPNG_TARGET("sse2") static __m128i paeth_select(__m128i a, __m128i b,
+                                                 __m128i c, __m128i pa,
+                                                 __m128i pb, __m128i pc) {
+  __m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+  __m128i mask = _mm_cmpeq_epi16(smallest, pc);
+  __m128i result = _mm_or_si128(_mm_and_si128(mask, c), _mm_andnot_si128(mask, b));
+  mask = _mm_cmpeq_epi16(smallest, pb);
+  result = _mm_or_si128(_mm_and_si128(mask, b), _mm_andnot_si128(mask, result));
+  mask = _mm_cmpeq_epi16(smallest, pa);
+  return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, result));
+}
+
+UPNG_TARGET("sse2") static __m128i abs_epi16_sse2(__m128i x) {
+  return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+}
+
+UPNG_TARGET("sse2") static void unfilter_paeth_sse2(
+    unsigned char *recon, const unsigned char *scanline,
+    const unsigned char *precon, unsigned long bpp, unsigned long length) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i a = zero, c = zero;
+  unsigned long i;
+  for (i = 0; i < length; i += bpp) {
+    __m128i b = _mm_unpacklo_epi8(load_pixel(precon + i, bpp), zero);
+    __m128i pa = abs_epi16_sse2(_mm_sub_epi16(b, c));
+    __m128i pb = abs_epi16_sse2(_mm_sub_epi16(a, c));
+    __m128i pc = abs_epi16_sse2(
+        _mm_sub_epi16(_mm_add_epi16(a, b), _mm_add_epi16(c, c)));
+    __m128i p = paeth_select(a, b, c, pa, pb, pc);
+    __m128i x = _mm_add_epi8(load_pixel(scanline + i, bpp),
+                             _mm_packus_epi16(p, p));
+    store_pixel(recon + i, x, bpp);
+    a = _mm_unpacklo_epi8(x, zero);
+    c = b;
+  }
+}
+
+UPNG_TARGET("ssse3") static void unfilter_paeth_ssse3(
+    unsigned char *recon, const unsigned char *scanline,
+    const unsigned char *precon, unsigned long bpp, unsigned long length) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i a = zero, c = zero;
+  unsigned long i;
+  for (i = 0; i < length; i += bpp) {
+    __m128i b = _mm_unpacklo_epi8(load_pixel(precon + i, bpp), zero);
+    __m128i pa = _mm_abs_epi16(_mm_sub_epi16(b, c));
+    __m128i pb = _mm_abs_epi16(_mm_sub_epi16(a, c));
+    __m128i pc = _mm_abs_epi16(
+        _mm_sub_epi16(_mm_add_epi16(a, b), _mm_add_epi16(c, c)));
+    __m128i p = paeth_select(a, b, c, pa, pb, pc);
+    __m128i x = _mm_add_epi8(load_pixel(scanline + i, bpp),
+                             _mm_packus_epi16(p, p));
+    store_pixel(recon + i, x, bpp);
+    a = _mm_unpacklo_epi8(x, zero);
+    c = b;
+  }
+}
+
+/* returns 0 when the filter/pixel size combination has no vector version */
+static int unfilter_scanline_simd(unsigned char *recon,
+                                  const unsigned char *scanline,
+                                  const unsigned char *precon,
+                                  unsigned long bytewidth,
+                                  unsigned char filterType,
+                                  unsigned long length, upng_simd simd) {
+  int pixels = bytewidth == 3 || bytewidth == 4;
+  switch (filterType) {
+  case 1:
+    if (!pixels) {
+      return 0;
+    }
+    unfilter_sub_sse2(recon, scanline, bytewidth, length);
+    return 1;
+  case 2:
+    if (precon == NULL) {
+      return 0;
+    }
+    if (simd >= UPNG_SIMD_AVX2) {
+      unfilter_up_avx2(recon, scanline, precon, length);
+    } else {
+      unfilter_up_sse2(recon, scanline, precon, length);
+    }
+    return 1;
+  case 3:
+    if (!pixels || precon == NULL) {
+      return 0;
+    }
+    unfilter_average_sse2(recon, scanline, precon, bytewidth, length);
+    return 1;
+  case 4:
+    if (!pixels) {
+      return 0;
+    }
+    /* without a previous line Paeth always predicts the left pixel */
+    if (precon == NULL) {
+      unfilter_sub_sse2(recon, scanline, bytewidth, length);
+    } else if (simd >= UPNG_SIMD_SSSE3) {
+      unfilter_paeth_ssse3(recon, scanline, precon, bytewidth, length);
+    } else {
+      unfilter_paeth_sse2(recon, scanline, precon, bytewidth, length);
+    }
+    return 1;
+  default:
+    return 0;
+  }
+}
+#endif /*defined(UPNG_X86_SIMD)*/
+
+static void unfilter_scanline(upng_t *upng, unsigned char *recon,
+                              const unsigned char *scanline,
+                              const unsigned char *precon,
+                              unsigned long bytewidth, unsigned char filterType,
+                              unsigned long length, upng_simd simd) {
+  /*
+     For PNG filter method 0
+     unfilter a PNG image scanline by scanline. when the pixels are smaller than
+     1 byte, the filter works byte per byte (bytewidth = 1) precon is the
+     previous unfiltered scanline, recon the result, scanline the current one
+     the incoming scanlines do NOT include the filtertype byte, that one is
+     given in the parameter filterType instead recon and scanline MAY be the
+     same memory address! precon must be disjoint.
+   */
+
+  unsigned long i;
+
+#if defined(UPNG_X86_SIMD)
+  if (simd != UPNG_SIMD_NONE &&
+      unfilter_scanline_simd(recon, scanline, precon, bytewidth, filterType,
+                             length, simd)) {
+    return;
+  }
+#else
+  (void)simd;
+#endif
+
+  switch (filterType) {
+  case 0:
+    for (i = 0; i < length; i++)
+      recon[i] = scanline[i];
+    break;
+  case 1:
+    for (i = 0; i < bytewidth; i++)
+      recon[i] = scanline[i];
+    for (i = bytewidth; i < length; i++)
+      recon[i] = scanline[i] + recon[i - bytewidth];
+    break;
+  case 2:
+    if (precon)
+      for (i = 0; i < length; i++)
+        recon[i] = scanline[i] + precon[i];
+    else
+      for (i = 0; i < length; i++)
+        recon[i] = scanline[i];
+    break;
+  case 3:
+    if (precon) {
+      for (i = 0; i < bytewidth; i++)
+        recon[i] = scanline[i] + precon[i] / 2;
+      for (i = bytewidth; i < length; i++)
+        recon[i] = scanline[i] + ((recon[i - bytewidth] + precon[i]) / 2);
+    } else {
+      for (i = 0; i < bytewidth; i++)
+        recon[i] = scanline[i];
+      for (i = bytewidth; i < length; i++)
+        recon[i] = scanline[i] + recon[i - bytewidth] / 2;
+    }
+    break;
+  case 4:
+    if (precon) {
+      for (i = 0; i < bytewidth; i++)
+        recon[i] =
+            (unsigned char)(scanline[i] + paeth_predictor(0, precon[i], 0));
+      for (i = bytewidth; i < length; i++)
+        recon[i] =
+            (unsigned char)(scanline[i] +
+                            paeth_predictor(recon[i - bytewidth], precon[i],
+                                            precon[i - bytewidth]));
+    } else {
+      for (i = 0; i < bytewidth; i++)
+        recon[i] = scanline[i];
+      for (i = bytewidth; i < length; i++)
+        recon[i] = (unsigned char)(scanline[i] +
+                                   paeth_predictor(recon[i - bytewidth], 0, 0));
+    }
+    break;
+  default:
+    SET_ERROR(upng, UPNG_EMALFORMED);
+    break;
+  }
+}
+
+#if defined(UPNG_REFERENCE_INFLATE)
+static void unfilter(upng_t *upng, unsigned char *out, const unsigned char *in,
+                     unsigned w, unsigned h, unsigned bpp) {
+  /*
+     For PNG filter method 0
+     this function unfilters a single image (e.g. without interlacing this is
+     called once, with Adam7 it's called 7 times) out must have enough bytes
+     allocated already, in must have the scanlines + 1 filtertype byte per
+     scanline w and h are image dimensions or dimensions of reduced image, bpp
+     is bpp per pixel in and out are allowed to be the same memory address!
+   */
+
+  unsigned y;
+  unsigned char *prevline = 0;
+  upng_simd simd = unfilter_simd_level();
+
+  unsigned long bytewidth =
+      (bpp + 7) / 8; /*bytewidth is used for filtering, is 1 when bpp < 8,
+                        number of bytes per pixel otherwise */
+  unsigned long linebytes = (w * bpp + 7) / 8;
+
+  for (y = 0; y < h; y++) {
+    unsigned long outindex = linebytes * y;
+    unsigned long inindex =
+        (1 + linebytes) * y; /*the extra filterbyte added to each row */
+    unsigned char filterType = in[inindex];
+
+    unfilter_scanline(upng, &out[outindex], &in[inindex + 1], prevline,
+                      bytewidth, filterType, linebytes, simd);
+    if (upng->error != UPNG_EOK) {
+      return;
+    }
+
+    prevline = &out[outindex];
+  }
+}
+
+static void remove_padding_bits(unsigned char *out, const unsigned char *in,
+                                unsigned long olinebits,
+                                unsigned long ilinebits, unsigned h) {
+  /*
+     After filtering there are still padding bpp if scanlines have non multiple
+     of 8 bit amounts. They need to be removed (except at last scanline of
+     (Adam7-reduced) image) before working with pure image buffers for the Adam7
+     code, the color convert code and the output to the user. in and out are
+     allowed to be the same buffer, in may also be higher but still overlapping;
+     in must have >= ilinebits*h bpp, out must have >= olinebits*h bpp,
+     olinebits must be <= ilinebits also used to move bpp after earlier such
+     operations happened, e.g. in a sequence of reduced images from Adam7 only
+     useful if (ilinebits - olinebits) is a value in the range 1..7
+   */
+  unsigned y;
+  unsigned long diff = ilinebits - olinebits;
+  unsigned long obp = 0, ibp = 0; /*bit pointers */
+  for (y = 0; y < h; y++) {
+    unsigned long x;
+    for (x = 0; x < olinebits; x++) {
+      unsigned char bit =
+          (unsigned char)((in[(ibp) >> 3] >> (7 - ((ibp) & 0x7))) & 1);
+      ibp++;
+
+      if (bit == 0)
+        out[(obp) >> 3] &= (unsigned char)(~(1 << (7 - ((obp) & 0x7))));
+      else
+        out[(obp) >> 3] |= (1 << (7 - ((obp) & 0x7)));
+      ++obp;
+    }
+    ibp += diff;
+  }
+}
+
+/*out must be buffer big enough to contain full image, and in must contain the
+ * full decompressed data from the IDAT chunks*/
+static void post_process_scanlines(upng_t *upng, unsigned char *out,
+                                   unsigned char *in, const upng_t *info_png) {
+  unsigned bpp = upng_get_bpp(info_png);
+  unsigned w = info_png->width;
+  unsigned h = info_png->height;
+
+  if (bpp == 0) {
+    SET_ERROR(upng, UPNG_EMALFORMED);
+    return;
+  }
+
+  if (bpp < 8 && w * bpp != ((w * bpp + 7) / 8) * 8) {
+    unfilter(upng, in, in, w, h, bpp);
+    if (upng->error != UPNG_EOK) {
+      return;
+    }
+    remove_padding_bits(out, in, w * bpp, ((w * bpp + 7) / 8) * 8, h);
+  } else {
+    unfilter(upng, out, in, w, h, bpp); /*we can immediatly filter into the out
+                                           buffer, no other steps needed */
+  }
+}
+
+#endif /*defined(UPNG_REFERENCE_INFLATE)*/
+
+static upng_format determine_format(upng_t *upng) {
   switch (upng->color_type) {
   case UPNG_LUM:
     switch (upng->color_depth) {
@@ -976,13 +1946,18 @@ static upng_format determine_format(upng_t *upng) {
 }
 
 static void upng_free_source(upng_t *upng) {
-  if (upng->source.owning != 0) {
-    free((void *)upng->source.buffer);
+  if (upng->source.owner == UPNG_SOURCE_HEAP) {
+    upng_dealloc(upng, (void *)upng->source.buffer);
+  }
+#if defined(UPNG_MMAP)
+  if (upng->source.owner == UPNG_SOURCE_MAPPED) {
+    munmap((void *)upng->source.buffer, upng->source.size);
   }
+#endif
 
   upng->source.buffer = NULL;
   upng->source.size = 0;
-  upng->source.owning = 0;
+  upng->source.owner = UPNG_SOURCE_BORROWED;
 }
 
 /*read the information from the header and store it in the upng_Info. return
@@ -1056,52 +2031,27 @@ upng_error upng_header(upng_t *upng) {
     return upng->error;
   }
 
+  /* bytes needed for the decoded image, see upng_decode_to() */
+  upng->size = (upng->height * upng->width * upng_get_bpp(upng) + 7) / 8;
+
   upng->state = UPNG_HEADER;
   return upng->error;
 }
 
-/*read a PNG, the result will be in the same color type as the PNG (hence
- * "generic")*/
-upng_error upng_decode(upng_t *upng) {
+/* verify the chunks following the header are well-formed, up to IEND. Finds
+ * the first IDAT chunk and the total size of the compressed image data. */
+static upng_error upng_scan_chunks(upng_t *upng, const unsigned char **idat,
+                                   unsigned long *compressed_size) {
   const unsigned char *chunk;
-  unsigned char *compressed;
-  unsigned char *inflated;
-  unsigned long compressed_size = 0, compressed_index = 0;
-  unsigned long inflated_size;
-  upng_error error;
-
-  /* if we have an error state, bail now */
-  if (upng->error != UPNG_EOK) {
-    return upng->error;
-  }
-
-  /* parse the main header, if necessary */
-  upng_header(upng);
-  if (upng->error != UPNG_EOK) {
-    return upng->error;
-  }
-
-  /* if the state is not HEADER (meaning we are ready to decode the image), stop
-   * now */
-  if (upng->state != UPNG_HEADER) {
-    return upng->error;
-  }
 
-  /* release old result, if any */
-  if (upng->buffer != 0) {
-    free(upng->buffer);
-    upng->buffer = 0;
-    upng->size = 0;
-  }
+  *idat = NULL;
+  *compressed_size = 0;
 
   /* first byte of the first chunk after the header */
   chunk = upng->source.buffer + 33;
 
-  /* scan through the chunks, finding the size of all IDAT chunks, and also
-   * verify general well-formed-ness */
   while (chunk < upng->source.buffer + upng->source.size) {
     unsigned long length;
-    const unsigned char *data [[maybe_unused]]; /*the data in the chunk */
 
     /* make sure chunk header is not larger than the total compressed */
     if ((unsigned long)(chunk - upng->source.buffer + 12) > upng->source.size) {
@@ -1123,12 +2073,12 @@ upng_error upng_decode(upng_t *upng) {
       return upng->error;
     }
 
-    /* get pointer to payload */
-    data = chunk + 8;
-
     /* parse chunks */
     if (upng_chunk_type(chunk) == CHUNK_IDAT) {
-      compressed_size += length;
+      if (*idat == NULL) {
+        *idat = chunk;
+      }
+      *compressed_size += length;
     } else if (upng_chunk_type(chunk) == CHUNK_IEND) {
       break;
     } else if (upng_chunk_critical(chunk)) {
@@ -1136,11 +2086,24 @@ upng_error upng_decode(upng_t *upng) {
       return upng->error;
     }
 
-    chunk += upng_chunk_length(chunk) + 12;
+    chunk += length + 12;
   }
 
+  return upng->error;
+}
+
+#if defined(UPNG_REFERENCE_INFLATE)
+/* gather the IDAT chunks, inflate them in one go and unfilter the result */
+static upng_error upng_decode_reference(upng_t *upng, unsigned char *out,
+                                        unsigned long compressed_size) {
+  const unsigned char *chunk;
+  unsigned char *compressed;
+  unsigned char *inflated;
+  unsigned long compressed_index = 0;
+  unsigned long inflated_size;
+
   /* allocate enough space for the (compressed and filtered) image data */
-  compressed = (unsigned char *)malloc(compressed_size);
+  compressed = (unsigned char *)upng_alloc(upng, compressed_size);
   if (compressed == NULL) {
     SET_ERROR(upng, UPNG_ENOMEM);
     return upng->error;
@@ -1168,48 +2131,86 @@ upng_error upng_decode(upng_t *upng) {
     chunk += upng_chunk_length(chunk) + 12;
   }
 
-  /* allocate space to store inflated (but still filtered) data */
+  /* allocate space to store inflated (but still filtered) data. This counts
+   * the image bit-tight rather than in whole-byte rows, so images with
+   * bit-padded rows can come out too large for it and be rejected as
+   * malformed; the streaming path sizes rows as the PNG stores them. */
   inflated_size =
       ((upng->width * (upng->height * upng_get_bpp(upng) + 7)) / 8) +
       upng->height;
-  inflated = (unsigned char *)malloc(inflated_size);
+  inflated = (unsigned char *)upng_alloc(upng, inflated_size);
   if (inflated == NULL) {
-    free(compressed);
+    upng_dealloc(upng, compressed);
     SET_ERROR(upng, UPNG_ENOMEM);
     return upng->error;
   }
 
   /* decompress image data */
-  error =
-      uz_inflate(upng, inflated, inflated_size, compressed, compressed_size);
-  if (error != UPNG_EOK) {
-    free(compressed);
-    free(inflated);
+  uz_inflate(upng, inflated, inflated_size, compressed, compressed_size);
+  upng_dealloc(upng, compressed);
+
+  /* unfilter scanlines */
+  if (upng->error == UPNG_EOK) {
+    post_process_scanlines(upng, out, inflated, upng);
+  }
+  upng_dealloc(upng, inflated);
+
+  return upng->error;
+}
+#endif /*defined(UPNG_REFERENCE_INFLATE)*/
+
+/*read a PNG, the result will be in the same color type as the PNG (hence
+ * "generic"). The image is written to buffer, which must hold at least
+ * upng_get_size() bytes; it stays owned by the caller.*/
+upng_error upng_decode_to(upng_t *upng, unsigned char *buffer,
+                          unsigned long size) {
+  const unsigned char *idat;
+  unsigned long compressed_size;
+
+  /* if we have an error state, bail now */
+  if (upng->error != UPNG_EOK) {
     return upng->error;
   }
 
-  /* free the compressed compressed data */
-  free(compressed);
+  /* parse the main header, if necessary */
+  upng_header(upng);
+  if (upng->error != UPNG_EOK) {
+    return upng->error;
+  }
 
-  /* allocate final image buffer */
-  upng->size = (upng->height * upng->width * upng_get_bpp(upng) + 7) / 8;
-  upng->buffer = (unsigned char *)malloc(upng->size);
-  if (upng->buffer == NULL) {
-    free(inflated);
-    upng->size = 0;
-    SET_ERROR(upng, UPNG_ENOMEM);
+  /* if the state is not HEADER (meaning we are ready to decode the image), stop
+   * now */
+  if (upng->state != UPNG_HEADER) {
     return upng->error;
   }
 
-  /* unfilter scanlines */
-  post_process_scanlines(upng, upng->buffer, inflated, upng);
-  free(inflated);
+  if (buffer == NULL || size < upng->size) {
+    SET_ERROR(upng, UPNG_EPARAM);
+    return upng->error;
+  }
 
-  if (upng->error != UPNG_EOK) {
-    free(upng->buffer);
+  /* release old result, if any */
+  if (upng->buffer != NULL) {
+    if (upng->buffer_owning != 0) {
+      upng_dealloc(upng, upng->buffer);
+    }
     upng->buffer = NULL;
-    upng->size = 0;
-  } else {
+  }
+
+  if (upng_scan_chunks(upng, &idat, &compressed_size) != UPNG_EOK) {
+    return upng->error;
+  }
+
+#if defined(UPNG_REFERENCE_INFLATE)
+  upng_decode_reference(upng, buffer, compressed_size);
+#else
+  (void)compressed_size;
+  uz_inflate_stream(upng, buffer, idat);
+#endif
+
+  if (upng->error == UPNG_EOK) {
+    upng->buffer = buffer;
+    upng->buffer_owning = 0;
     upng->state = UPNG_DECODED;
   }
 
@@ -1219,16 +2220,54 @@ upng_error upng_decode(upng_t *upng) {
   return upng->error;
 }
 
-static upng_t *upng_new(void) {
+/*read a PNG into a buffer allocated for it, see upng_get_buffer()*/
+upng_error upng_decode(upng_t *upng) {
+  unsigned char *buffer;
+
+  /* if we have an error state, bail now */
+  if (upng->error != UPNG_EOK) {
+    return upng->error;
+  }
+
+  /* parse the main header, if necessary */
+  upng_header(upng);
+  if (upng->error != UPNG_EOK || upng->state != UPNG_HEADER) {
+    return upng->error;
+  }
+
+  /* allocate final image buffer */
+  buffer = (unsigned char *)upng_alloc(upng, upng->size);
+  if (buffer == NULL) {
+    SET_ERROR(upng, UPNG_ENOMEM);
+    return upng->error;
+  }
+
+  if (upng_decode_to(upng, buffer, upng->size) != UPNG_EOK) {
+    upng_dealloc(upng, buffer);
+    return upng->error;
+  }
+  upng->buffer_owning = 1;
+
+  return upng->error;
+}
+
+static upng_t *upng_new(const upng_allocator *allocator) {
   upng_t *upng;
 
-  upng = (upng_t *)malloc(sizeof(upng_t));
+  if (allocator == NULL) {
+    allocator = &upng_default_allocator;
+  }
+
+  upng = (upng_t *)allocator->alloc(allocator->context, sizeof(upng_t));
   if (upng == NULL) {
     return NULL;
   }
 
+  upng->allocator = *allocator;
+
   upng->buffer = NULL;
   upng->size = 0;
+  upng->buffer_owning = 0;
 
   upng->width = upng->height = 0;
 
@@ -1243,75 +2282,143 @@ static upng_t *upng_new(void) {
 
   upng->source.buffer = NULL;
   upng->source.size = 0;
-  upng->source.owning = 0;
+  upng->source.owner = UPNG_SOURCE_BORROWED;
 
   return upng;
 }
 
 upng_t *upng_new_from_bytes(const unsigned char *buffer, unsigned long size) {
-  upng_t *upng = upng_new();
+  return upng_new_from_bytes_using(buffer, size, NULL);
+}
+
+upng_t *upng_new_from_bytes_using(const unsigned char *buffer,
+                                  unsigned long size,
+                                  const upng_allocator *allocator) {
+  upng_t *upng = upng_new(allocator);
   if (upng == NULL) {
     return NULL;
   }
 
   upng->source.buffer = buffer;
   upng->source.size = size;
-  upng->source.owning = 0;
+  upng->source.owner = UPNG_SOURCE_BORROWED;
 
   return upng;
 }
 
-upng_t *upng_new_from_file(const char *filename) {
-  upng_t *upng;
+#if defined(UPNG_MMAP)
+/* map a regular file read-only so the decoder reads it in place; returns 0
+ * when the file cannot be mapped and has to be read instead */
+static int upng_source_map(upng_t *upng, const char *filename) {
+  struct stat st;
+  void *mapping;
+  int fd;
+
+  fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    return 0;
+  }
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0) {
+    close(fd);
+    return 0;
+  }
+
+  mapping = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    return 0;
+  }
+
+  upng->source.buffer = (const unsigned char *)mapping;
+  upng->source.size = (unsigned long)st.st_size;
+  upng->source.owner = UPNG_SOURCE_MAPPED;
+  return 1;
+}
+#endif /*defined(UPNG_MMAP)*/
+
+/* read the whole file into a heap buffer */
+static void upng_source_read(upng_t *upng, const char *filename) {
   unsigned char *buffer;
   FILE *file;
   long size;
 
-  upng = upng_new();
-  if (upng == NULL) {
-    return NULL;
-  }
-
   file = fopen(filename, "rb");
   if (file == NULL) {
     SET_ERROR(upng, UPNG_ENOTFOUND);
-    return upng;
+    return;
   }
 
   /* get filesize */
-  fseek(file, 0, SEEK_END);
-  size = ftell(file);
+  if (fseek(file, 0, SEEK_END) != 0 || (size = ftell(file)) < 0) {
+    fclose(file);
+    SET_ERROR(upng, UPNG_ENOTFOUND);
+    return;
+  }
   rewind(file);
 
   /* read contents of the file into the vector */
-  buffer = (unsigned char *)malloc((unsigned long)size);
+  buffer =
+      (unsigned char *)upng_alloc(upng, size > 0 ? (unsigned long)size : 1);
   if (buffer == NULL) {
     fclose(file);
     SET_ERROR(upng, UPNG_ENOMEM);
-    return upng;
+    return;
+  }
+  if (fread(buffer, 1, (unsigned long)size, file) != (unsigned long)size) {
+    upng_dealloc(upng, buffer);
+    fclose(file);
+    SET_ERROR(upng, UPNG_ENOTFOUND);
+    return;
   }
-  fread(buffer, 1, (unsigned long)size, file);
   fclose(file);
 
-  /* set the read buffer as our source buffer, with owning flag set */
+  /* set the read buffer as our source buffer, freed with the source */
   upng->source.buffer = buffer;
   upng->source.size = size;
-  upng->source.owning = 1;
+  upng->source.owner = UPNG_SOURCE_HEAP;
+}
+
+upng_t *upng_new_from_file(const char *filename) {
+  return upng_new_from_file_using(filename, NULL);
+}
+
+upng_t *upng_new_from_file_using(const char *filename,
+                                 const upng_allocator *allocator) {
+  upng_t *upng;
+
+  upng = upng_new(allocator);
+  if (upng == NULL) {
+    return NULL;
+  }
+
+  /* decode straight from a mapping of the file where possible, which saves
+   * a full-size allocation and copy and lets processes share the pages */
+#if defined(UPNG_MMAP)
+  if (upng_source_map(upng, filename)) {
+    return upng;
+  }
+#endif
+  upng_source_read(upng, filename);
 
   return upng;
 }
 
 void upng_free(upng_t *upng) {
-  /* deallocate image buffer */
-  if (upng->buffer != NULL) {
-    free(upng->buffer);
+  upng_allocator allocator;
+
+  /* deallocate image buffer, unless the caller supplied it */
+  if (upng->buffer != NULL && upng->buffer_owning != 0) {
+    upng_dealloc(upng, upng->buffer);
   }
 
   /* deallocate source buffer, if necessary */
   upng_free_source(upng);
 
-  /* deallocate struct itself */
-  free(upng);
+  /* deallocate struct itself, through a copy of the hooks it holds */
+  allocator = upng->allocator;
+  if (allocator.free != NULL) {
+    allocator.free(allocator.context, upng);
+  }
 }
 
 upng_error upng_get_error(const upng_t *upng) { return upng->error; }
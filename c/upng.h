@@ -55,14 +55,46 @@ typedef enum upng_format {
   UPNG_LUMINANCE_ALPHA8
 } upng_format;
 
+/* instruction sets the scanline unfilter has vector versions for */
+typedef enum upng_simd {
+  UPNG_SIMD_NONE = 0,
+  UPNG_SIMD_SSE2 = 1,
+  UPNG_SIMD_SSSE3 = 2,
+  UPNG_SIMD_AVX2 = 3
+} upng_simd;
+
 typedef struct upng_t upng_t;
 
+/* memory hooks for everything a decoder allocates: the object itself, the
+ * source buffer, decode scratch and the image buffer. free may be NULL for
+ * allocators that release in bulk, e.g. an arena reset. */
+typedef struct upng_allocator {
+  void *(*alloc)(void *context, unsigned long size);
+  void (*free)(void *context, void *ptr);
+  void *context;
+} upng_allocator;
+
 upng_t *upng_new_from_bytes(const unsigned char *buffer, unsigned long size);
 upng_t *upng_new_from_file(const char *path);
+/* as above, allocating through allocator (malloc and free when NULL) */
+upng_t *upng_new_from_bytes_using(const unsigned char *buffer,
+                                  unsigned long size,
+                                  const upng_allocator *allocator);
+upng_t *upng_new_from_file_using(const char *path,
+                                 const upng_allocator *allocator);
 void upng_free(upng_t *upng);
 
 upng_error upng_header(upng_t *upng);
 upng_error upng_decode(upng_t *upng);
+/* decode into a caller-provided buffer of at least upng_get_size() bytes,
+ * which is known once upng_header() succeeded */
+upng_error upng_decode_to(upng_t *upng, unsigned char *buffer,
+                          unsigned long size);
+
+/* decodes use the best unfilter the CPU supports, up to limit
+ * (UPNG_SIMD_AVX2 by default). Call before decoding starts; returns the
+ * level decodes will use. */
+upng_simd upng_set_simd_limit(upng_simd limit);
 
 upng_error upng_get_error(const upng_t *upng);
 unsigned upng_get_error_line(const upng_t *upng);
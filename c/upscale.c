@@ -0,0 +1,329 @@
+#include "upscale.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *filter_names[] = {"nearest", "bilinear"};
+
+/* src[x0[x]] for every destination column x, of a source row src_count
+ * pixels wide */
+static void gather_row_scalar(Uint32 *out, const Uint32 *src, int src_count,
+                              const int32_t *x0, int count) {
+  (void)src_count;
+  for (int x = 0; x < count; x++)
+    out[x] = src[x0[x]];
+}
+
+/* (a * (256 - w) + b * w) >> 8 per 8-bit channel */
+static inline Uint32 lerp_pixel(Uint32 a, Uint32 b, uint32_t w) {
+  Uint32 pixel = 0;
+  for (int shift = 0; shift < 32; shift += 8) {
+    uint32_t c = (((a >> shift) & 0xFF) * (256 - w) +
+                  ((b >> shift) & 0xFF) * w) >>
+                 8;
+    pixel |= c << shift;
+  }
+  return pixel;
+}
+
+/* rows a and b blended with weight w for b */
+static void blend_rows_scalar(Uint32 *out, const Uint32 *a, const Uint32 *b,
+                              uint32_t w, int count) {
+  for (int x = 0; x < count; x++)
+    out[x] = lerp_pixel(a[x], b[x], w);
+}
+
+/* src[x0[x]] and src[x1[x]] blended with weight wx[x] for the latter */
+static void lerp_row_scalar(Uint32 *out, const Uint32 *src, int src_count,
+                            const int32_t *x0, const int32_t *x1,
+                            const uint32_t *wx, int count) {
+  (void)src_count;
+  for (int x = 0; x < count; x++)
+    out[x] = lerp_pixel(src[x0[x]], src[x1[x]], wx[x] & 0xFFFF);
+}
+
+#if defined(CPU_X86_SIMD)
+/* the blend of 4 pixels a and b with the 16-bit weights of b in w, one per
+ * channel */
+CPU_TARGET("sse2")
+static inline __m128i lerp_sse2(__m128i a, __m128i b, __m128i w_lo,
+                                __m128i w_hi) {
+  __m128i zero = _mm_setzero_si128();
+  __m128i full = _mm_set1_epi16(256);
+  __m128i lo = _mm_add_epi16(
+      _mm_mullo_epi16(_mm_unpacklo_epi8(a, zero), _mm_sub_epi16(full, w_lo)),
+      _mm_mullo_epi16(_mm_unpacklo_epi8(b, zero), w_lo));
+  __m128i hi = _mm_add_epi16(
+      _mm_mullo_epi16(_mm_unpackhi_epi8(a, zero), _mm_sub_epi16(full, w_hi)),
+      _mm_mullo_epi16(_mm_unpackhi_epi8(b, zero), w_hi));
+  return _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8));
+}
+
+CPU_TARGET("sse2")
+static void gather_row_sse2(Uint32 *out, const Uint32 *src, int src_count,
+                            const int32_t *x0, int count) {
+  int x = 0;
+  for (; x + 4 <= count; x += 4)
+    _mm_storeu_si128((__m128i *)(out + x),
+                     _mm_setr_epi32(src[x0[x]], src[x0[x + 1]],
+                                    src[x0[x + 2]], src[x0[x + 3]]));
+  gather_row_scalar(out + x, src, src_count, x0 + x, count - x);
+}
+
+CPU_TARGET("sse2")
+static void blend_rows_sse2(Uint32 *out, const Uint32 *a, const Uint32 *b,
+                            uint32_t w, int count) {
+  __m128i weight = _mm_set1_epi16((short)w);
+  int x = 0;
+  for (; x + 4 <= count; x += 4)
+    _mm_storeu_si128(
+        (__m128i *)(out + x),
+        lerp_sse2(_mm_loadu_si128((const __m128i *)(a + x)),
+                  _mm_loadu_si128((const __m128i *)(b + x)), weight, weight));
+  blend_rows_scalar(out + x, a + x, b + x, w, count - x);
+}
+
+CPU_TARGET("sse2")
+static void lerp_row_sse2(Uint32 *out, const Uint32 *src, int src_count,
+                          const int32_t *x0, const int32_t *x1,
+                          const uint32_t *wx, int count) {
+  int x = 0;
+  for (; x + 4 <= count; x += 4) {
+    __m128i a = _mm_setr_epi32(src[x0[x]], src[x0[x + 1]], src[x0[x + 2]],
+                               src[x0[x + 3]]);
+    __m128i b = _mm_setr_epi32(src[x1[x]], src[x1[x + 1]], src[x1[x + 2]],
+                               src[x1[x + 3]]);
+    __m128i w = _mm_loadu_si128((const __m128i *)(wx + x));
+    _mm_storeu_si128((__m128i *)(out + x),
+                     lerp_sse2(a, b, _mm_unpacklo_epi32(w, w),
+                               _mm_unpackhi_epi32(w, w)));
+  }
+  lerp_row_scalar(out + x, src, src_count, x0 + x, x1 + x, wx + x, count - x);
+}
+
+/* as lerp_sse2, 8 pixels; unpacking works within each 128-bit half, so the
+ * weights have to be spread the same way */
+CPU_TARGET("avx2")
+static inline __m256i lerp_avx2(__m256i a, __m256i b, __m256i w_lo,
+                                __m256i w_hi) {
+  __m256i zero = _mm256_setzero_si256();
+  __m256i full = _mm256_set1_epi16(256);
+  __m256i lo = _mm256_add_epi16(
+      _mm256_mullo_epi16(_mm256_unpacklo_epi8(a, zero),
+                         _mm256_sub_epi16(full, w_lo)),
+      _mm256_mullo_epi16(_mm256_unpacklo_epi8(b, zero), w_lo));
+  __m256i hi = _mm256_add_epi16(
+      _mm256_mullo_epi16(_mm256_unpackhi_epi8(a, zero),
+                         _mm256_sub_epi16(full, w_hi)),
+      _mm256_mullo_epi16(_mm256_unpackhi_epi8(b, zero), w_hi));
+  return _mm256_packus_epi16(_mm256_srli_epi16(lo, 8),
+                             _mm256_srli_epi16(hi, 8));
+}
+
+/* the source pixels of 8 destination pixels starting at column x: when they
+ * lie within 8 pixels of the first, as they do when scaling up, one load and
+ * a permute replace a gather */
+CPU_TARGET("avx2")
+static inline __m256i fetch_avx2(const Uint32 *src, int src_count,
+                                 const int32_t *index, int base, int span) {
+  __m256i at = _mm256_loadu_si256((const __m256i *)index);
+  if (span < 8 && base + 8 <= src_count)
+    return _mm256_permutevar8x32_epi32(
+        _mm256_loadu_si256((const __m256i *)(src + base)),
+        _mm256_sub_epi32(at, _mm256_set1_epi32(base)));
+  return _mm256_i32gather_epi32((const int *)src, at, 4);
+}
+
+CPU_TARGET("avx2")
+static void gather_row_avx2(Uint32 *out, const Uint32 *src, int src_count,
+                            const int32_t *x0, int count) {
+  int x = 0;
+  for (; x + 8 <= count; x += 8)
+    _mm256_storeu_si256((__m256i *)(out + x),
+                        fetch_avx2(src, src_count, x0 + x, x0[x],
+                                   x0[x + 7] - x0[x]));
+  gather_row_scalar(out + x, src, src_count, x0 + x, count - x);
+}
+
+CPU_TARGET("avx2")
+static void blend_rows_avx2(Uint32 *out, const Uint32 *a, const Uint32 *b,
+                            uint32_t w, int count) {
+  __m256i weight = _mm256_set1_epi16((short)w);
+  int x = 0;
+  for (; x + 8 <= count; x += 8)
+    _mm256_storeu_si256(
+        (__m256i *)(out + x),
+        lerp_avx2(_mm256_loadu_si256((const __m256i *)(a + x)),
+                  _mm256_loadu_si256((const __m256i *)(b + x)), weight,
+                  weight));
+  blend_rows_scalar(out + x, a + x, b + x, w, count - x);
+}
+
+CPU_TARGET("avx2")
+static void lerp_row_avx2(Uint32 *out, const Uint32 *src, int src_count,
+                          const int32_t *x0, const int32_t *x1,
+                          const uint32_t *wx, int count) {
+  int x = 0;
+  for (; x + 8 <= count; x += 8) {
+    int span = x1[x + 7] - x0[x];
+    __m256i a = fetch_avx2(src, src_count, x0 + x, x0[x], span);
+    __m256i b = fetch_avx2(src, src_count, x1 + x, x0[x], span);
+    __m256i w = _mm256_loadu_si256((const __m256i *)(wx + x));
+    _mm256_storeu_si256((__m256i *)(out + x),
+                        lerp_avx2(a, b, _mm256_unpacklo_epi32(w, w),
+                                  _mm256_unpackhi_epi32(w, w)));
+  }
+  lerp_row_scalar(out + x, src, src_count, x0 + x, x1 + x, wx + x, count - x);
+}
+#endif
+
+static void (*gather_row)(Uint32 *out, const Uint32 *src, int src_count,
+                          const int32_t *x0, int count) = gather_row_scalar;
+static void (*blend_rows)(Uint32 *out, const Uint32 *a, const Uint32 *b,
+                          uint32_t w, int count) = blend_rows_scalar;
+static void (*lerp_row)(Uint32 *out, const Uint32 *src, int src_count,
+                        const int32_t *x0, const int32_t *x1,
+                        const uint32_t *wx, int count) = lerp_row_scalar;
+
+CpuIsa upscale_use_isa(CpuIsa limit) {
+#if defined(CPU_X86_SIMD)
+  if (limit >= CPU_ISA_AVX2) {
+    gather_row = gather_row_avx2;
+    blend_rows = blend_rows_avx2;
+    lerp_row = lerp_row_avx2;
+    return CPU_ISA_AVX2;
+  }
+  if (limit >= CPU_ISA_SSE2) {
+    gather_row = gather_row_sse2;
+    blend_rows = blend_rows_sse2;
+    lerp_row = lerp_row_sse2;
+    return CPU_ISA_SSE2;
+  }
+#endif
+  (void)limit;
+  gather_row = gather_row_scalar;
+  blend_rows = blend_rows_scalar;
+  lerp_row = lerp_row_scalar;
+  return CPU_ISA_SCALAR;
+}
+
+/* the source samples of n destination pixels over a source of size pixels,
+ * with pixel centers lined up. Nearest only fills first. */
+static void upscale_axis(int32_t *first, int32_t *second, uint32_t *weight,
+                         int n, int size, UpscaleFilter filter) {
+  for (int i = 0; i < n; i++) {
+    double position = (i + 0.5) * size / n;
+    if (filter == UPSCALE_NEAREST) {
+      int nearest = (int)position;
+      first[i] = nearest < size ? nearest : size - 1;
+      second[i] = first[i];
+      weight[i] = 0;
+      continue;
+    }
+    position -= 0.5;
+    if (position < 0)
+      position = 0;
+    int left = (int)position;
+    if (left > size - 1)
+      left = size - 1;
+    first[i] = left;
+    second[i] = left + 1 < size ? left + 1 : left;
+    weight[i] = (uint32_t)((position - left) * 256);
+    if (weight[i] > 255)
+      weight[i] = 255;
+  }
+}
+
+void upscaler_init(Upscaler *upscaler, int src_width, int src_height,
+                   int dst_width, int dst_height, UpscaleFilter filter) {
+  /* six tables and two rows, each rounded up */
+  arena_init(&upscaler->arena,
+             sizeof(int32_t) * 3 * ((size_t)dst_width + dst_height) +
+                 sizeof(Uint32) * 2 * (size_t)dst_width +
+                 8 * ARENA_ALIGNMENT);
+  upscaler->filter = filter;
+  upscaler->src_width = src_width;
+  upscaler->src_height = src_height;
+  upscaler->dst_width = dst_width;
+  upscaler->dst_height = dst_height;
+  upscaler->x0 = arena_alloc(&upscaler->arena, sizeof(int32_t) * dst_width);
+  upscaler->x1 = arena_alloc(&upscaler->arena, sizeof(int32_t) * dst_width);
+  upscaler->wx = arena_alloc(&upscaler->arena, sizeof(uint32_t) * dst_width);
+  upscaler->y0 = arena_alloc(&upscaler->arena, sizeof(int32_t) * dst_height);
+  upscaler->y1 = arena_alloc(&upscaler->arena, sizeof(int32_t) * dst_height);
+  upscaler->wy = arena_alloc(&upscaler->arena, sizeof(uint32_t) * dst_height);
+  for (int i = 0; i < 2; i++) {
+    upscaler->rows[i] =
+        arena_alloc(&upscaler->arena, sizeof(Uint32) * dst_width);
+    upscaler->row_source[i] = -1;
+  }
+  upscale_axis(upscaler->x0, upscaler->x1, upscaler->wx, dst_width, src_width,
+               filter);
+  for (int x = 0; x < dst_width; x++)
+    upscaler->wx[x] |= upscaler->wx[x] << 16;
+  upscale_axis(upscaler->y0, upscaler->y1, upscaler->wy, dst_height,
+               src_height, filter);
+}
+
+void upscaler_release(Upscaler *upscaler) {
+  arena_release(&upscaler->arena);
+}
+
+/* source row y scaled across, from the two kept rows when it is one of them,
+ * otherwise into the kept row that is not keep */
+static const Uint32 *upscale_row(Upscaler *upscaler, const Uint32 *src, int y,
+                                 int keep) {
+  for (int i = 0; i < 2; i++) {
+    if (upscaler->row_source[i] == y)
+      return upscaler->rows[i];
+  }
+  int i = upscaler->row_source[0] == keep ? 1 : 0;
+  lerp_row(upscaler->rows[i], src + (size_t)y * upscaler->src_width,
+           upscaler->src_width, upscaler->x0, upscaler->x1, upscaler->wx,
+           upscaler->dst_width);
+  upscaler->row_source[i] = y;
+  return upscaler->rows[i];
+}
+
+void upscale(Upscaler *upscaler, const Uint32 *src, Uint32 *dst) {
+  int width = upscaler->dst_width;
+  upscaler->row_source[0] = upscaler->row_source[1] = -1;
+  for (int y = 0; y < upscaler->dst_height; y++) {
+    Uint32 *out = dst + (size_t)y * width;
+    int y0 = upscaler->y0[y], y1 = upscaler->y1[y];
+    if (y > 0 && y0 == upscaler->y0[y - 1] && y1 == upscaler->y1[y - 1] &&
+        upscaler->wy[y] == upscaler->wy[y - 1]) {
+      memcpy(out, out - width, sizeof(Uint32) * width);
+      continue;
+    }
+    if (upscaler->filter == UPSCALE_NEAREST) {
+      gather_row(out, src + (size_t)y0 * upscaler->src_width,
+                 upscaler->src_width, upscaler->x0, width);
+      continue;
+    }
+    /* every source row is scaled across once and blended into the two or
+     * three destination rows it contributes to */
+    const Uint32 *top = upscale_row(upscaler, src, y0, y1);
+    if (upscaler->wy[y] == 0) {
+      memcpy(out, top, sizeof(Uint32) * width);
+      continue;
+    }
+    const Uint32 *bottom = upscale_row(upscaler, src, y1, y0);
+    blend_rows(out, top, bottom, upscaler->wy[y], width);
+  }
+}
+
+UpscaleFilter upscale_filter_parse(const char *name) {
+  for (int i = 0; i <= UPSCALE_BILINEAR; i++) {
+    if (strcmp(name, filter_names[i]) == 0)
+      return (UpscaleFilter)i;
+  }
+  fprintf(stderr,
+          "Error: unknown upscale filter %s (expected nearest or bilinear)\n",
+          name);
+  exit(1);
+}
+
+const char *upscale_filter_name(UpscaleFilter filter) {
+  return filter_names[filter];
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "arena.h"
+#include "cpu.h"
+#include <SDL3/SDL_stdinc.h>
+#include <stdint.h>
+
+typedef enum UpscaleFilter {
+  UPSCALE_NEAREST = 0,
+  UPSCALE_BILINEAR,
+} UpscaleFilter;
+
+typedef struct Upscaler Upscaler;
+
+/* Scales a src_width x src_height image up to dst_width x dst_height. Where
+ * every destination pixel samples from is worked out once, so a frame costs
+ * one gather per pixel for nearest. Bilinear scales each source row across
+ * once, two gathers and a blend per pixel, and blends pairs of those rows
+ * into each destination row. Destination rows that sample exactly like the
+ * row above are copied. */
+struct Upscaler {
+  Arena arena;
+  UpscaleFilter filter;
+  int src_width, src_height;
+  int dst_width, dst_height;
+  int32_t *x0, *x1; /* source column of each destination column */
+  uint32_t *wx;     /* weight of x1 in 1/256, in both 16-bit halves */
+  int32_t *y0, *y1; /* source row of each destination row */
+  uint32_t *wy;     /* weight of y1 in 1/256 */
+  Uint32 *rows[2];  /* source rows scaled across, for bilinear */
+  int row_source[2]; /* which source row each holds, -1 for none */
+};
+
+void upscaler_init(Upscaler *upscaler, int src_width, int src_height,
+                   int dst_width, int dst_height, UpscaleFilter filter);
+void upscaler_release(Upscaler *upscaler);
+/* both images are tightly packed, src_width and dst_width pixels a row */
+void upscale(Upscaler *upscaler, const Uint32 *src, Uint32 *dst);
+
+/* pick the row kernels for the best level up to limit, returns it */
+CpuIsa upscale_use_isa(CpuIsa limit);
+
+/* parse an --upscale argument (nearest, bilinear); exits on anything else */
+UpscaleFilter upscale_filter_parse(const char *name);
+const char *upscale_filter_name(UpscaleFilter filter);
@@ -0,0 +1,1204 @@
+#include "wall.h"
+#include "defs.h"
+#include "jobs.h"
+#include "renderer.h"
+#include "scaler.h"
+#include "tile.h"
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* columns drawn per band: one cache line of each row they cover */
+#define WALL_BAND_WIDTH 16
+/* columns drawn per job, a whole number of bands and vectors */
+#define WALL_JOB_COLUMNS (4 * WALL_BAND_WIDTH)
+
+_Static_assert(WALL_STRIP_WIDTH == 1, "the strip kernels draw one column per "
+                                      "ray");
+
+typedef struct WallStrips WallStrips;
+
+/* What each column of a view height rows tall shows, one entry per column:
+ * rows [y_start, y_end) are wall, texel
+ * table[rows + y] of the column starting at atlas offset texels, or color
+ * where texels is -1, plus shade. Rows above are ceiling and rows below are
+ * floor. The vector kernels get the same texel
+ * rows as clamp((int)((y + center) * scale), 0, last): across 8 or 16
+ * columns a few multiplies are cheaper than a second, dependent gather. */
+struct WallStrips {
+  int32_t *y_start;
+  int32_t *y_end;
+  int32_t *texels;
+  int32_t *rows;
+  uint32_t *color;
+  uint32_t *shade;
+  int32_t *last;
+  double *center;
+  double *scale;
+  const uint16_t *table; /* scaler_table() of the renderer's scalers */
+  bool tables;           /* whether rows were worked out */
+  Uint32 *tiles; /* a band, column by column, per thread for the band
+                  * kernels */
+  int count;
+  int pitch;  /* pixels from one row of the view to the next */
+  int stride; /* pixels from one column to the next, 2 for one phase of an
+               * interlaced view, whose other columns are left as they are */
+  int height;
+};
+
+static WallStrips wall_strips_alloc(Arena *arena, int count, int height) {
+  size_t padded =
+      (count + RAY_BUFFER_LANES - 1) / RAY_BUFFER_LANES * RAY_BUFFER_LANES;
+  WallStrips strips;
+  strips.y_start = arena_alloc(arena, sizeof(int32_t) * padded);
+  strips.y_end = arena_alloc(arena, sizeof(int32_t) * padded);
+  strips.texels = arena_alloc(arena, sizeof(int32_t) * padded);
+  strips.rows = arena_alloc(arena, sizeof(int32_t) * padded);
+  strips.color = arena_alloc(arena, sizeof(uint32_t) * padded);
+  strips.shade = arena_alloc(arena, sizeof(uint32_t) * padded);
+  strips.last = arena_alloc(arena, sizeof(int32_t) * padded);
+  strips.center = arena_alloc(arena, sizeof(double) * padded);
+  strips.scale = arena_alloc(arena, sizeof(double) * padded);
+  strips.tiles = arena_alloc(arena, sizeof(Uint32) * WALL_BAND_WIDTH * height *
+                                        (jobs_threads() + 1));
+  strips.count = count;
+  strips.pitch = count;
+  strips.stride = 1;
+  strips.height = height;
+  strips.tables = false;
+  return strips;
+}
+
+typedef struct WallJob {
+  Uint32 *color_buffer;
+  const uint32_t *texels;
+  /* for render_observation() */
+  void *out;
+  const uint8_t *luma;
+  WallStrips strips;
+} WallJob;
+
+size_t wall_arena_bytes(int count, int height) {
+  size_t padded =
+      (count + RAY_BUFFER_LANES - 1) / RAY_BUFFER_LANES * RAY_BUFFER_LANES;
+  /* the job, nine per-column arrays and the band tiles, each rounded up to
+   * the arena alignment */
+  return sizeof(WallJob) + 8 * 9 * padded +
+         sizeof(Uint32) * WALL_BAND_WIDTH * height * (jobs_threads() + 1) +
+         11 * ARENA_ALIGNMENT;
+}
+
+/* column x top to bottom, row y at out[y * step] */
+static inline void draw_strip(Uint32 *out, ptrdiff_t step,
+                              const uint32_t *texels, const WallStrips *strips,
+                              int x) {
+  const uint16_t *table = strips->table;
+  int y_start = strips->y_start[x];
+  int y_end = strips->y_end[x];
+  for (int j = 0; j < y_start; j++) {
+    out[j * step] = WALL_CEILING_COLOR;
+  }
+  for (int y = y_start; y < y_end; y++) {
+    uint32_t texel = strips->color[x];
+    if (strips->texels[x] >= 0)
+      texel = texels[strips->texels[x] + table[strips->rows[x] + y]];
+    out[y * step] = texel + strips->shade[x];
+  }
+  for (int j = y_end; j < strips->height; j++) {
+    out[j * step] = WALL_FLOOR_COLOR;
+  }
+}
+
+/* columns [first, last) one at a time, top to bottom */
+static void draw_walls_scalar(Uint32 *color_buffer, const uint32_t *texels,
+                              const WallStrips *strips, int first, int last) {
+  for (int x = first; x < last; x++)
+    draw_strip(color_buffer + (size_t)x * strips->stride, strips->pitch,
+               texels, strips, x);
+}
+
+/* Down a column of the view every store is a row apart, a cache line of its
+ * own. The band kernels draw WALL_BAND_WIDTH columns at a time into a tile
+ * that keeps each column contiguous and stays in cache, then copy the tile
+ * to the view row by row, a cache line of each row at a time. */
+static Uint32 *draw_band_tile(const uint32_t *texels, const WallStrips *strips,
+                              int first) {
+  Uint32 *tile =
+      strips->tiles + (size_t)jobs_self() * WALL_BAND_WIDTH * strips->height;
+  for (int c = 0; c < WALL_BAND_WIDTH; c++)
+    draw_strip(tile + (size_t)c * strips->height, 1, texels, strips,
+               first + c);
+  return tile;
+}
+
+static void draw_walls_bands(Uint32 *color_buffer, const uint32_t *texels,
+                             const WallStrips *strips, int first, int last) {
+  int x = first;
+  for (; x + WALL_BAND_WIDTH <= last; x += WALL_BAND_WIDTH) {
+    const Uint32 *tile = draw_band_tile(texels, strips, x);
+    int stride = strips->stride;
+    for (int y = 0; y < strips->height; y++) {
+      Uint32 *out =
+          color_buffer + (size_t)y * strips->pitch + (size_t)x * stride;
+      for (int c = 0; c < WALL_BAND_WIDTH; c++)
+        out[c * stride] = tile[(size_t)c * strips->height + y];
+    }
+  }
+  draw_walls_scalar(color_buffer, texels, strips, x, last);
+}
+
+/* rows [0, top) of a group of columns are all ceiling and rows from bottom
+ * down are all floor; in between each lane picks its own */
+static void wall_group_bounds(const WallStrips *strips, int first, int lanes,
+                              int *top, int *bottom) {
+  *top = strips->y_start[first];
+  *bottom = strips->y_end[first];
+  for (int lane = 1; lane < lanes; lane++) {
+    if (strips->y_start[first + lane] < *top)
+      *top = strips->y_start[first + lane];
+    if (strips->y_end[first + lane] > *bottom)
+      *bottom = strips->y_end[first + lane];
+  }
+  if (*bottom < *top)
+    *bottom = *top;
+}
+
+#if defined(CPU_X86_SIMD)
+/* as draw_walls_bands, turning the tile 4x4 pixels at a time. The stores
+ * go through the cache: the view is read back whole for the upload right
+ * after, and streaming it past the cache measured slower. Columns a stride
+ * apart are copied a pixel at a time. */
+CPU_TARGET("sse2")
+static void draw_walls_bands_sse2(Uint32 *color_buffer, const uint32_t *texels,
+                                  const WallStrips *strips, int first,
+                                  int last) {
+  int stride = strips->stride;
+  int rows = stride == 1 ? strips->height & ~3 : 0;
+  int x = first;
+  for (; x + WALL_BAND_WIDTH <= last; x += WALL_BAND_WIDTH) {
+    const Uint32 *tile = draw_band_tile(texels, strips, x);
+    size_t height = strips->height;
+    int y = 0;
+    /* all four 4x4 blocks of a row of the band, so each cache line of the
+     * view is written whole before the next */
+    for (; y < rows; y += 4) {
+      for (int c = 0; c < WALL_BAND_WIDTH; c += 4) {
+        const Uint32 *column = tile + c * height + y;
+        __m128i c0 = _mm_loadu_si128((const __m128i *)column);
+        __m128i c1 = _mm_loadu_si128((const __m128i *)(column + height));
+        __m128i c2 = _mm_loadu_si128((const __m128i *)(column + 2 * height));
+        __m128i c3 = _mm_loadu_si128((const __m128i *)(column + 3 * height));
+        __m128i lo01 = _mm_unpacklo_epi32(c0, c1);
+        __m128i hi01 = _mm_unpackhi_epi32(c0, c1);
+        __m128i lo23 = _mm_unpacklo_epi32(c2, c3);
+        __m128i hi23 = _mm_unpackhi_epi32(c2, c3);
+        __m128i row[4] = {
+            _mm_unpacklo_epi64(lo01, lo23), _mm_unpackhi_epi64(lo01, lo23),
+            _mm_unpacklo_epi64(hi01, hi23), _mm_unpackhi_epi64(hi01, hi23)};
+        for (int r = 0; r < 4; r++)
+          _mm_storeu_si128(
+              (__m128i *)(color_buffer + (size_t)(y + r) * strips->pitch + x +
+                          c),
+              row[r]);
+      }
+    }
+    for (; y < strips->height; y++) {
+      Uint32 *out =
+          color_buffer + (size_t)y * strips->pitch + (size_t)x * stride;
+      for (int c = 0; c < WALL_BAND_WIDTH; c++)
+        out[c * stride] = tile[c * height + y];
+    }
+  }
+  draw_walls_scalar(color_buffer, texels, strips, x, last);
+}
+
+/* a row of 8 columns at out, adjacent or, with a stride of 2, every other
+ * pixel with the ones between left as they are */
+CPU_TARGET("avx2")
+static inline void store_columns_avx2(Uint32 *out, __m256i pixels,
+                                      int stride) {
+  if (stride == 1) {
+    _mm256_storeu_si256((__m256i *)out, pixels);
+    return;
+  }
+  __m256i even = _mm256_setr_epi32(-1, 0, -1, 0, -1, 0, -1, 0);
+  _mm256_maskstore_epi32(
+      (int *)out, even,
+      _mm256_permutevar8x32_epi32(pixels,
+                                  _mm256_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3)));
+  _mm256_maskstore_epi32(
+      (int *)out + 8, even,
+      _mm256_permutevar8x32_epi32(pixels,
+                                  _mm256_setr_epi32(4, 4, 5, 5, 6, 6, 7, 7)));
+}
+
+/* what the AVX2 kernel keeps of 8 adjacent columns while it draws them */
+typedef struct WallLanesAvx2 {
+  __m256i y_start;
+  __m256i y_end;
+  __m256i base;
+  __m256i last_row;
+  __m256i color;
+  __m256i shade;
+  __m256i textured;
+  __m256d center_lo;
+  __m256d center_hi;
+  __m256d scale_lo;
+  __m256d scale_hi;
+} WallLanesAvx2;
+
+CPU_TARGET("avx2")
+static inline WallLanesAvx2 wall_lanes_avx2(const WallStrips *strips, int x) {
+  WallLanesAvx2 lanes;
+  lanes.y_start = _mm256_loadu_si256((const __m256i *)(strips->y_start + x));
+  lanes.y_end = _mm256_loadu_si256((const __m256i *)(strips->y_end + x));
+  lanes.base = _mm256_loadu_si256((const __m256i *)(strips->texels + x));
+  lanes.last_row = _mm256_loadu_si256((const __m256i *)(strips->last + x));
+  lanes.color = _mm256_loadu_si256((const __m256i *)(strips->color + x));
+  lanes.shade = _mm256_loadu_si256((const __m256i *)(strips->shade + x));
+  lanes.textured = _mm256_cmpgt_epi32(lanes.base, _mm256_set1_epi32(-1));
+  lanes.center_lo = _mm256_loadu_pd(strips->center + x);
+  lanes.center_hi = _mm256_loadu_pd(strips->center + x + 4);
+  lanes.scale_lo = _mm256_loadu_pd(strips->scale + x);
+  lanes.scale_hi = _mm256_loadu_pd(strips->scale + x + 4);
+  return lanes;
+}
+
+/* row y of the 8 columns, with the texels of all 8 fetched by one gather */
+CPU_TARGET("avx2")
+static inline __m256i wall_row_avx2(const WallLanesAvx2 *lanes,
+                                    const uint32_t *texels, int y) {
+  __m256i row = _mm256_set1_epi32(y);
+  __m256i above = _mm256_cmpgt_epi32(lanes->y_start, row);
+  __m256i below = _mm256_xor_si256(_mm256_cmpgt_epi32(lanes->y_end, row),
+                                   _mm256_set1_epi32(-1));
+  __m256i wall =
+      _mm256_andnot_si256(_mm256_or_si256(above, below), lanes->textured);
+  __m256d yd = _mm256_set1_pd(y);
+  __m128i offset_lo = _mm256_cvttpd_epi32(
+      _mm256_mul_pd(_mm256_add_pd(yd, lanes->center_lo), lanes->scale_lo));
+  __m128i offset_hi = _mm256_cvttpd_epi32(
+      _mm256_mul_pd(_mm256_add_pd(yd, lanes->center_hi), lanes->scale_hi));
+  __m256i offset = _mm256_max_epi32(
+      _mm256_min_epi32(_mm256_set_m128i(offset_hi, offset_lo),
+                       lanes->last_row),
+      _mm256_setzero_si256());
+  __m256i index = _mm256_add_epi32(lanes->base, offset);
+  __m256i texel = _mm256_mask_i32gather_epi32(lanes->color, (const int *)texels,
+                                              index, wall, 4);
+  __m256i pixel = _mm256_add_epi32(texel, lanes->shade);
+  pixel = _mm256_blendv_epi8(pixel, _mm256_set1_epi32(WALL_CEILING_COLOR),
+                             above);
+  return _mm256_blendv_epi8(pixel, _mm256_set1_epi32(WALL_FLOOR_COLOR), below);
+}
+
+/* Adjacent columns row by row, so every store is one contiguous run of
+ * pixels. A band of WALL_BAND_WIDTH columns is drawn as two groups of 8
+ * side by side, so each row of it is one whole cache line, as in the other
+ * band kernels; 8 columns at a time measured 15% slower over the scripted
+ * run. The columns left over are drawn 8, then 1 at a time. */
+CPU_TARGET("avx2")
+static void draw_walls_avx2(Uint32 *color_buffer, const uint32_t *texels,
+                            const WallStrips *strips, int first, int last) {
+  _Static_assert(WALL_BAND_WIDTH == 16, "an AVX2 band is two groups of 8");
+  __m256i ceiling = _mm256_set1_epi32(WALL_CEILING_COLOR);
+  __m256i floor_color = _mm256_set1_epi32(WALL_FLOOR_COLOR);
+  int stride = strips->stride;
+  int x = first;
+  for (; x + WALL_BAND_WIDTH <= last; x += WALL_BAND_WIDTH) {
+    WallLanesAvx2 left = wall_lanes_avx2(strips, x);
+    WallLanesAvx2 right = wall_lanes_avx2(strips, x + 8);
+    int top, bottom;
+    wall_group_bounds(strips, x, WALL_BAND_WIDTH, &top, &bottom);
+
+    Uint32 *out = color_buffer + (size_t)x * stride;
+    int y = 0;
+    for (; y < top; y++) {
+      store_columns_avx2(out + y * strips->pitch, ceiling, stride);
+      store_columns_avx2(out + y * strips->pitch + 8 * stride, ceiling,
+                         stride);
+    }
+    for (; y < bottom; y++) {
+      store_columns_avx2(out + y * strips->pitch,
+                         wall_row_avx2(&left, texels, y), stride);
+      store_columns_avx2(out + y * strips->pitch + 8 * stride,
+                         wall_row_avx2(&right, texels, y), stride);
+    }
+    for (; y < strips->height; y++) {
+      store_columns_avx2(out + y * strips->pitch, floor_color, stride);
+      store_columns_avx2(out + y * strips->pitch + 8 * stride, floor_color,
+                         stride);
+    }
+  }
+  for (; x + 8 <= last; x += 8) {
+    WallLanesAvx2 lanes = wall_lanes_avx2(strips, x);
+    int top, bottom;
+    wall_group_bounds(strips, x, 8, &top, &bottom);
+
+    Uint32 *out = color_buffer + (size_t)x * stride;
+    int y = 0;
+    for (; y < top; y++)
+      store_columns_avx2(out + y * strips->pitch, ceiling, stride);
+    for (; y < bottom; y++)
+      store_columns_avx2(out + y * strips->pitch,
+                         wall_row_avx2(&lanes, texels, y), stride);
+    for (; y < strips->height; y++)
+      store_columns_avx2(out + y * strips->pitch, floor_color, stride);
+  }
+  draw_walls_scalar(color_buffer, texels, strips, x, last);
+}
+
+/* as store_columns_avx2(), for 16 columns */
+CPU_TARGET("avx512f")
+static inline void store_columns_avx512(Uint32 *out, __m512i pixels,
+                                        int stride) {
+  if (stride == 1) {
+    _mm512_storeu_si512(out, pixels);
+    return;
+  }
+  _mm512_mask_storeu_epi32(
+      out, 0x5555,
+      _mm512_permutexvar_epi32(_mm512_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3, 4,
+                                                 4, 5, 5, 6, 6, 7, 7),
+                               pixels));
+  _mm512_mask_storeu_epi32(
+      out + 16, 0x5555,
+      _mm512_permutexvar_epi32(_mm512_setr_epi32(8, 8, 9, 9, 10, 10, 11, 11,
+                                                 12, 12, 13, 13, 14, 14, 15,
+                                                 15),
+                               pixels));
+}
+
+/* as the AVX2 variant, 16 columns per pass with mask registers. A pass is
+ * a band already: each row of it is one whole cache line. */
+CPU_TARGET("avx512f")
+static void draw_walls_avx512(Uint32 *color_buffer, const uint32_t *texels,
+                              const WallStrips *strips, int first, int last) {
+  __m512i ceiling = _mm512_set1_epi32(WALL_CEILING_COLOR);
+  __m512i floor_color = _mm512_set1_epi32(WALL_FLOOR_COLOR);
+  int x = first;
+  for (; x + 16 <= last; x += 16) {
+    __m512i y_start = _mm512_loadu_si512(strips->y_start + x);
+    __m512i y_end = _mm512_loadu_si512(strips->y_end + x);
+    __m512i base = _mm512_loadu_si512(strips->texels + x);
+    __m512i last_row = _mm512_loadu_si512(strips->last + x);
+    __m512d center_lo = _mm512_loadu_pd(strips->center + x);
+    __m512d center_hi = _mm512_loadu_pd(strips->center + x + 8);
+    __m512d scale_lo = _mm512_loadu_pd(strips->scale + x);
+    __m512d scale_hi = _mm512_loadu_pd(strips->scale + x + 8);
+    __m512i color = _mm512_loadu_si512(strips->color + x);
+    __m512i shade = _mm512_loadu_si512(strips->shade + x);
+    __mmask16 textured = _mm512_cmpge_epi32_mask(base, _mm512_setzero_si512());
+    int top, bottom;
+    wall_group_bounds(strips, x, 16, &top, &bottom);
+
+    Uint32 *out = color_buffer + (size_t)x * strips->stride;
+    int y = 0;
+    for (; y < top; y++)
+      store_columns_avx512(out + y * strips->pitch, ceiling, strips->stride);
+    for (; y < bottom; y++) {
+      __m512i row = _mm512_set1_epi32(y);
+      __mmask16 above = _mm512_cmpgt_epi32_mask(y_start, row);
+      __mmask16 below = _mm512_cmple_epi32_mask(y_end, row);
+      __mmask16 wall = ~(above | below) & textured;
+      __m512d yd = _mm512_set1_pd(y);
+      __m256i offset_lo = _mm512_cvttpd_epi32(
+          _mm512_mul_pd(_mm512_add_pd(yd, center_lo), scale_lo));
+      __m256i offset_hi = _mm512_cvttpd_epi32(
+          _mm512_mul_pd(_mm512_add_pd(yd, center_hi), scale_hi));
+      __m512i offset = _mm512_inserti64x4(_mm512_castsi256_si512(offset_lo),
+                                          offset_hi, 1);
+      offset = _mm512_max_epi32(_mm512_min_epi32(offset, last_row),
+                                _mm512_setzero_si512());
+      __m512i index = _mm512_add_epi32(base, offset);
+      __m512i texel =
+          _mm512_mask_i32gather_epi32(color, wall, index, texels, 4);
+      __m512i pixel = _mm512_add_epi32(texel, shade);
+      pixel = _mm512_mask_blend_epi32(above, pixel, ceiling);
+      pixel = _mm512_mask_blend_epi32(below, pixel, floor_color);
+      store_columns_avx512(out + y * strips->pitch, pixel, strips->stride);
+    }
+    for (; y < strips->height; y++)
+      store_columns_avx512(out + y * strips->pitch, floor_color,
+                           strips->stride);
+  }
+  draw_walls_scalar(color_buffer, texels, strips, x, last);
+}
+#endif
+
+/* The window blends a pixel over black by its alpha. Every wall texture is
+ * opaque, so a strip's alpha is 0xFF plus its shade, wrapping as the add
+ * into the pixel does. Observations scale each channel by that alpha out of
+ * 256, counting 0xFF as 256 so ceiling and floor keep their colors; every
+ * kernel variant weighs the same way, to the same bytes. */
+#define OBSERVE_UNSHADED 256
+
+static inline uint32_t strip_weight(const WallStrips *strips, int x) {
+  uint32_t alpha = ((strips->shade[x] >> 24) + 0xFF) & 0xFF;
+  return alpha + (alpha >> 7);
+}
+
+static inline uint8_t weigh(uint32_t channel, uint32_t weight) {
+  return channel * weight >> 8;
+}
+
+/* the texel row column x samples at row y, as the vector kernels work it
+ * out: observations are mostly drawn without scaler tables */
+static inline int strip_texel_row(const WallStrips *strips, int x, int y) {
+  int row = (int)((y + strips->center[x]) * strips->scale[x]);
+  return row < 0 ? 0 : row > strips->last[x] ? strips->last[x] : row;
+}
+
+/* column x of a gray observation, from the atlas' luma, row y at
+ * out[y * pitch + x] */
+static inline void observe_strip_gray(uint8_t *out, const uint8_t *luma,
+                                      const WallStrips *strips, int x) {
+  int pitch = strips->pitch;
+  int y_start = strips->y_start[x];
+  int y_end = strips->y_end[x];
+  uint32_t weight = strip_weight(strips, x);
+  out += x;
+  for (int y = 0; y < y_start; y++)
+    out[y * pitch] = texture_luma(WALL_CEILING_COLOR);
+  if (strips->texels[x] >= 0) {
+    const uint8_t *column = luma + strips->texels[x];
+    for (int y = y_start; y < y_end; y++)
+      out[y * pitch] = weigh(column[strip_texel_row(strips, x, y)], weight);
+  } else {
+    uint8_t flat = weigh(texture_luma(strips->color[x]), weight);
+    for (int y = y_start; y < y_end; y++)
+      out[y * pitch] = flat;
+  }
+  for (int y = y_end; y < strips->height; y++)
+    out[y * pitch] = texture_luma(WALL_FLOOR_COLOR);
+}
+
+static inline void put_rgb(uint8_t *pixel, uint32_t color, uint32_t weight) {
+  pixel[0] = weigh(color & 0xFF, weight);
+  pixel[1] = weigh(color >> 8 & 0xFF, weight);
+  pixel[2] = weigh(color >> 16 & 0xFF, weight);
+}
+
+/* column x of an RGB observation */
+static inline void observe_strip_rgb(uint8_t *out, const uint32_t *texels,
+                                     const WallStrips *strips, int x) {
+  size_t pitch = 3 * (size_t)strips->pitch;
+  int y_start = strips->y_start[x];
+  int y_end = strips->y_end[x];
+  uint32_t weight = strip_weight(strips, x);
+  out += 3 * (size_t)x;
+  for (int y = 0; y < y_start; y++)
+    put_rgb(out + y * pitch, WALL_CEILING_COLOR, OBSERVE_UNSHADED);
+  if (strips->texels[x] >= 0) {
+    const uint32_t *column = texels + strips->texels[x];
+    for (int y = y_start; y < y_end; y++)
+      put_rgb(out + y * pitch, column[strip_texel_row(strips, x, y)], weight);
+  } else {
+    for (int y = y_start; y < y_end; y++)
+      put_rgb(out + y * pitch, strips->color[x], weight);
+  }
+  for (int y = y_end; y < strips->height; y++)
+    put_rgb(out + y * pitch, WALL_FLOOR_COLOR, OBSERVE_UNSHADED);
+}
+
+/* columns [first, last) of an observation one at a time, top to bottom */
+static void observe_walls_gray_scalar(uint8_t *out, const uint8_t *luma,
+                                      const WallStrips *strips, int first,
+                                      int last) {
+  for (int x = first; x < last; x++)
+    observe_strip_gray(out, luma, strips, x);
+}
+
+static void observe_walls_rgb_scalar(uint8_t *out, const uint32_t *texels,
+                                     const WallStrips *strips, int first,
+                                     int last) {
+  for (int x = first; x < last; x++)
+    observe_strip_rgb(out, texels, strips, x);
+}
+
+#if defined(CPU_X86_SIMD)
+/* texture_luma() of 8 colors */
+CPU_TARGET("avx2")
+static inline __m256i luma_avx2(__m256i color) {
+  __m256i byte = _mm256_set1_epi32(0xFF);
+  __m256i r = _mm256_and_si256(color, byte);
+  __m256i g = _mm256_and_si256(_mm256_srli_epi32(color, 8), byte);
+  __m256i b = _mm256_and_si256(_mm256_srli_epi32(color, 16), byte);
+  __m256i sum = _mm256_add_epi32(
+      _mm256_add_epi32(_mm256_mullo_epi32(r, _mm256_set1_epi32(77)),
+                       _mm256_mullo_epi32(g, _mm256_set1_epi32(150))),
+      _mm256_add_epi32(_mm256_mullo_epi32(b, _mm256_set1_epi32(29)),
+                       _mm256_set1_epi32(128)));
+  return _mm256_srli_epi32(sum, 8);
+}
+
+/* strip_weight() of 8 columns */
+CPU_TARGET("avx2")
+static inline __m256i weight_avx2(__m256i shade) {
+  __m256i byte = _mm256_set1_epi32(0xFF);
+  __m256i alpha = _mm256_and_si256(
+      _mm256_add_epi32(_mm256_srli_epi32(shade, 24), byte), byte);
+  return _mm256_add_epi32(alpha, _mm256_srli_epi32(alpha, 7));
+}
+
+/* weigh() of every channel of 8 pixels; the products of two channels a
+ * byte apart do not reach each other */
+CPU_TARGET("avx2")
+static inline __m256i weigh_avx2(__m256i pixels, __m256i weight) {
+  __m256i rb = _mm256_and_si256(pixels, _mm256_set1_epi32(0x00FF00FF));
+  __m256i g = _mm256_and_si256(pixels, _mm256_set1_epi32(0x0000FF00));
+  rb = _mm256_srli_epi32(_mm256_mullo_epi32(rb, weight), 8);
+  g = _mm256_srli_epi32(_mm256_mullo_epi32(g, weight), 8);
+  return _mm256_or_si256(
+      _mm256_and_si256(rb, _mm256_set1_epi32(0x00FF00FF)),
+      _mm256_and_si256(g, _mm256_set1_epi32(0x0000FF00)));
+}
+
+/* the low byte of each of 8 lanes, to 8 bytes at out */
+CPU_TARGET("avx2")
+static inline void store_gray8(uint8_t *out, __m256i pixels) {
+  __m256i packed = _mm256_shuffle_epi8(
+      pixels, _mm256_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                               -1, -1, -1, 0, 4, 8, 12, -1, -1, -1, -1, -1, -1,
+                               -1, -1, -1, -1, -1, -1));
+  packed = _mm256_permutevar8x32_epi32(
+      packed, _mm256_setr_epi32(0, 4, 1, 2, 3, 5, 6, 7));
+  _mm_storel_epi64((__m128i *)out, _mm256_castsi256_si128(packed));
+}
+
+/* the red, green and blue bytes of 8 pixels, to 24 bytes at out. The store
+ * is masked: past them may be columns another job draws. */
+CPU_TARGET("avx2")
+static inline void store_rgb8(uint8_t *out, __m256i pixels) {
+  __m256i packed = _mm256_shuffle_epi8(
+      pixels, _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1,
+                               -1, -1, 0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14,
+                               -1, -1, -1, -1));
+  packed = _mm256_permutevar8x32_epi32(
+      packed, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+  _mm256_maskstore_epi32((int *)out,
+                         _mm256_setr_epi32(-1, -1, -1, -1, -1, -1, 0, 0),
+                         packed);
+}
+
+/* clamp((int)((y + center) * scale), 0, last) of 8 columns, the row of
+ * their texel columns row y samples */
+CPU_TARGET("avx2")
+static inline __m256i texel_rows_avx2(int y, __m256d center_lo,
+                                      __m256d center_hi, __m256d scale_lo,
+                                      __m256d scale_hi, __m256i last) {
+  __m256d yd = _mm256_set1_pd(y);
+  __m128i offset_lo = _mm256_cvttpd_epi32(
+      _mm256_mul_pd(_mm256_add_pd(yd, center_lo), scale_lo));
+  __m128i offset_hi = _mm256_cvttpd_epi32(
+      _mm256_mul_pd(_mm256_add_pd(yd, center_hi), scale_hi));
+  return _mm256_max_epi32(
+      _mm256_min_epi32(_mm256_set_m128i(offset_hi, offset_lo), last),
+      _mm256_setzero_si256());
+}
+
+/* as draw_walls_avx2, gathering a byte of luma per pixel */
+CPU_TARGET("avx2")
+static void observe_walls_gray_avx2(uint8_t *out, const uint8_t *luma,
+                                    const WallStrips *strips, int first,
+                                    int last) {
+  __m256i ceiling = _mm256_set1_epi32(texture_luma(WALL_CEILING_COLOR));
+  __m256i floor_luma = _mm256_set1_epi32(texture_luma(WALL_FLOOR_COLOR));
+  __m128i ceiling_row = _mm_set1_epi8(texture_luma(WALL_CEILING_COLOR));
+  __m128i floor_row = _mm_set1_epi8(texture_luma(WALL_FLOOR_COLOR));
+  __m256i no_texture = _mm256_set1_epi32(-1);
+  __m256i byte = _mm256_set1_epi32(0xFF);
+  int x = first;
+  for (; x + 8 <= last; x += 8) {
+    __m256i y_start =
+        _mm256_loadu_si256((const __m256i *)(strips->y_start + x));
+    __m256i y_end = _mm256_loadu_si256((const __m256i *)(strips->y_end + x));
+    __m256i base = _mm256_loadu_si256((const __m256i *)(strips->texels + x));
+    __m256i last_row = _mm256_loadu_si256((const __m256i *)(strips->last + x));
+    __m256d center_lo = _mm256_loadu_pd(strips->center + x);
+    __m256d center_hi = _mm256_loadu_pd(strips->center + x + 4);
+    __m256d scale_lo = _mm256_loadu_pd(strips->scale + x);
+    __m256d scale_hi = _mm256_loadu_pd(strips->scale + x + 4);
+    __m256i flat = luma_avx2(
+        _mm256_loadu_si256((const __m256i *)(strips->color + x)));
+    __m256i weight = weight_avx2(
+        _mm256_loadu_si256((const __m256i *)(strips->shade + x)));
+    __m256i textured = _mm256_cmpgt_epi32(base, no_texture);
+    int top, bottom;
+    wall_group_bounds(strips, x, 8, &top, &bottom);
+
+    uint8_t *column = out + x;
+    int y = 0;
+    for (; y < top; y++)
+      _mm_storel_epi64((__m128i *)(column + y * strips->pitch), ceiling_row);
+    for (; y < bottom; y++) {
+      __m256i row = _mm256_set1_epi32(y);
+      __m256i above = _mm256_cmpgt_epi32(y_start, row);
+      __m256i below = _mm256_xor_si256(_mm256_cmpgt_epi32(y_end, row),
+                                       _mm256_set1_epi32(-1));
+      __m256i wall = _mm256_andnot_si256(_mm256_or_si256(above, below),
+                                         textured);
+      __m256i index = _mm256_add_epi32(
+          base, texel_rows_avx2(y, center_lo, center_hi, scale_lo, scale_hi,
+                                last_row));
+      __m256i texel = _mm256_and_si256(
+          _mm256_mask_i32gather_epi32(flat, (const int *)luma, index, wall, 1),
+          byte);
+      __m256i pixel =
+          _mm256_srli_epi32(_mm256_mullo_epi32(texel, weight), 8);
+      pixel = _mm256_blendv_epi8(pixel, ceiling, above);
+      pixel = _mm256_blendv_epi8(pixel, floor_luma, below);
+      store_gray8(column + y * strips->pitch, pixel);
+    }
+    for (; y < strips->height; y++)
+      _mm_storel_epi64((__m128i *)(column + y * strips->pitch), floor_row);
+  }
+  observe_walls_gray_scalar(out, luma, strips, x, last);
+}
+
+/* as draw_walls_avx2, weighing the texels and dropping their alpha */
+CPU_TARGET("avx2")
+static void observe_walls_rgb_avx2(uint8_t *out, const uint32_t *texels,
+                                   const WallStrips *strips, int first,
+                                   int last) {
+  __m256i ceiling = _mm256_set1_epi32(WALL_CEILING_COLOR);
+  __m256i floor_color = _mm256_set1_epi32(WALL_FLOOR_COLOR);
+  __m256i no_texture = _mm256_set1_epi32(-1);
+  size_t pitch = 3 * (size_t)strips->pitch;
+  int x = first;
+  for (; x + 8 <= last; x += 8) {
+    __m256i y_start =
+        _mm256_loadu_si256((const __m256i *)(strips->y_start + x));
+    __m256i y_end = _mm256_loadu_si256((const __m256i *)(strips->y_end + x));
+    __m256i base = _mm256_loadu_si256((const __m256i *)(strips->texels + x));
+    __m256i last_row = _mm256_loadu_si256((const __m256i *)(strips->last + x));
+    __m256d center_lo = _mm256_loadu_pd(strips->center + x);
+    __m256d center_hi = _mm256_loadu_pd(strips->center + x + 4);
+    __m256d scale_lo = _mm256_loadu_pd(strips->scale + x);
+    __m256d scale_hi = _mm256_loadu_pd(strips->scale + x + 4);
+    __m256i color = _mm256_loadu_si256((const __m256i *)(strips->color + x));
+    __m256i weight = weight_avx2(
+        _mm256_loadu_si256((const __m256i *)(strips->shade + x)));
+    __m256i textured = _mm256_cmpgt_epi32(base, no_texture);
+    int top, bottom;
+    wall_group_bounds(strips, x, 8, &top, &bottom);
+
+    uint8_t *column = out + 3 * (size_t)x;
+    int y = 0;
+    for (; y < top; y++)
+      store_rgb8(column + y * pitch, ceiling);
+    for (; y < bottom; y++) {
+      __m256i row = _mm256_set1_epi32(y);
+      __m256i above = _mm256_cmpgt_epi32(y_start, row);
+      __m256i below = _mm256_xor_si256(_mm256_cmpgt_epi32(y_end, row),
+                                       _mm256_set1_epi32(-1));
+      __m256i wall = _mm256_andnot_si256(_mm256_or_si256(above, below),
+                                         textured);
+      __m256i index = _mm256_add_epi32(
+          base, texel_rows_avx2(y, center_lo, center_hi, scale_lo, scale_hi,
+                                last_row));
+      __m256i texel = _mm256_mask_i32gather_epi32(color, (const int *)texels,
+                                                  index, wall, 4);
+      __m256i pixel = weigh_avx2(texel, weight);
+      pixel = _mm256_blendv_epi8(pixel, ceiling, above);
+      pixel = _mm256_blendv_epi8(pixel, floor_color, below);
+      store_rgb8(column + y * pitch, pixel);
+    }
+    for (; y < strips->height; y++)
+      store_rgb8(column + y * pitch, floor_color);
+  }
+  observe_walls_rgb_scalar(out, texels, strips, x, last);
+}
+
+/* texture_luma() of 16 colors */
+CPU_TARGET("avx512f")
+static inline __m512i luma_avx512(__m512i color) {
+  __m512i byte = _mm512_set1_epi32(0xFF);
+  __m512i r = _mm512_and_si512(color, byte);
+  __m512i g = _mm512_and_si512(_mm512_srli_epi32(color, 8), byte);
+  __m512i b = _mm512_and_si512(_mm512_srli_epi32(color, 16), byte);
+  __m512i sum = _mm512_add_epi32(
+      _mm512_add_epi32(_mm512_mullo_epi32(r, _mm512_set1_epi32(77)),
+                       _mm512_mullo_epi32(g, _mm512_set1_epi32(150))),
+      _mm512_add_epi32(_mm512_mullo_epi32(b, _mm512_set1_epi32(29)),
+                       _mm512_set1_epi32(128)));
+  return _mm512_srli_epi32(sum, 8);
+}
+
+/* strip_weight() of 16 columns */
+CPU_TARGET("avx512f")
+static inline __m512i weight_avx512(__m512i shade) {
+  __m512i byte = _mm512_set1_epi32(0xFF);
+  __m512i alpha = _mm512_and_si512(
+      _mm512_add_epi32(_mm512_srli_epi32(shade, 24), byte), byte);
+  return _mm512_add_epi32(alpha, _mm512_srli_epi32(alpha, 7));
+}
+
+/* as weigh_avx2(), 16 pixels */
+CPU_TARGET("avx512f")
+static inline __m512i weigh_avx512(__m512i pixels, __m512i weight) {
+  __m512i rb = _mm512_and_si512(pixels, _mm512_set1_epi32(0x00FF00FF));
+  __m512i g = _mm512_and_si512(pixels, _mm512_set1_epi32(0x0000FF00));
+  rb = _mm512_srli_epi32(_mm512_mullo_epi32(rb, weight), 8);
+  g = _mm512_srli_epi32(_mm512_mullo_epi32(g, weight), 8);
+  return _mm512_or_si512(
+      _mm512_and_si512(rb, _mm512_set1_epi32(0x00FF00FF)),
+      _mm512_and_si512(g, _mm512_set1_epi32(0x0000FF00)));
+}
+
+/* as texel_rows_avx2(), 16 columns */
+CPU_TARGET("avx512f")
+static inline __m512i texel_rows_avx512(int y, __m512d center_lo,
+                                        __m512d center_hi, __m512d scale_lo,
+                                        __m512d scale_hi, __m512i last) {
+  __m512d yd = _mm512_set1_pd(y);
+  __m256i offset_lo = _mm512_cvttpd_epi32(
+      _mm512_mul_pd(_mm512_add_pd(yd, center_lo), scale_lo));
+  __m256i offset_hi = _mm512_cvttpd_epi32(
+      _mm512_mul_pd(_mm512_add_pd(yd, center_hi), scale_hi));
+  __m512i offset = _mm512_inserti64x4(_mm512_castsi256_si512(offset_lo),
+                                      offset_hi, 1);
+  return _mm512_max_epi32(_mm512_min_epi32(offset, last),
+                          _mm512_setzero_si512());
+}
+
+/* as the AVX2 variant, 16 columns per pass with mask registers */
+CPU_TARGET("avx512f")
+static void observe_walls_gray_avx512(uint8_t *out, const uint8_t *luma,
+                                      const WallStrips *strips, int first,
+                                      int last) {
+  __m512i ceiling = _mm512_set1_epi32(texture_luma(WALL_CEILING_COLOR));
+  __m512i floor_luma = _mm512_set1_epi32(texture_luma(WALL_FLOOR_COLOR));
+  __m128i ceiling_row = _mm_set1_epi8(texture_luma(WALL_CEILING_COLOR));
+  __m128i floor_row = _mm_set1_epi8(texture_luma(WALL_FLOOR_COLOR));
+  __m512i byte = _mm512_set1_epi32(0xFF);
+  int x = first;
+  for (; x + 16 <= last; x += 16) {
+    __m512i y_start = _mm512_loadu_si512(strips->y_start + x);
+    __m512i y_end = _mm512_loadu_si512(strips->y_end + x);
+    __m512i base = _mm512_loadu_si512(strips->texels + x);
+    __m512i last_row = _mm512_loadu_si512(strips->last + x);
+    __m512d center_lo = _mm512_loadu_pd(strips->center + x);
+    __m512d center_hi = _mm512_loadu_pd(strips->center + x + 8);
+    __m512d scale_lo = _mm512_loadu_pd(strips->scale + x);
+    __m512d scale_hi = _mm512_loadu_pd(strips->scale + x + 8);
+    __m512i flat = luma_avx512(_mm512_loadu_si512(strips->color + x));
+    __m512i weight = weight_avx512(_mm512_loadu_si512(strips->shade + x));
+    __mmask16 textured = _mm512_cmpge_epi32_mask(base, _mm512_setzero_si512());
+    int top, bottom;
+    wall_group_bounds(strips, x, 16, &top, &bottom);
+
+    uint8_t *column = out + x;
+    int y = 0;
+    for (; y < top; y++)
+      _mm_storeu_si128((__m128i *)(column + y * strips->pitch), ceiling_row);
+    for (; y < bottom; y++) {
+      __m512i row = _mm512_set1_epi32(y);
+      __mmask16 above = _mm512_cmpgt_epi32_mask(y_start, row);
+      __mmask16 below = _mm512_cmple_epi32_mask(y_end, row);
+      __mmask16 wall = ~(above | below) & textured;
+      __m512i index = _mm512_add_epi32(
+          base, texel_rows_avx512(y, center_lo, center_hi, scale_lo,
+                                  scale_hi, last_row));
+      __m512i texel = _mm512_and_si512(
+          _mm512_mask_i32gather_epi32(flat, wall, index, luma, 1), byte);
+      __m512i pixel =
+          _mm512_srli_epi32(_mm512_mullo_epi32(texel, weight), 8);
+      pixel = _mm512_mask_blend_epi32(above, pixel, ceiling);
+      pixel = _mm512_mask_blend_epi32(below, pixel, floor_luma);
+      _mm_storeu_si128((__m128i *)(column + y * strips->pitch),
+                       _mm512_cvtepi32_epi8(pixel));
+    }
+    for (; y < strips->height; y++)
+      _mm_storeu_si128((__m128i *)(column + y * strips->pitch), floor_row);
+  }
+  observe_walls_gray_scalar(out, luma, strips, x, last);
+}
+
+/* With the scaler tables every texel row of a column is known up front, and
+ * a texture column up to 128 texels tall fits in two registers, so gray
+ * observations need no gathers: 64 rows of a column come from one byte
+ * permute, and 16 such columns are turned into rows in registers. */
+#define OBSERVE_PERMUTE_ROWS 128
+
+/* a mask of the first n of 64 bytes */
+static inline uint64_t first_bytes(int n) {
+  return n <= 0 ? 0 : n >= 64 ? ~(uint64_t)0 : ((uint64_t)1 << n) - 1;
+}
+
+/* 64 bytes, each times weight out of 256 */
+CPU_TARGET("avx512f,avx512bw")
+static inline __m512i weigh_bytes_avx512(__m512i bytes, __m512i weight) {
+  __m512i lo = _mm512_cvtepu8_epi16(_mm512_castsi512_si256(bytes));
+  __m512i hi = _mm512_cvtepu8_epi16(_mm512_extracti64x4_epi64(bytes, 1));
+  lo = _mm512_srli_epi16(_mm512_mullo_epi16(lo, weight), 8);
+  hi = _mm512_srli_epi16(_mm512_mullo_epi16(hi, weight), 8);
+  return _mm512_inserti64x4(_mm512_castsi256_si512(_mm512_cvtepi16_epi8(lo)),
+                            _mm512_cvtepi16_epi8(hi), 1);
+}
+
+/* rows [y, y + 64) of column x of a gray observation, a byte a row, from a
+ * texture at most OBSERVE_PERMUTE_ROWS tall */
+CPU_TARGET("avx512f,avx512bw,avx512vbmi")
+static inline __m512i observe_column_vbmi(const uint8_t *luma,
+                                          const WallStrips *strips, int x,
+                                          int y) {
+  int32_t texels = strips->texels[x];
+  int rows = strips->last[x] + 1;
+  uint64_t above = first_bytes(strips->y_start[x] - y);
+  uint64_t wall = first_bytes(strips->y_end[x] - y) & ~above;
+  __m512i pixel = _mm512_mask_blend_epi8(
+      above, _mm512_set1_epi8(texture_luma(WALL_FLOOR_COLOR)),
+      _mm512_set1_epi8(texture_luma(WALL_CEILING_COLOR)));
+  if (wall == 0)
+    return pixel;
+  /* a flat color permutes to itself */
+  __m512i lo = _mm512_set1_epi8(texture_luma(strips->color[x]));
+  __m512i hi = lo;
+  __m512i index = _mm512_setzero_si512();
+  if (texels >= 0) {
+    lo = _mm512_maskz_loadu_epi8(first_bytes(rows), luma + texels);
+    if (rows > 64)
+      hi = _mm512_maskz_loadu_epi8(first_bytes(rows - 64), luma + texels + 64);
+    /* the table only has the wall's rows */
+    const uint16_t *table = strips->table + strips->rows[x] + y;
+    __m256i index_lo = _mm512_cvtepi16_epi8(
+        _mm512_maskz_loadu_epi16((__mmask32)wall, table));
+    __m256i index_hi = _mm512_cvtepi16_epi8(
+        _mm512_maskz_loadu_epi16((__mmask32)(wall >> 32), table + 32));
+    index =
+        _mm512_inserti64x4(_mm512_castsi256_si512(index_lo), index_hi, 1);
+  }
+  __m512i weight = _mm512_set1_epi16(strip_weight(strips, x));
+  __m512i texel =
+      weigh_bytes_avx512(_mm512_permutex2var_epi8(lo, index, hi), weight);
+  return _mm512_mask_blend_epi8(wall, pixel, texel);
+}
+
+/* columns [x, x + columns) of a gray observation, at most 16. Rows with
+ * wall in any of them go 64 at a time: four rounds of interleaving register
+ * i with register i + 8 turn the 16 by 16 bytes in each 128-bit lane of the
+ * 16 columns' registers around, so lane k of register i ends up as row
+ * 16 * k + i. */
+CPU_TARGET("avx512f,avx512bw,avx512vl,avx512vbmi")
+static void observe_gray_group_vbmi(uint8_t *out, const uint8_t *luma,
+                                    const WallStrips *strips, int x,
+                                    int columns) {
+  __mmask16 lanes = (__mmask16)((1u << columns) - 1);
+  __m128i ceiling = _mm_set1_epi8(texture_luma(WALL_CEILING_COLOR));
+  __m128i floor_row = _mm_set1_epi8(texture_luma(WALL_FLOOR_COLOR));
+  size_t pitch = strips->pitch;
+  int top, bottom;
+  wall_group_bounds(strips, x, columns, &top, &bottom);
+  for (int y = 0; y < top; y++)
+    _mm_mask_storeu_epi8(out + y * pitch + x, lanes, ceiling);
+  for (int y = top; y < bottom; y += 64) {
+    __m512i rows[16], next[16];
+    for (int c = 0; c < 16; c++)
+      rows[c] = c < columns ? observe_column_vbmi(luma, strips, x + c, y)
+                            : _mm512_setzero_si512();
+    for (int round = 0; round < 4; round++) {
+      for (int i = 0; i < 8; i++) {
+        next[2 * i] = _mm512_unpacklo_epi8(rows[i], rows[i + 8]);
+        next[2 * i + 1] = _mm512_unpackhi_epi8(rows[i], rows[i + 8]);
+      }
+      memcpy(rows, next, sizeof(rows));
+    }
+    for (int i = 0; i < 16; i++) {
+      __m128i lane[4] = {_mm512_castsi512_si128(rows[i]),
+                         _mm512_extracti32x4_epi32(rows[i], 1),
+                         _mm512_extracti32x4_epi32(rows[i], 2),
+                         _mm512_extracti32x4_epi32(rows[i], 3)};
+      for (int k = 0; k < 4; k++) {
+        int row = y + 16 * k + i;
+        if (row < bottom)
+          _mm_mask_storeu_epi8(out + row * pitch + x, lanes, lane[k]);
+      }
+    }
+  }
+  for (int y = bottom; y < strips->height; y++)
+    _mm_mask_storeu_epi8(out + y * pitch + x, lanes, floor_row);
+}
+
+/* as the AVX-512 F variant, without gathers where the strips have scaler
+ * tables and the textures are short enough */
+CPU_TARGET("avx512f,avx512bw,avx512vl,avx512vbmi")
+static void observe_walls_gray_vbmi(uint8_t *out, const uint8_t *luma,
+                                    const WallStrips *strips, int first,
+                                    int last) {
+  if (!strips->tables) {
+    observe_walls_gray_avx512(out, luma, strips, first, last);
+    return;
+  }
+  for (int x = first; x < last; x += 16) {
+    int columns = last - x < 16 ? last - x : 16;
+    bool short_textures = true;
+    for (int c = 0; c < columns; c++)
+      short_textures &= strips->last[x + c] < OBSERVE_PERMUTE_ROWS;
+    if (short_textures)
+      observe_gray_group_vbmi(out, luma, strips, x, columns);
+    else
+      observe_walls_gray_avx512(out, luma, strips, x, x + columns);
+  }
+}
+
+CPU_TARGET("avx512f")
+static void observe_walls_rgb_avx512(uint8_t *out, const uint32_t *texels,
+                                     const WallStrips *strips, int first,
+                                     int last) {
+  __m512i ceiling = _mm512_set1_epi32(WALL_CEILING_COLOR);
+  __m512i floor_color = _mm512_set1_epi32(WALL_FLOOR_COLOR);
+  size_t pitch = 3 * (size_t)strips->pitch;
+  int x = first;
+  for (; x + 16 <= last; x += 16) {
+    __m512i y_start = _mm512_loadu_si512(strips->y_start + x);
+    __m512i y_end = _mm512_loadu_si512(strips->y_end + x);
+    __m512i base = _mm512_loadu_si512(strips->texels + x);
+    __m512i last_row = _mm512_loadu_si512(strips->last + x);
+    __m512d center_lo = _mm512_loadu_pd(strips->center + x);
+    __m512d center_hi = _mm512_loadu_pd(strips->center + x + 8);
+    __m512d scale_lo = _mm512_loadu_pd(strips->scale + x);
+    __m512d scale_hi = _mm512_loadu_pd(strips->scale + x + 8);
+    __m512i color = _mm512_loadu_si512(strips->color + x);
+    __m512i weight = weight_avx512(_mm512_loadu_si512(strips->shade + x));
+    __mmask16 textured = _mm512_cmpge_epi32_mask(base, _mm512_setzero_si512());
+    int top, bottom;
+    wall_group_bounds(strips, x, 16, &top, &bottom);
+
+    uint8_t *column = out + 3 * (size_t)x;
+    int y = 0;
+    for (; y < top; y++) {
+      store_rgb8(column + y * pitch, _mm512_castsi512_si256(ceiling));
+      store_rgb8(column + y * pitch + 24, _mm512_castsi512_si256(ceiling));
+    }
+    for (; y < bottom; y++) {
+      __m512i row = _mm512_set1_epi32(y);
+      __mmask16 above = _mm512_cmpgt_epi32_mask(y_start, row);
+      __mmask16 below = _mm512_cmple_epi32_mask(y_end, row);
+      __mmask16 wall = ~(above | below) & textured;
+      __m512i index = _mm512_add_epi32(
+          base, texel_rows_avx512(y, center_lo, center_hi, scale_lo,
+                                  scale_hi, last_row));
+      __m512i texel =
+          _mm512_mask_i32gather_epi32(color, wall, index, texels, 4);
+      __m512i pixel = weigh_avx512(texel, weight);
+      pixel = _mm512_mask_blend_epi32(above, pixel, ceiling);
+      pixel = _mm512_mask_blend_epi32(below, pixel, floor_color);
+      store_rgb8(column + y * pitch, _mm512_castsi512_si256(pixel));
+      store_rgb8(column + y * pitch + 24,
+                 _mm512_extracti64x4_epi64(pixel, 1));
+    }
+    for (; y < strips->height; y++) {
+      store_rgb8(column + y * pitch, _mm512_castsi512_si256(floor_color));
+      store_rgb8(column + y * pitch + 24,
+                 _mm512_castsi512_si256(floor_color));
+    }
+  }
+  observe_walls_rgb_scalar(out, texels, strips, x, last);
+}
+#endif
+
+static void (*observe_walls_gray)(uint8_t *out, const uint8_t *luma,
+                                  const WallStrips *strips, int first,
+                                  int last) = observe_walls_gray_scalar;
+static void (*observe_walls_rgb)(uint8_t *out, const uint32_t *texels,
+                                 const WallStrips *strips, int first,
+                                 int last) = observe_walls_rgb_scalar;
+
+static void (*draw_walls)(Uint32 *color_buffer, const uint32_t *texels,
+                          const WallStrips *strips, int first,
+                          int last) = draw_walls_bands;
+
+static const char *observation_variant = "scalar";
+
+CpuIsa wall_use_isa(CpuIsa limit) {
+#if defined(CPU_X86_SIMD)
+  if (limit >= CPU_ISA_AVX512) {
+    draw_walls = draw_walls_avx512;
+    __builtin_cpu_init();
+    bool permutes = __builtin_cpu_supports("avx512bw") &&
+                    __builtin_cpu_supports("avx512vl") &&
+                    __builtin_cpu_supports("avx512vbmi");
+    observe_walls_gray =
+        permutes ? observe_walls_gray_vbmi : observe_walls_gray_avx512;
+    observe_walls_rgb = observe_walls_rgb_avx512;
+    observation_variant = permutes ? "avx512 (gray avx512vbmi)" : "avx512";
+    return CPU_ISA_AVX512;
+  }
+  if (limit >= CPU_ISA_AVX2) {
+    draw_walls = draw_walls_avx2;
+    observe_walls_gray = observe_walls_gray_avx2;
+    observe_walls_rgb = observe_walls_rgb_avx2;
+    observation_variant = "avx2";
+    return CPU_ISA_AVX2;
+  }
+  /* without gathers, small observations are drawn a column at a time */
+  observe_walls_gray = observe_walls_gray_scalar;
+  observe_walls_rgb = observe_walls_rgb_scalar;
+  observation_variant = "scalar";
+  if (limit >= CPU_ISA_SSE2) {
+    draw_walls = draw_walls_bands_sse2;
+    return CPU_ISA_SSE2;
+  }
+#endif
+  (void)limit;
+  draw_walls = draw_walls_bands;
+  return CPU_ISA_SCALAR;
+}
+
+const char *wall_observation_variant(void) { return observation_variant; }
+
+static void draw_walls_job(void *data, int first, int last) {
+  WallJob *job = data;
+  draw_walls(job->color_buffer, job->texels, &job->strips, first, last);
+}
+
+/* work out what every column shows, into a job for the kernels; without
+ * tables the strips have no scaler rows */
+static WallJob *wall_job_prepare(Renderer *renderer, int height,
+                                 const RayBuffer *rays, Player *player,
+                                 Arena *arena, bool tables) {
+  const TextureAtlas *atlas = renderer->atlas;
+  ScalerCache *scaler = renderer->scaler;
+  WallJob *job = arena_alloc(arena, sizeof(WallJob));
+  job->color_buffer = NULL;
+  job->texels = atlas->texels;
+  job->out = NULL;
+  job->luma = atlas->luma;
+  job->strips = wall_strips_alloc(arena, rays->count, height);
+  WallStrips *strips = &job->strips;
+  scaler_cache_begin_frame(scaler, height);
+  strips->table = scaler_table(scaler);
+  strips->tables = tables;
+  for (int i = 0; i < rays->count; i++) {
+    float distance =
+        rays->distance[i] * cos(rays->angle[i] - player->rotationAngle);
+    float distance_to_projection_plane =
+        (rays->layout.columns / 2.0) / tan(FOV_ANGLE / 2);
+    float wall_strip_height =
+        (TILE_SIZE / distance) * distance_to_projection_plane;
+
+    float shade = wall_strip_height / height;
+    /* strips are drawn at whole heights, each with its own scaler */
+    int strip_height = scaler_height(scaler, wall_strip_height);
+    strips->y_start[i] = scaler_y_start(scaler, strip_height);
+    strips->y_end[i] = scaler_y_end(scaler, strip_height);
+    strips->shade[i] = (int)(0xFF000000 * shade) & (0xFF000000);
+
+    /* the texel column this strip samples, or a flat color for textures
+     * that are unknown or not streamed in yet */
+    const TextureDescriptor *texture =
+        texture_atlas_lookup(atlas, rays->content[i]);
+    strips->color[i] =
+        texture != NULL ? texture->fallback : TEXTURE_MISSING_COLOR;
+    strips->texels[i] = -1;
+    strips->rows[i] = 0;
+    strips->last[i] = 0;
+    strips->center[i] = 0;
+    strips->scale[i] = 0;
+    if (texture != NULL && texture->offset != TEXTURE_NOT_RESIDENT) {
+      int hit = rays->side[i] ? (int)(rays->hitY[i]) : (int)(rays->hitX[i]);
+      int texture_offset_x =
+          TILE_SIZE_IS_POW2 && texture->width_shift != TEXTURE_NO_SHIFT
+              ? tile_offset(hit) << texture->width_shift >> TILE_SHIFT
+              : tile_offset(hit) * texture->width / TILE_SIZE_INT;
+      strips->texels[i] = texture_column(texture, texture_offset_x);
+      if (tables)
+        strips->rows[i] = scaler_rows(scaler, strip_height, texture->height);
+      strips->last[i] = texture->height - 1;
+      strips->center[i] = scaler_center(scaler, strip_height);
+      strips->scale[i] = scaler_scale(strip_height, texture->height);
+    }
+  }
+  return job;
+}
+
+void render_3D_projections(Renderer *renderer, Uint32 *color_buffer,
+                           int height, const RayBuffer *rays, Player *player,
+                           Arena *arena, JobCounter *after, JobCounter *done) {
+  render_3D_projections_strided(renderer, color_buffer, rays->count, 1,
+                                height, rays, player, arena, after, done);
+}
+
+void render_3D_projections_strided(Renderer *renderer, Uint32 *color_buffer,
+                                   int pitch, int stride, int height,
+                                   const RayBuffer *rays, Player *player,
+                                   Arena *arena, JobCounter *after,
+                                   JobCounter *done) {
+  WallJob *job =
+      wall_job_prepare(renderer, height, rays, player, arena, true);
+  job->color_buffer = color_buffer;
+  job->strips.pitch = pitch;
+  job->strips.stride = stride;
+  jobs_for(done, after, draw_walls_job, job, rays->count, WALL_JOB_COLUMNS);
+}
+
+static const char *observation_format_names[] = {"rgba", "rgb", "gray",
+                                                  "depth"};
+
+size_t observation_bytes(ObservationFormat format, int width, int height) {
+  size_t pixels = (size_t)width * height;
+  switch (format) {
+  case OBSERVATION_RGB:
+    return 3 * pixels;
+  case OBSERVATION_GRAY:
+    return pixels;
+  case OBSERVATION_DEPTH:
+    return sizeof(float) * width;
+  default:
+    return sizeof(Uint32) * pixels;
+  }
+}
+
+ObservationFormat observation_format_parse(const char *name) {
+  for (int i = 0; i <= OBSERVATION_DEPTH; i++) {
+    if (strcmp(name, observation_format_names[i]) == 0)
+      return (ObservationFormat)i;
+  }
+  fprintf(stderr,
+          "Error: unknown observation format %s (expected rgba, rgb, gray or "
+          "depth)\n",
+          name);
+  exit(1);
+}
+
+const char *observation_format_name(ObservationFormat format) {
+  return observation_format_names[format];
+}
+
+static void observe_gray_job(void *data, int first, int last) {
+  WallJob *job = data;
+  observe_walls_gray(job->out, job->luma, &job->strips, first, last);
+}
+
+static void observe_rgb_job(void *data, int first, int last) {
+  WallJob *job = data;
+  observe_walls_rgb(job->out, job->texels, &job->strips, first, last);
+}
+
+void render_observation(Renderer *renderer, void *out, ObservationFormat format,
+                        int height, const RayBuffer *rays, Player *player,
+                        Arena *arena, JobCounter *after, JobCounter *done) {
+  if (format == OBSERVATION_RGBA) {
+    render_3D_projections(renderer, out, height, rays, player, arena, after,
+                          done);
+    return;
+  }
+  if (format == OBSERVATION_DEPTH) {
+    memcpy(out, rays->distance, sizeof(float) * rays->count);
+    return;
+  }
+  /* gray observations use the scaler tables where the renderer holds every
+   * one of them already, and finding a column's is only a lookup */
+  WallJob *job = wall_job_prepare(
+      renderer, height, rays, player, arena,
+      format == OBSERVATION_GRAY && renderer->scaler->complete);
+  job->out = out;
+  jobs_for(done, after,
+           format == OBSERVATION_GRAY ? observe_gray_job : observe_rgb_job, job,
+           rays->count, WALL_JOB_COLUMNS);
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include "arena.h"
+#include "cpu.h"
+#include "graphics.h"
+#include "jobs.h"
+#include "player.h"
+#include "ray.h"
+
+#define WALL_CEILING_COLOR 0xFFA9A9A9
+#define WALL_FLOOR_COLOR 0xFF2F4F4F
+
+/* What render_observation() draws, row by row. The color buffer's pixels
+ * carry each wall's shade in their alpha, which the window blends over
+ * black; the smaller formats are what that blend shows. */
+typedef enum ObservationFormat {
+  OBSERVATION_RGBA = 0, /* 4 bytes a pixel, as the color buffer holds them */
+  OBSERVATION_RGB,      /* 3 bytes a pixel, as the window shows them */
+  OBSERVATION_GRAY,     /* 1 byte a pixel, their luma */
+  OBSERVATION_DEPTH,    /* a float a column, the distance its ray went */
+} ObservationFormat;
+
+/* pick the wall strip variant for the best level up to limit, returns it.
+ * Observations have kernels of their own, picked at the same time: at SSE2
+ * they are scalar, and gray ones use AVX-512 VBMI where the CPU has it. */
+CpuIsa wall_use_isa(CpuIsa limit);
+/* the observation kernels wall_use_isa() picked, for the log */
+const char *wall_observation_variant(void);
+
+/* arena bytes render_3D_projections() takes for count rays and height rows */
+size_t wall_arena_bytes(int count, int height);
+/* draw the ceiling, wall and floor of the column of every ray, side by side
+ * into a buffer one column per ray wide and height rows tall, at most the
+ * renderer's view, with its textures and scalers. Walls are sized for the
+ * view in the rays' layout. Per-column parameters are worked out right away
+ * and allocated from arena; the columns are drawn by jobs in bands, counted
+ * by done and, with after, held back until after has nothing pending. Wait
+ * on done before the next call with the same renderer, which may drop the
+ * scaler tables they draw with. */
+void render_3D_projections(Renderer *renderer, Uint32 *color_buffer,
+                           int height, const RayBuffer *rays, Player *player,
+                           Arena *arena, JobCounter *after, JobCounter *done);
+/* as render_3D_projections(), with column x of the rays at color_buffer +
+ * x * stride of rows pitch pixels apart; the pixels between, stride 2 for
+ * one phase of an interlaced view, are left as they are */
+void render_3D_projections_strided(Renderer *renderer, Uint32 *color_buffer,
+                                   int pitch, int stride, int height,
+                                   const RayBuffer *rays, Player *player,
+                                   Arena *arena, JobCounter *after,
+                                   JobCounter *done);
+
+/* bytes of one observation of width rays and height rows */
+size_t observation_bytes(ObservationFormat format, int width, int height);
+ObservationFormat observation_format_parse(const char *name);
+const char *observation_format_name(ObservationFormat format);
+/* as render_3D_projections(), in format into out. Gray is drawn from the
+ * atlas' luma, so a pixel costs one byte read and one written. A depth
+ * observation is the rays' distances, copied before this returns. */
+void render_observation(Renderer *renderer, void *out, ObservationFormat format,
+                        int height, const RayBuffer *rays, Player *player,
+                        Arena *arena, JobCounter *after, JobCounter *done);